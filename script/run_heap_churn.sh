@@ -0,0 +1,37 @@
+#!/bin/bash
+
+# go to PDSHarness/script
+cd "$( dirname "${BASH_SOURCE[0]}" )"
+# go to PDSHarness
+cd ..
+
+outfile_dir="data"
+THREADS=(1 4 8 12 16 20 24 32 36 40 48 62 72 80 90)
+HEAPS_PER_THREAD=(1 2 4) # MultiQueue's c
+TASK_LENGTH=30 # length of each workload in second
+REPEAT_NUM=3 # number of trials
+
+delete_heap_file(){
+    rm -rf /mnt/pmem/${USER}* /dev/shm/${USER}*
+}
+
+# look rideables and tests up by name, as their indices shift over time.
+index_of(){
+    bin/main -h 2>&1 | grep " : $1\$" | sed 's/^[^0-9]*\([0-9]*\) :.*/\1/'
+}
+
+make clean; make -j
+mkdir -p $outfile_dir
+rideable_idx=$(index_of "PriorityQueue")
+test_idx=$(index_of "HeapChurnTest<string>:eq50dq50:range=1000000:prefill=2000")
+echo "Running priority queue, 50enq 50deq for $TASK_LENGTH seconds"
+echo "thread,ops,ds,test,heaps_per_thread" > $outfile_dir/heap_thread.csv
+for ((i=1; i<=REPEAT_NUM; ++i)); do
+    for threads in "${THREADS[@]}"; do
+        for c in "${HEAPS_PER_THREAD[@]}"; do
+            delete_heap_file
+            ./bin/main -r $rideable_idx -m $test_idx -t $threads -i $TASK_LENGTH -dHeapsPerThread=$c | \
+                sed "s/$/,$c/" | tee -a $outfile_dir/heap_thread.csv
+        done
+    done
+done
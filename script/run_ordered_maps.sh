@@ -0,0 +1,38 @@
+#!/bin/bash
+
+# go to PDSHarness/script
+cd "$( dirname "${BASH_SOURCE[0]}" )"
+# go to PDSHarness
+cd ..
+
+outfile_dir="data"
+THREADS=(1 4 8 12 16 20 24 32 36 40 48 62 72 80 90)
+MAPS=("NataTree" "MontageNataTree" "MontageSkipList" "MontageBTree" "MontageART")
+TESTS=("MapTest<string>:g0p0i50rm50:range=1000000:prefill=500000:op=10000000"
+    "MapTest<string>:g50p0i25rm25:range=1000000:prefill=500000:op=10000000"
+    "MapTest<string>:g90p0i5rm5:range=1000000:prefill=500000:op=10000000")
+REPEAT_NUM=3 # number of trials
+
+delete_heap_file(){
+    rm -rf /mnt/pmem/${USER}* /dev/shm/${USER}*
+}
+
+# look rideables and tests up by name, as their indices shift over time.
+index_of(){
+    bin/main -h 2>&1 | grep " : $1\$" | sed 's/^[^0-9]*\([0-9]*\) :.*/\1/'
+}
+
+make clean; make -j
+mkdir -p $outfile_dir
+echo "thread,ops,ds,test" > $outfile_dir/ordered_maps_thread.csv
+for test in "${TESTS[@]}"; do
+    test_idx=$(index_of "$test")
+    for ((i=1; i<=REPEAT_NUM; ++i)); do
+        for threads in "${THREADS[@]}"; do
+            for map in "${MAPS[@]}"; do
+                delete_heap_file
+                ./bin/main -r $(index_of "$map") -m $test_idx -t $threads | tee -a $outfile_dir/ordered_maps_thread.csv
+            done
+        done
+    done
+done
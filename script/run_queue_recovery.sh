@@ -0,0 +1,37 @@
+#!/bin/bash
+
+# go to PDSHarness/script
+cd "$( dirname "${BASH_SOURCE[0]}" )"
+# go to PDSHarness
+cd ..
+
+outfile_dir="data"
+SIZES=(10000 100000 1000000 10000000) # items enqueued before the crash
+QUEUES=("MontageQueue" "MontageMSQueue")
+REPEAT_NUM=3 # number of trials
+
+delete_heap_file(){
+    rm -rf /mnt/pmem/${USER}* /dev/shm/${USER}*
+}
+
+# look rideables and tests up by name, as their indices shift over time.
+index_of(){
+    bin/main -h 2>&1 | grep " : $1\$" | sed 's/^[^0-9]*\([0-9]*\) :.*/\1/'
+}
+
+make clean; make
+mkdir -p $outfile_dir
+test_idx=$(index_of "QueueRecoverTest")
+echo "size,items,ms,ds" > $outfile_dir/queue_recovery.csv
+for queue in "${QUEUES[@]}"; do
+    rideable_idx=$(index_of "$queue")
+    for size in "${SIZES[@]}"; do
+        for ((i=1; i<=REPEAT_NUM; ++i)); do
+            delete_heap_file
+            echo "$queue: $size items, trial $i"
+            bin/main -r $rideable_idx -m $test_idx -t 1 -dInsCnt=$size | \
+                sed -n "s/^Recovered \([0-9]*\) items in \([0-9]*\)ms$/$size,\1,\2,$queue/p" \
+                >> $outfile_dir/queue_recovery.csv
+        done
+    done
+done
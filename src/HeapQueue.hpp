@@ -10,8 +10,12 @@
 template <class K, class V> class HeapQueue : public virtual Rideable{
 public:
 
+    // Dequeues a value with one of the greatest keys; relaxed
+    // implementations may pick one slightly below the maximum
+    // returns : the value, or nothing if the queue is empty
     virtual optional<V> dequeue(int tid)=0;
 
+    // Enqueues val with priority key; keys need not be unique
     virtual void enqueue(K key, V val, int tid)=0;
 };
 
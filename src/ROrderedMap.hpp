@@ -0,0 +1,17 @@
+#ifndef RORDEREDMAP_HPP
+#define RORDEREDMAP_HPP
+
+#include <functional>
+#include "RMap.hpp"
+
+template <class K, class V> class ROrderedMap : public RMap<K,V>{
+public:
+
+    // Visits the key/value pairs with keys in [lo, hi] in ascending
+    // key order, all as of a single point in time, stopping after
+    // the first limit of them if limit is positive
+    // returns : the number of pairs visited
+    virtual int range(K lo, K hi, int limit, std::function<void(const K&, const V&)> f, int tid)=0;
+};
+
+#endif
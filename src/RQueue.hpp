@@ -21,6 +21,7 @@ limitations under the License.
 #define RQUEUE_HPP
 
 #include <string>
+#include <vector>
 #include "Rideable.hpp"
 
 #include "optional.hpp"
@@ -31,6 +32,31 @@ public:
     virtual optional<V> dequeue(int tid)=0;
 
     virtual void enqueue(V val, int tid)=0;
+
+    // Enqueues vals in order
+    // default falls back to one enqueue per value; overriders may
+    // link the whole batch at once, keeping it contiguous
+    virtual void enqueue_bulk(const std::vector<V>& vals, int tid){
+        for (const V& v : vals){
+            enqueue(v, tid);
+        }
+    }
+
+    // Dequeues up to n values
+    // default falls back to one dequeue per value
+    // returns : the dequeued values, oldest first; fewer than n
+    // means the queue ran empty
+    virtual std::vector<V> dequeue_bulk(int n, int tid){
+        std::vector<V> res;
+        for (int i = 0; i < n; i++){
+            optional<V> v = dequeue(tid);
+            if (!v){
+                break;
+            }
+            res.push_back(*v);
+        }
+        return res;
+    }
 };
 
 #endif   
\ No newline at end of file
@@ -37,7 +37,12 @@
 #include "FriedmanQueue.hpp"
 
 #include "MontageLfHashTable.hpp"
+#include "MontageSOHashTable.hpp"
 #include "MontageNatarajanTree.hpp"
+#include "MontageSkipList.hpp"
+#include "MontageBTree.hpp"
+#include "MontageART.hpp"
+#include "MontageRBTree.hpp"
 
 #include "LockfreeHashTable.hpp"
 #include "PLockfreeHashTable.hpp"
@@ -66,10 +71,13 @@
 #include "GraphTest.hpp"
 
 #include "QueueChurnTest.hpp"
+#include "QueueRecoverTest.hpp"
 #include "HeapChurnTest.hpp"
 #include "SetChurnTest.hpp"
 #include "MapTest.hpp"
 #include "MapChurnTest.hpp"
+#include "MapScanTest.hpp"
+#include "MapMonotonicTest.hpp"
 #include "SyncTest.hpp"
 #ifndef MNEMOSYNE
 #include "RecoverVerifyTest.hpp"
@@ -93,7 +101,6 @@ int main(int argc, char *argv[])
 	/* queues */
 	// gtc.addRideableOption(new MSQueueFactory<string>(), "MSQueue");//transient
 	// gtc.addRideableOption(new FriedmanQueueFactory<string>(), "FriedmanQueue");//comparison
-	// gtc.addRideableOption(new MontageMSQueueFactory<string>(), "MontageMSQueue");
 #if !defined(MNEMOSYNE) and !defined(PRONTO)
 	gtc.addRideableOption(new QueueFactory<string,PLACE_DRAM>(), "TransientQueue<DRAM>");
 	gtc.addRideableOption(new QueueFactory<string,PLACE_NVM>(), "TransientQueue<NVM>");
@@ -113,6 +120,7 @@ int main(int argc, char *argv[])
 	gtc.addRideableOption(new NVMSOFTHashTableFactory<string>(), "NVMSOFT");
 	gtc.addRideableOption(new MontageLfHashTableFactory<string>(), "MontageLfHashTable");
 	gtc.addRideableOption(new MontageNatarajanTreeFactory<string>(), "MontageNataTree");
+	gtc.addRideableOption(new MontageSOHashTableFactory<string>(), "MontageSOHashTable");
 
 	/* graphs */
 	gtc.addRideableOption(new TGraphFactory<numVertices, meanEdgesPerVertex, vertexLoad>(), "TGraph");
@@ -122,6 +130,15 @@ int main(int argc, char *argv[])
 
     // gtc.addRideableOption(new MontageGraphFactory<3072627>(), "Orkut");
     gtc.addRideableOption(new TGraphFactory<3076727, 0, 100>(), "TransientOrkut");
+
+	/* added later, kept last so that the indices above stay put */
+	gtc.addRideableOption(new MontageMSQueueFactory<string>(), "MontageMSQueue");
+	gtc.addRideableOption(new PriorityQueueFactory<string>(), "PriorityQueue");
+	gtc.addRideableOption(new MontageSkipListFactory<string>(), "MontageSkipList");
+	gtc.addRideableOption(new MontageBTreeFactory<string>(), "MontageBTree");
+	gtc.addRideableOption(new MontageARTFactory<string>(), "MontageART");
+	gtc.addRideableOption(new UnbalancedTreeFactory<string>(), "UnbalancedTree");
+	gtc.addRideableOption(new MontageRBTreeFactory<string>(), "MontageRBTree");
 #endif /* !defined(MNEMOSYNE) and !defined(PRONTO) */
 #ifdef MNEMOSYNE
 	gtc.addRideableOption(new MneQueueFactory<string>(), "MneQueue");
@@ -153,8 +170,27 @@ int main(int argc, char *argv[])
 	gtc.addTestOption(new AllocTest(1024 * 1024, DO_JEMALLOC_ALLOC), "AllocTest-JEMalloc");
 	gtc.addTestOption(new AllocTest(1024 * 1024, DO_RALLOC_ALLOC), "AllocTest-Ralloc");
 	gtc.addTestOption(new AllocTest(1024 * 1024, DO_MONTAGE_ALLOC), "AllocTest-Montage");
+	gtc.addTestOption(new MapScanTest<string,string>(10, 0, 45, 45, 1000000, 500000, 100), "MapScanTest<string>:s10p0i45rm45:range=1000000:prefill=500000:len=100");
+	gtc.addTestOption(new MapScanTest<string,string>(50, 0, 25, 25, 1000000, 500000, 100), "MapScanTest<string>:s50p0i25rm25:range=1000000:prefill=500000:len=100");
+	gtc.addTestOption(new QueueRecoverTest(), "QueueRecoverTest");
+	gtc.addTestOption(new QueueTest(5000000,50,64), "Queue:5m:batch=64");
+	gtc.addTestOption(new HeapChurnTest<string>(50,50,1000000,2000), "HeapChurnTest<string>:eq50dq50:range=1000000:prefill=2000");
+	gtc.addTestOption(new MapMonotonicTest<string,string>(50, 0, 50, 0, 2000), "MapMonotonicTest<string>:g50p0i50rm0:prefill=2000");
 
 	gtc.parseCommandLine(argc, argv);
+
+#ifdef NVM_EMULATION
+	persist_func::emulation::configure(
+		gtc.checkEnv("NVMWriteLatency") ? stoull(gtc.getEnv("NVMWriteLatency")) : 300,
+		gtc.checkEnv("NVMFlushCost") ? stoull(gtc.getEnv("NVMFlushCost")) : 30,
+		gtc.checkEnv("NVMBandwidth") ? stoull(gtc.getEnv("NVMBandwidth")) : 2000,
+		gtc.checkEnv("NVMQueueDepth") ? stoull(gtc.getEnv("NVMQueueDepth")) : 64);
+#else
+	if (gtc.checkEnv("NVMWriteLatency") || gtc.checkEnv("NVMFlushCost") ||
+		gtc.checkEnv("NVMBandwidth") || gtc.checkEnv("NVMQueueDepth")){
+		errexit("NVM emulation parameters need a build with NVM_EMULATION (make nvm-emu).");
+	}
+#endif
 	
         omp_set_num_threads(gtc.task_num);
 	gtc.runTest();
@@ -1,5 +1,7 @@
 #include "EpochSys.hpp"
 #include "EpochAdvancers.hpp"
+#include <algorithm>
+#include <string>
 
 using namespace pds;
 
@@ -43,8 +45,83 @@ void GlobalCounterEpochAdvancer::on_end_transaction(EpochSys* esys, uint64_t c){
 }
 
 
+const char* AdaptiveEpochLength::reason_names[REASON_NUM] =
+    {"sync", "backlog", "writeback", "idle", "steady"};
+
+AdaptiveEpochLength::AdaptiveEpochLength(GlobalTestConfig* gtc, uint64_t base_length, uint64_t unit){
+    if (base_length == 0){
+        errexit("EpochAdvance=Adaptive requires a nonzero EpochLength.");
+    }
+    min_length = std::max(base_length/16, (uint64_t)1);
+    max_length = base_length*4;
+    if (gtc->checkEnv("EpochLengthMin")){
+        min_length = stoull(gtc->getEnv("EpochLengthMin"))*unit;
+    }
+    if (gtc->checkEnv("EpochLengthMax")){
+        max_length = stoull(gtc->getEnv("EpochLengthMax"))*unit;
+    }
+    if (gtc->checkEnv("EpochBacklog")){
+        backlog_target = stoull(gtc->getEnv("EpochBacklog"));
+    }
+    if (min_length == 0 || min_length > max_length){
+        errexit("invalid EpochLengthMin or EpochLengthMax.");
+    }
+    length = std::min(std::max(base_length, min_length), max_length);
+}
+
+uint64_t AdaptiveEpochLength::next(uint64_t wb_length, uint64_t backlog, uint64_t syncs){
+    if (syncs > 0){
+        last_reason = SYNC;
+    } else if (backlog != UINT64_MAX && backlog > backlog_target){
+        last_reason = BACKLOG;
+    } else if (wb_length > length/4){
+        last_reason = WRITEBACK;
+    } else if (backlog == 0){
+        last_reason = IDLE;
+    } else {
+        last_reason = STEADY;
+    }
+    switch(last_reason){
+        case SYNC:
+        case BACKLOG:
+        case WRITEBACK:
+            length /= 2;
+            break;
+        case IDLE:
+            length *= 2;
+            break;
+        default:
+            length += std::max(length/8, (uint64_t)1);
+    }
+    length = std::min(std::max(length, min_length), max_length);
+    adjusts[last_reason]++;
+    length_sum += length;
+    epochs++;
+    return length;
+}
+
+void AdaptiveEpochLength::report(GlobalTestConfig* gtc){
+    std::string adjust_str;
+    for (int i = 0; i < REASON_NUM; i++){
+        adjust_str += std::string(i == 0 ? "" : " ") + reason_names[i] + ":" + std::to_string(adjusts[i]);
+    }
+    double mean_length = epochs == 0 ? length : (double)length_sum/epochs;
+    if (gtc->recorder){
+        gtc->recorder->reportGlobalInfo("epoch_length(us)", (unsigned long)length);
+        gtc->recorder->reportGlobalInfo("epoch_length_mean(us)", mean_length);
+        gtc->recorder->reportGlobalInfo("epoch_length_reason", std::string(reason_names[last_reason]));
+        gtc->recorder->reportGlobalInfo("epoch_length_adjusts", adjust_str);
+    }
+    if (gtc->verbose){
+        std::cout<<"adaptive epoch length:"<<length<<"us ("<<reason_names[last_reason]<<
+            "), mean:"<<mean_length<<"us, adjusts:"<<adjust_str<<std::endl;
+    }
+}
+
+
 DedicatedEpochAdvancer::DedicatedEpochAdvancer(GlobalTestConfig* gtc, EpochSys* es):
     gtc(gtc), esys(es){
+    uint64_t unit = 1;
     if (gtc->checkEnv("EpochLength")){
         epoch_length = stoi(gtc->getEnv("EpochLength"));
     } else {
@@ -53,15 +130,26 @@ DedicatedEpochAdvancer::DedicatedEpochAdvancer(GlobalTestConfig* gtc, EpochSys*
     if (gtc->checkEnv("EpochLengthUnit")){
         std::string env_unit = gtc->getEnv("EpochLengthUnit");
         if (env_unit == "Second"){
-            epoch_length *= 1000000;
+            unit = 1000000;
         } else if (env_unit == "Millisecond"){
-            epoch_length *= 1000;
+            unit = 1000;
         } else if (env_unit == "Microsecond"){
             // do nothing.
         } else {
             errexit("time unit not supported.");
         }
     }
+    epoch_length *= unit;
+    if (gtc->checkEnv("EpochAdvance")){
+        std::string env_advance = gtc->getEnv("EpochAdvance");
+        if (env_advance == "Adaptive"){
+            adaptive = new AdaptiveEpochLength(gtc, epoch_length, unit);
+            epoch_length = adaptive->get_length();
+        } else if (env_advance != "Dedicated"){
+            errexit("unrecognized 'epoch advance' argument");
+        }
+    }
+    sync_requests.store(0);
     started.store(false);
     advancer_thread = std::move(std::thread(&DedicatedEpochAdvancer::advancer, this, gtc->task_num));
     started.store(true);
@@ -107,6 +195,10 @@ void DedicatedEpochAdvancer::advancer(int task_num){
         }
         int64_t wb_length = chrono::duration_cast<chrono::microseconds>(
             chrono::high_resolution_clock::now()-wb_start).count();
+        if (adaptive){
+            epoch_length = adaptive->next(wb_length, esys->get_persist_backlog(),
+                sync_requests.exchange(0, std::memory_order_relaxed));
+        }
         
         next_sleep = epoch_length - wb_length;
         // wake all threads waiting for sync() to finish.
@@ -118,6 +210,7 @@ void DedicatedEpochAdvancer::advancer(int task_num){
 void DedicatedEpochAdvancer::sync(uint64_t c){
     // sync must NOT be called in an operation.
     assert(c == NULL_EPOCH);
+    sync_requests.fetch_add(1, std::memory_order_relaxed);
     uint64_t target_epoch = esys->get_epoch()+2;
     std::unique_lock<std::mutex> lk(sync_signal.bell);
     if (target_epoch < sync_signal.target_epoch-2){
@@ -129,6 +222,18 @@ void DedicatedEpochAdvancer::sync(uint64_t c){
     sync_signal.worker_ring.wait(lk, [&]{return (esys->get_epoch() >= target_epoch);});
 }
 
+void DedicatedEpochAdvancer::wait_epoch(uint64_t target){
+    // like sync(), but for a given target rather than two epochs from now.
+    if (esys->get_epoch() >= target){
+        return;
+    }
+    sync_requests.fetch_add(1, std::memory_order_relaxed);
+    std::unique_lock<std::mutex> lk(sync_signal.bell);
+    sync_signal.target_epoch = std::max(target, sync_signal.target_epoch);
+    sync_signal.advancer_ring.notify_all();
+    sync_signal.worker_ring.wait(lk, [&]{return (esys->get_epoch() >= target);});
+}
+
 DedicatedEpochAdvancer::~DedicatedEpochAdvancer(){
     // std::cout<<"terminating advancer_thread"<<std::endl;
     started.store(false);
@@ -141,5 +246,9 @@ DedicatedEpochAdvancer::~DedicatedEpochAdvancer(){
     if (advancer_thread.joinable()){
         advancer_thread.join();
     }
+    if (adaptive){
+        adaptive->report(gtc);
+        delete adaptive;
+    }
     // std::cout<<"terminated advancer_thread"<<std::endl;
 }
\ No newline at end of file
@@ -21,6 +21,8 @@ public:
     virtual void set_help_freq(int help_freq) = 0;
     virtual void on_end_transaction(EpochSys* esys, uint64_t c) = 0;
     virtual void sync(uint64_t c){}
+    // block until the global epoch reaches target, advancing early if needed.
+    virtual void wait_epoch(uint64_t target){}
     virtual ~EpochAdvancer(){}
 };
 
@@ -53,6 +55,40 @@ public:
     }
 };
 
+// Epoch length controller of DedicatedEpochAdvancer under
+// -dEpochAdvance=Adaptive. After each advance it picks the next length
+// within [EpochLengthMin, EpochLengthMax], checking in order:
+//   sync:      sync() was requested, which waits for two epochs. halve.
+//   backlog:   more than EpochBacklog write-backs were left for the
+//              boundary. halve. BufferedWB bounds the backlog by its
+//              buffers, which shorter epochs do not shrink.
+//   writeback: write-back took over a quarter of the length. halve.
+//   idle:      nothing was left to write back. double.
+//   steady:    otherwise grow by an eighth.
+class AdaptiveEpochLength{
+public:
+    enum Reason {SYNC, BACKLOG, WRITEBACK, IDLE, STEADY, REASON_NUM};
+    static const char* reason_names[REASON_NUM];
+private:
+    uint64_t min_length;
+    uint64_t max_length;
+    uint64_t backlog_target = 0x1ULL << 16;
+    uint64_t length;
+    Reason last_reason = STEADY;
+    uint64_t adjusts[REASON_NUM] = {};
+    uint64_t length_sum = 0;
+    uint64_t epochs = 0;
+public:
+    // all lengths are in microseconds.
+    AdaptiveEpochLength(GlobalTestConfig* gtc, uint64_t base_length, uint64_t unit);
+    uint64_t next(uint64_t wb_length, uint64_t backlog, uint64_t syncs);
+    uint64_t get_length(){
+        return length;
+    }
+    // export chosen lengths and reasons to gtc->recorder.
+    void report(GlobalTestConfig* gtc);
+};
+
 class DedicatedEpochAdvancer : public EpochAdvancer{
     struct SyncSignal{
         std::mutex bell;
@@ -66,6 +102,9 @@ class DedicatedEpochAdvancer : public EpochAdvancer{
     std::atomic<bool> started;
     uint64_t epoch_length;
     SyncSignal sync_signal;
+    // sync() calls since the last advance.
+    std::atomic<uint64_t> sync_requests;
+    AdaptiveEpochLength* adaptive = nullptr;
     void advancer(int task_num);
 public:
     DedicatedEpochAdvancer(GlobalTestConfig* gtc, EpochSys* es);
@@ -76,6 +115,7 @@ public:
         // do nothing here.
     }
     void sync(uint64_t c);
+    void wait_epoch(uint64_t target);
 };
 
 class NoEpochAdvancer : public EpochAdvancer{
@@ -2,6 +2,12 @@
 
 #include <omp.h>
 #include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/eventfd.h>
 namespace pds{
 
     thread_local int EpochSys::tid = -1;
@@ -32,8 +38,10 @@ namespace pds{
         gtc->setEnv("BufferSize", "64");
     }
 
+        no_persist = false;
         if (gtc->checkEnv("PersistStrat")){
             if (gtc->getEnv("PersistStrat") == "No"){
+                no_persist = true;
                 to_be_persisted = new NoToBePersistContainer();
                 to_be_freed = new NoToBeFreedContainer(this);
                 epoch_advancer = new NoEpochAdvancer();
@@ -164,6 +172,17 @@ namespace pds{
         to_be_persisted->register_persist(b, _ral->malloc_size(b), c);
     }
 
+    void EpochSys::register_update_field(PBlk* b, const void* field, size_t sz, uint64_t c){
+        if (c == NULL_EPOCH){
+            return;
+        }
+        assert(b->epoch == c);
+        assert((char*)field >= (char*)b && (char*)field + sz <= (char*)b + _ral->malloc_size(b));
+        // containers only see (address, size) pairs, so the range is
+        // registered in place of the block.
+        to_be_persisted->register_persist((PBlk*)field, sz, c);
+    }
+
     uint64_t EpochSys::get_epoch(){
         return global_epoch->load(std::memory_order_acquire);
     }
@@ -229,6 +248,59 @@ namespace pds{
         // Actually advance the epoch
         // global_epoch->compare_exchange_strong(c, c+1, std::memory_order_seq_cst);
         global_epoch->store(c+1, std::memory_order_seq_cst);
+        notify_durable(c+1);
+    }
+
+    void EpochSys::notify_durable(uint64_t c){
+        std::vector<std::function<void()>> ready;
+        {
+            std::lock_guard<std::mutex> lk(durable_lock);
+            // tickets up to c-2 are durable now.
+            auto end = durable_callbacks.upper_bound(c-2);
+            for (auto itr = durable_callbacks.begin(); itr != end; itr++){
+                ready.push_back(std::move(itr->second));
+            }
+            durable_callbacks.erase(durable_callbacks.begin(), end);
+        }
+        for (auto& f : ready){
+            f();
+        }
+        int fd = durable_fd.load(std::memory_order_acquire);
+        if (fd >= 0){
+            uint64_t one = 1;
+            if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN){
+                errexit("failed to signal durability_fd.");
+            }
+        }
+    }
+
+    void EpochSys::on_durable(uint64_t ticket, const std::function<void()>& f){
+        {
+            // checked under the lock so that notify_durable(), which takes
+            // it after advancing, cannot miss the callback.
+            std::lock_guard<std::mutex> lk(durable_lock);
+            if (!is_durable(ticket)){
+                durable_callbacks.emplace(ticket, f);
+                return;
+            }
+        }
+        f();
+    }
+
+    int EpochSys::durability_fd(){
+        int fd = durable_fd.load(std::memory_order_acquire);
+        if (fd < 0){
+            int new_fd = eventfd(0, EFD_NONBLOCK);
+            if (new_fd < 0){
+                errexit("failed to create durability_fd.");
+            }
+            if (durable_fd.compare_exchange_strong(fd, new_fd, std::memory_order_acq_rel)){
+                fd = new_fd;
+            } else {
+                close(new_fd);
+            }
+        }
+        return fd;
     }
 
     // TODO: figure out how/whether to do helping with existence of dedicated bookkeeping thread(s)
@@ -272,8 +344,63 @@ namespace pds{
         // trans_tracker->unregister_bookkeeping(c);
     }
 
+    namespace{
+        // Map a block id to the recovery shard that resolves it. Ids carry
+        // the allocating thread in their high bits and a per-thread sequence
+        // in their low bits, so mix them before taking the modulo.
+        inline int recovery_shard(uint64_t id, int shard_num){
+            id ^= id >> 33;
+            id *= 0xff51afd7ed558ccdULL;
+            id ^= id >> 33;
+            return id % shard_num;
+        }
+
+        // Blocks a traversing thread hands over to the owner of one shard.
+        struct RecoveryOutbox{
+            // ALLOC, UPDATE and DELETE blocks, sharded by id.
+            std::vector<PBlk*> records;
+            // OWNED blocks, sharded by owner_id.
+            std::vector<PBlk*> owned;
+        };
+
+        struct RecoveryStats{
+            size_t in_use = 0;
+            size_t deleted = 0;
+            size_t owned = 0;
+            size_t orphaned = 0;
+        };
+
+        inline int64_t ms_since(const std::chrono::high_resolution_clock::time_point& begin){
+            return std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::high_resolution_clock::now() - begin).count();
+        }
+    }
+
     std::unordered_map<uint64_t, PBlk*>* EpochSys::recover(const int rec_thd){
+        // collect the streamed shards and only then build the map, so that
+        // recovery threads never touch a shared container.
+        std::vector<padded<std::vector<PBlk*>>> live(rec_thd);
+        recover([&](const std::vector<PBlk*>& blks, int shard){
+            live[shard].ui = blks;
+        }, rec_thd);
+
+        auto begin = chrono::high_resolution_clock::now();
+        size_t in_use_cnt = 0;
+        for (int s = 0; s < rec_thd; s++){
+            in_use_cnt += live[s].ui.size();
+        }
         std::unordered_map<uint64_t, PBlk*>* in_use = new std::unordered_map<uint64_t, PBlk*>();
+        in_use->reserve(in_use_cnt);
+        for (int s = 0; s < rec_thd; s++){
+            for (PBlk* blk : live[s].ui){
+                in_use->insert({blk->id, blk});
+            }
+        }
+        std::cout << "Collecting in-use blocks completed in " << ms_since(begin) << "ms" << std::endl;
+        return in_use;
+    }
+
+    void EpochSys::recover(const RecoverCallback& on_shard, const int rec_thd){
 #ifndef MNEMOSYNE
         bool clean_start;
 
@@ -282,8 +409,9 @@ namespace pds{
         sys_mode=RECOVER;
         // set system mode to RECOVER -- all PDELETE_DATA and PDELETE becomes no-ops.
 
-        // make a whole pass thorugh all blocks, find the epoch block.
-        epoch_container = nullptr;
+        // the epoch container and UID marks are roots, so a single traversal
+        // that also lets a dirty Ralloc rebuild its metadata suffices.
+        load_roots();
         if(itr_raw[0].is_dirty()) {
             clean_start = false;
             std::cout<<"dirty restart"<<std::endl;
@@ -293,218 +421,191 @@ namespace pds{
             clean_start = true;
             // clean restart, epoch system and app may still need iter to do something
         }
-
-        #pragma omp parallel num_threads(rec_thd)
-        {
-            int tid = omp_get_thread_num();
-            for(; !itr_raw[tid].is_last(); ++itr_raw[tid]) { // iter++ is temporarily not supported
-                PBlk* curr_blk = (PBlk*)*itr_raw[tid];
-                // use curr_blk to do higher level recovery
-                if (curr_blk->blktype == EPOCH){
-                    epoch_container = (Epoch*) curr_blk;
-                    global_epoch = &epoch_container->global_epoch;
-                    // we continue this pass to the end to help ralloc recover.
-                }
-            }
-        }
-
-        std::cout<<"finished first traversal"<<std::endl;
         if (!epoch_container){
             errexit("epoch container not found during recovery.");
         }
-        std::cout<<"epoch before crash:" << global_epoch->load() <<std::endl;
-
-        // make a second pass through all blocks, compute a set of in-use blocks and return the others (to ralloc).
-        uint64_t epoch_cap = global_epoch->load(std::memory_order_relaxed) - 2;
-        std::unordered_set<PBlk*> not_in_use;
-        std::unordered_set<uint64_t> delete_nodes;
-        std::unordered_multimap<uint64_t, PBlk*> owned;
-        std::mutex not_in_use_m;
-        std::mutex delete_nodes_m;
-        std::mutex in_use_m;
-        std::mutex owned_m;
-
-        itr_raw = _ral->recover(rec_thd);
-
-        // Clear the heap
-        if (epoch_cap < 1) {
-            #pragma omp parallel num_threads(rec_thd)
-            {
-                int tid = omp_get_thread_num();
-                for (; !itr_raw[tid].is_last(); ++itr_raw[tid]) {
-                    _ral->deallocate(*itr_raw[tid],0);
+        if (restart_epoch != NULL_EPOCH){
+            // reopened heap: stay off the persistent epoch, see EpochSys().
+            global_epoch = &transient_epoch;
+        }
+        if (restart_epoch == NULL_EPOCH){
+            // same-process recovery (e.g., after simulate_crash()).
+            restart_epoch = global_epoch->load(std::memory_order_relaxed);
+        }
+        std::cout<<"epoch before crash:" << restart_epoch <<std::endl;
+
+        // Everything from here on is partitioned by block id: every traversing
+        // thread t drops each block into outboxes[t][shard], and after a
+        // barrier the thread owning a shard resolves all ALLOC/UPDATE/DELETE
+        // records and OWNED blocks of that shard on its own. No phase needs a
+        // lock or a shared container.
+        uint64_t epoch_cap = restart_epoch - 2;
+        std::vector<std::vector<RecoveryOutbox>> outboxes(rec_thd, std::vector<RecoveryOutbox>(rec_thd));
+        std::vector<padded<std::vector<PBlk*>>> not_in_use(rec_thd);
+        std::vector<padded<RecoveryStats>> stats(rec_thd);
+
+        // Classify blocks of each thread's superblock range into shards.
+        // If there is no complete epoch to recover to, everything is garbage.
+        auto begin = chrono::high_resolution_clock::now();
+        #pragma omp parallel for num_threads(rec_thd) schedule(static, 1)
+        for (int t = 0; t < rec_thd; t++){
+            std::vector<RecoveryOutbox>& outbox = outboxes[t];
+            std::vector<PBlk*>& _not_in_use = not_in_use[t].ui;
+            for(; !itr_raw[t].is_last(); ++itr_raw[t]) { // iter++ is temporarily not supported
+                PBlk* curr_blk = (PBlk*)*itr_raw[t];
+                if (curr_blk == epoch_container || curr_blk == uid_container){
+                    continue;
+                }
+                if (epoch_cap < 1 || curr_blk->epoch == NULL_EPOCH || curr_blk->epoch > epoch_cap){
+                    _not_in_use.push_back(curr_blk);
+                    continue;
+                }
+                switch(curr_blk->blktype){
+                    case OWNED:
+                        outbox[recovery_shard(curr_blk->owner_id, rec_thd)].owned.push_back(curr_blk);
+                        break;
+                    case DELETE:
+                        if (clean_start){
+                            errexit("delete node appears after a clean exit.");
+                        }
+                        outbox[recovery_shard(curr_blk->id, rec_thd)].records.push_back(curr_blk);
+                        break;
+                    case ALLOC:
+                    case UPDATE:
+                        outbox[recovery_shard(curr_blk->id, rec_thd)].records.push_back(curr_blk);
+                        break;
+                    case EPOCH:
+                        break;
+                    default:
+                        // after a dirty exit Ralloc reports every slot of a
+                        // small superblock, including never-allocated ones
+                        // holding stale bytes from the superblock's use by
+                        // another size class. they are free.
+                        _not_in_use.push_back(curr_blk);
+                        break;
                 }
             }
-            return in_use;
         }
-        auto begin = chrono::high_resolution_clock::now();
+        std::cout << "Classification pass completed in " << ms_since(begin) << "ms" << std::endl;
 
-        #pragma omp parallel num_threads(rec_thd)
-        {
-            int tid = omp_get_thread_num();
-            std::unordered_set<PBlk*> _not_in_use;
-            std::unordered_set<uint64_t> _delete_nodes;
-            std::unordered_map<uint64_t, PBlk*> _in_use;
-            std::unordered_multimap<uint64_t, PBlk*> _owned;
-
-            for(; !itr_raw[tid].is_last(); ++itr_raw[tid]) { // iter++ is temporarily not supported
-                PBlk* curr_blk = (PBlk*)*itr_raw[tid];
-                // use curr_blk to do higher level recovery
-                if (curr_blk->epoch == NULL_EPOCH || curr_blk->epoch > epoch_cap){
-                    _not_in_use.insert(curr_blk);
+        // Resolve each shard: sort its records by (id, epoch) so that all
+        // versions of a block are adjacent. A DELETE record kills every
+        // version of its id; otherwise the newest version survives. OWNED
+        // blocks are then merge-joined against the surviving ids, and the
+        // live blocks are handed to on_shard by the thread that resolved them.
+        begin = chrono::high_resolution_clock::now();
+        #pragma omp parallel for num_threads(rec_thd) schedule(static, 1)
+        for (int s = 0; s < rec_thd; s++){
+            std::vector<PBlk*> records;
+            std::vector<PBlk*> owned;
+            size_t records_cnt = 0;
+            size_t owned_cnt = 0;
+            for (int t = 0; t < rec_thd; t++){
+                records_cnt += outboxes[t][s].records.size();
+                owned_cnt += outboxes[t][s].owned.size();
+            }
+            records.reserve(records_cnt);
+            owned.reserve(owned_cnt);
+            for (int t = 0; t < rec_thd; t++){
+                RecoveryOutbox& outbox = outboxes[t][s];
+                records.insert(records.end(), outbox.records.begin(), outbox.records.end());
+                owned.insert(owned.end(), outbox.owned.begin(), outbox.owned.end());
+                std::vector<PBlk*>().swap(outbox.records);
+                std::vector<PBlk*>().swap(outbox.owned);
+            }
+
+            std::vector<PBlk*> _live;
+            std::vector<PBlk*>& _not_in_use = not_in_use[s].ui;
+            RecoveryStats& _stats = stats[s].ui;
+            std::sort(records.begin(), records.end(), [](const PBlk* a, const PBlk* b){
+                return a->id < b->id || (a->id == b->id && a->epoch < b->epoch);
+            });
+            _live.reserve(records.size());
+            for (size_t i = 0; i < records.size();){
+                size_t j = i;
+                bool deleted = false;
+                for (; j < records.size() && records[j]->id == records[i]->id; j++){
+                    deleted |= (records[j]->blktype == DELETE);
+                }
+                if (deleted){
+                    _stats.deleted++;
+                    _not_in_use.insert(_not_in_use.end(), records.begin()+i, records.begin()+j);
                 } else {
-                    curr_blk->epoch = INIT_EPOCH + 2;
-                    switch(curr_blk->blktype){
-                        case OWNED:
-                            _owned.insert(std::pair<uint64_t, PBlk*>(curr_blk->owner_id, curr_blk));
-                            break;
-                        case ALLOC:{
-                                       auto insert_res = _in_use.insert({curr_blk->id, curr_blk});
-                                       if (insert_res.second == false){
-                                           if (clean_start){
-                                               errexit("more than one record with the same id after a clean exit.");
-                                           }
-                                           _not_in_use.insert(curr_blk);
-                                       }
-                                   }
-                                   break;
-                        case UPDATE:{
-                                        auto search = _in_use.find(curr_blk->id);
-                                        if (search != _in_use.end()){
-                                            if (clean_start){
-                                                errexit("more than one record with the same id after a clean exit.");
-                                            }
-                                            if (curr_blk->epoch > search->second->epoch){
-                                                _not_in_use.insert(search->second);
-                                                search->second = curr_blk; // TODO: double-check if this is right.
-                                            } else {
-                                                _not_in_use.insert(curr_blk);
-                                            }
-                                        } else {
-                                            _in_use.insert({curr_blk->id, curr_blk});
-                                        }
-                                    }
-                                    break;
-                        case DELETE:
-                                    if (clean_start){
-                                        errexit("delete node appears after a clean exit.");
-                                    }
-                                    _delete_nodes.insert(curr_blk->id);
-                                    _not_in_use.insert(curr_blk);
-                                    break;
-                        case EPOCH:
-                                    break;
-                        default:
-                                    errexit("wrong type of pblk discovered");
-                                    break;
+                    if (clean_start && j-i > 1){
+                        errexit("more than one record with the same id after a clean exit.");
                     }
+                    // the newest version is the last one; older ones are garbage.
+                    _not_in_use.insert(_not_in_use.end(), records.begin()+i, records.begin()+j-1);
+                    _live.push_back(records[j-1]);
                 }
+                i = j;
             }
 
-            #pragma omp critical
-            delete_nodes.merge(_delete_nodes);
-            #pragma omp critical    
-            owned.merge(_owned);
-            #pragma omp critical
-            in_use->merge(_in_use);
-            #pragma omp critical
-            not_in_use.merge(_not_in_use);
-            // If recovery ever fails, uncomment the below
-            /*
-            #pragma omp critical
-            {
-                for (auto tpl : _in_use) {
-                    auto curr_blk = tpl.second;
-                    if (curr_blk->blktype == UPDATE) {
-                        auto ret = in_use->find(curr_blk->id);
-                        if (ret != in_use->end()) {
-                            if (curr_blk->epoch > ret->second->epoch) {
-                                not_in_use.insert(ret->second);
-                                ret->second = curr_blk;
-                            } else {
-                                not_in_use.insert(curr_blk);
-                            }
-                        } else {
-                            in_use->insert({curr_blk->id, curr_blk});
-                        }
-                    } else if (curr_blk->blktype == ALLOC) { 
-                        auto ret = in_use->insert({curr_blk->id, curr_blk});
-                        if (ret.second == false) {
-                            not_in_use.insert(curr_blk);
-                        }
-                    } else {
-                        in_use->insert({curr_blk->id, curr_blk});
-                    }
+            std::sort(owned.begin(), owned.end(), [](const PBlk* a, const PBlk* b){
+                return a->owner_id < b->owner_id;
+            });
+            size_t l = 0;
+            for (PBlk* blk : owned){
+                while (l < _live.size() && _live[l]->id < blk->owner_id){
+                    l++;
+                }
+                if (l < _live.size() && _live[l]->id == blk->owner_id){
+                    blk->epoch = INIT_EPOCH + 2;
+                    _stats.owned++;
+                } else {
+                    _stats.orphaned++;
+                    _not_in_use.push_back(blk);
                 }
-                not_in_use.merge(_not_in_use);
-            }*/
-        }
-        
-        auto end = chrono::high_resolution_clock::now();
-        auto dur = end - begin;
-        auto dur_ms = std::chrono::duration_cast<std::chrono::milliseconds>(dur).count();
-        std::cout << "Second pass completed in " << dur_ms << "ms" << std::endl;
-    
-        std::cout << "deleted(" << delete_nodes.size() << "), not_in_use(" << not_in_use.size() << "), in_use(" << in_use->size() << "), owned(" << owned.size() << ")" << std::endl;
-        if (clean_start){
-            return in_use;
-        }
-
-        
-        begin = chrono::high_resolution_clock::now();
-        // make a pass through in-use blocks and owned blocks, remove those marked by delete_nodes:
-        for (auto itr = delete_nodes.begin(); itr != delete_nodes.end(); itr++){
-            // remove deleted in-use blocks
-
-            auto deleted = in_use->extract(*itr);
-            if (!deleted.empty()){
-                not_in_use.insert(deleted.mapped());
             }
-            // remove deleted owned blocks
-            auto owned_blks = owned.equal_range(*itr);
-            for (auto owned_itr = owned_blks.first; owned_itr != owned_blks.second; owned_itr++){
-                not_in_use.insert(owned_itr->second);
+            for (PBlk* blk : _live){
+                blk->epoch = INIT_EPOCH + 2;
             }
-            owned.erase(*itr);
+            _stats.in_use = _live.size();
+            on_shard(_live, s);
         }
+        std::cout << "Resolution pass completed in " << ms_since(begin) << "ms" << std::endl;
+
+        size_t deleted_cnt = 0, not_in_use_cnt = 0, in_use_cnt = 0, owned_cnt = 0, orphaned_cnt = 0;
+        for (int s = 0; s < rec_thd; s++){
+            deleted_cnt += stats[s].ui.deleted;
+            owned_cnt += stats[s].ui.owned;
+            orphaned_cnt += stats[s].ui.orphaned;
+            not_in_use_cnt += not_in_use[s].ui.size();
+            in_use_cnt += stats[s].ui.in_use;
+        }
+        std::cout << "deleted(" << deleted_cnt << "), not_in_use(" << not_in_use_cnt << "), in_use(" << in_use_cnt << "), owned(" << owned_cnt << "), orphaned(" << orphaned_cnt << ")" << std::endl;
 
-        end = chrono::high_resolution_clock::now();
-        dur = end - begin;
-        dur_ms = std::chrono::duration_cast<std::chrono::milliseconds>(dur).count();
-        std::cout << "Third pass completed in " << dur_ms << "ms" << std::endl;
-
+        // Give garbage back to Ralloc. Each recovery thread can use its own
+        // thread cache as long as there are enough worker caches; the cache
+        // of the epoch advancer (tid task_num) is never borrowed.
         begin = chrono::high_resolution_clock::now();
-        // make a pass through owned blocks, remove orphaned blocks:
-        std::unordered_set<uint64_t> orphaned;
-        for (auto itr = owned.begin(); itr != owned.end(); itr++){
-            if (in_use->find(itr->first) == in_use->end()){
-                orphaned.insert(itr->first);
+        if (rec_thd <= task_num){
+            #pragma omp parallel for num_threads(rec_thd) schedule(static, 1)
+            for (int s = 0; s < rec_thd; s++){
+                int ral_tid = omp_get_thread_num();
+                for (PBlk* blk : not_in_use[s].ui){
+                    // we can't call delete here: the PBlk may have null vtable pointer
+                    _ral->deallocate(blk, ral_tid);
+                }
             }
-        }
-        for (auto itr = orphaned.begin(); itr != orphaned.end(); itr++){
-            auto orphaned_blks = owned.equal_range(*itr);
-            for (auto orphaned_itr = orphaned_blks.first; orphaned_itr != orphaned_blks.second; orphaned_itr++){
-                not_in_use.insert(orphaned_itr->second);
+        } else {
+            for (int s = 0; s < rec_thd; s++){
+                for (PBlk* blk : not_in_use[s].ui){
+                    _ral->deallocate(blk);
+                }
             }
-            owned.erase(*itr); // we don't actually need to do this.
-        }
-        end = chrono::high_resolution_clock::now();
-        dur = end - begin;
-        dur_ms = std::chrono::duration_cast<std::chrono::milliseconds>(dur).count();
-        std::cout << "Fourth pass completed in " << dur_ms << "ms" << std::endl;
-
-        // reclaim all nodes in not_in_use bag
-        for (auto itr = not_in_use.begin(); itr != not_in_use.end(); itr++){
-            // we can't call delete here: the PBlk may have null vtable pointer
-            _ral->deallocate(*itr);
         }
+        std::cout << "Reclamation pass completed in " << ms_since(begin) << "ms" << std::endl;
 
-        // set system mode back to online
+        // set system mode back to online, resuming past the epochs of the
+        // recovered blocks so that operations on them don't see them as new.
         sys_mode = ONLINE;
-        reset();
+        uint64_t resume_epoch = std::max<uint64_t>(restart_epoch, INIT_EPOCH);
+        restart_epoch = NULL_EPOCH;
+        global_epoch = &epoch_container->global_epoch;
+        reset(resume_epoch);
 
         std::cout<<"returning from EpochSys Recovery."<<std::endl;
 #endif /* !MNEMOSYNE */
-        return in_use;
     }
 }
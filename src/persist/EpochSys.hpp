@@ -8,6 +8,10 @@
 #include <thread>
 #include <condition_variable>
 #include <string>
+#include <vector>
+#include <functional>
+#include <mutex>
+#include <unistd.h>
 #include "TestConfig.hpp"
 #include "ConcurrentPrimitives.hpp"
 #include "PersistFunc.hpp"
@@ -111,6 +115,16 @@ struct Epoch : public PBlk{
     }
 };
 
+// persistent high-water marks of EpochSys::uid_generator, followed by
+// marks.count entries.
+struct UIDContainer : public PBlk{
+    UIDMarks marks;
+};
+
+// Ralloc roots holding EpochSys metadata, taken from the top of the root
+// array to stay clear of application roots.
+enum EpochSysRoot {EPOCH_ROOT = MAX_ROOTS-1, UID_ROOT = MAX_ROOTS-2};
+
 //////////////////
 // Epoch System //
 //////////////////
@@ -124,9 +138,10 @@ private:
     // persistent fields:
     Epoch* epoch_container = nullptr;
     std::atomic<uint64_t>* global_epoch = nullptr;
+    UIDContainer* uid_container = nullptr;
 
     // semi-persistent fields:
-    // TODO: set a periodic-updated persistent boundary to recover to.
+    // ids are persisted in chunks via the high-water marks in uid_container.
     UIDGenerator uid_generator;
 
     // transient fields:
@@ -138,8 +153,46 @@ private:
     GlobalTestConfig* gtc = nullptr;
     Ralloc* _ral = nullptr;
     int task_num;
+    // true when PersistStrat=No: nothing is persisted, so, as with sync(),
+    // durability tickets are trivially satisfied.
+    bool no_persist = false;
+    // pending on_durable() callbacks by ticket, and durability_fd().
+    std::mutex durable_lock;
+    std::multimap<uint64_t, std::function<void()>> durable_callbacks;
+    std::atomic<int> durable_fd;
+    // epoch of the previous run when this heap was reopened. The persistent
+    // one must keep it until recover() is done, or a crash during recovery
+    // would make every block look uncommitted; till then the system runs on
+    // transient_epoch.
+    uint64_t restart_epoch = NULL_EPOCH;
+    std::atomic<uint64_t> transient_epoch;
     static std::atomic<int> esys_num;
 
+    // adopt the metadata blocks registered as roots of this heap.
+    void load_roots(){
+        epoch_container = _ral->get_root<Epoch>(EPOCH_ROOT);
+        global_epoch = epoch_container ? &epoch_container->global_epoch : nullptr;
+        uid_container = _ral->get_root<UIDContainer>(UID_ROOT);
+    }
+
+    // (re)bind uid_generator to the persistent marks, resuming above the
+    // ones left by a previous run. a stale, smaller container is left for
+    // recovery to reclaim.
+    void bind_uid_marks(){
+        UIDContainer* prev = uid_container;
+        if (!prev || prev->marks.count < uid_generator.get_count()){
+            uid_container = (UIDContainer*)_ral->allocate(
+                sizeof(UIDContainer) + uid_generator.get_count()*sizeof(uint64_t));
+            new (uid_container) UIDContainer();
+            uid_container->blktype = EPOCH;
+        }
+        uid_generator.bind(&uid_container->marks, prev ? &prev->marks : nullptr);
+        persist_func::clwb_range(uid_container, sizeof(UIDContainer));
+        if (prev != uid_container){
+            _ral->set_root(uid_container, UID_ROOT);
+        }
+    }
+
 public:
 
     /* static */
@@ -148,10 +201,17 @@ public:
     // system mode that toggles on/off PDELETE for recovery purpose.
     SysMode sys_mode = ONLINE;
 
-    EpochSys(GlobalTestConfig* _gtc) : uid_generator(_gtc->task_num), gtc(_gtc) {
+    EpochSys(GlobalTestConfig* _gtc) : uid_generator(_gtc->task_num), gtc(_gtc), durable_fd(-1) {
         std::string heap_name = get_ralloc_heap_name();
         // task_num+1 to construct Ralloc for dedicated epoch advancer
         _ral = new Ralloc(_gtc->task_num+1,heap_name.c_str(),REGION_SIZE);
+        if (_ral->is_restart()){
+            load_roots();
+            if (epoch_container){
+                restart_epoch = global_epoch->load(std::memory_order_relaxed);
+                global_epoch = &transient_epoch;
+            }
+        }
         reset(); // TODO: change to recover() later on.
     }
 
@@ -174,6 +234,9 @@ public:
         delete trans_tracker;
         delete to_be_persisted;
         delete to_be_freed;
+        if (durable_fd.load() >= 0){
+            close(durable_fd.load());
+        }
         delete _ral;
     }
 
@@ -197,14 +260,16 @@ public:
         return ret;
     }
 
-    void reset(){
+    void reset(uint64_t start_epoch = INIT_EPOCH){
         task_num = gtc->task_num;
         if (!epoch_container){
             epoch_container = new_pblk<Epoch>();
             epoch_container->blktype = EPOCH;
             global_epoch = &epoch_container->global_epoch;
+            _ral->set_root(epoch_container, EPOCH_ROOT);
         }
-        global_epoch->store(INIT_EPOCH, std::memory_order_relaxed);
+        bind_uid_marks();
+        global_epoch->store(start_epoch, std::memory_order_relaxed);
         parse_env();
     }
 
@@ -288,6 +353,10 @@ public:
     // called by the API.
     void register_update_pblk(PBlk* b, uint64_t c);
 
+    // register an in-place update of sz bytes at field inside b, which
+    // must have been registered as a whole earlier in epoch c.
+    void register_update_field(PBlk* b, const void* field, size_t sz, uint64_t c);
+
     // free a PBlk during a transaction.
     template<typename T>
     void free_pblk(T* b, uint64_t c);
@@ -317,6 +386,27 @@ public:
         epoch_advancer->sync(c);
     }
 
+    // Durability tickets. A ticket is the epoch an operation ran in; the
+    // operation is durable once that epoch is persisted, i.e., once the
+    // global epoch is two ahead of it.
+    bool is_durable(uint64_t ticket){
+        return no_persist || ticket == NULL_EPOCH || get_epoch() >= ticket + 2;
+    }
+
+    // block until ticket is durable, advancing epochs early if needed.
+    void wait_durable(uint64_t ticket){
+        if (!is_durable(ticket)){
+            epoch_advancer->wait_epoch(ticket + 2);
+        }
+    }
+
+    // run f once ticket is durable: in place if it already is, otherwise
+    // on the advancer thread, without hurrying it.
+    void on_durable(uint64_t ticket, const std::function<void()>& f);
+
+    // a nonblocking eventfd signaled whenever the durable frontier moves.
+    int durability_fd();
+
 
     /////////////////
     // Bookkeeping //
@@ -325,12 +415,21 @@ public:
     // get the current global epoch number.
     uint64_t get_epoch();
 
+    // write-backs done at the last epoch boundary, UINT64_MAX if unknown.
+    uint64_t get_persist_backlog(){
+        return to_be_persisted->last_backlog;
+    }
+
     // try to advance global epoch, helping others along the way.
     void advance_epoch(uint64_t c);
 
     // a version of advance_epoch for a SINGLE bookkeeping thread.
     void advance_epoch_dedicated();
 
+    // run on_durable() callbacks and signal durability_fd() after the
+    // global epoch advanced to c.
+    void notify_durable(uint64_t c);
+
     // try to help with block persistence and reclamation.
     void help();
 
@@ -341,7 +440,16 @@ public:
     // Recover //
     /////////////
     
-    // recover all PBlk decendants. return an iterator.
+    // called once per recovery shard with the shard's live blocks, from
+    // the recovery thread that resolved it and while the system is still
+    // in RECOVER mode. shard is in [0, rec_thd) and unique per call.
+    // callbacks must not allocate or free PBlks.
+    typedef std::function<void(const std::vector<PBlk*>& blks, int shard)> RecoverCallback;
+
+    // recover all PBlk decendants, streaming live ones shard by shard.
+    void recover(const RecoverCallback& on_shard, const int rec_thd = 2);
+
+    // recover all PBlk decendants. return a map from id to live block.
     std::unordered_map<uint64_t, PBlk*>* recover(const int rec_thd = 2);
 };
 
@@ -450,6 +558,9 @@ void EpochSys::free_pblk(T* b, uint64_t c){
         throw OldSeeNewException();
     } else if (e == c){
         if (blktype == ALLOC){
+            // recovery sees freed blocks as potentially in use, so the
+            // header must not be left claiming an allocation in c.
+            blk->epoch = NULL_EPOCH;
             to_be_persisted->register_persist_raw(blk, c);
             _ral->deallocate(b);
             return;
@@ -91,6 +91,11 @@ public:
         return std::string(char_array, size);
     }
 
+    // bytes in use from the start of the object, see pds::field_extent.
+    size_t extent() const{
+        return (char_array - (const char*)this) + size;
+    }
+
     operator std::string() const {
         return std_str();
     }
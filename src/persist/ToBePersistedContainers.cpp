@@ -1,10 +1,150 @@
 #include "ToBePersistedContainers.hpp"
 #include "EpochSys.hpp"
+#include <algorithm>
 
 using namespace pds;
 
+PersisterPool::PersisterPool(GlobalTestConfig* _gtc, int _pool_size) :
+    gtc(_gtc), pool_size(_pool_size), task_num(_gtc->task_num){
+    if (pool_size <= 0){
+        errexit("PersisterPool must be positive.");
+    }
+    pool_size = std::min(pool_size, task_num);
+    ranges = new Range[pool_size];
+    int stride = task_num / pool_size;
+    int extra = task_num % pool_size;
+    for (int i = 0, begin = 0; i < pool_size; i++){
+        // first `extra` ranges take one more worker each.
+        ranges[i].end = begin + stride + (i < extra ? 1 : 0);
+        ranges[i].next.store(ranges[i].end, std::memory_order_relaxed);
+        begin = ranges[i].end;
+    }
+    finished.store(pool_size, std::memory_order_relaxed);
+    persisted.store(0, std::memory_order_relaxed);
+    for (int i = 0; i < pool_size; i++){
+        persisters.push_back(std::move(
+            std::thread(&PersisterPool::persister_main, this, i)));
+    }
+}
+PersisterPool::~PersisterPool(){
+    {
+        std::unique_lock<std::mutex> lck(bell);
+        exit = true;
+    }
+    ring.notify_all();
+    for (auto i = persisters.begin(); i != persisters.end(); i++){
+        if (i->joinable()){
+            i->join();
+        }
+    }
+    delete[] ranges;
+}
+void PersisterPool::persister_main(int pid){
+    bool pin = gtc->checkEnv("PersisterPoolPin") && stoi(gtc->getEnv("PersisterPoolPin")) != 0;
+    int first_worker = pid == 0 ? 0 : ranges[pid-1].end;
+    if (pin && first_worker < (int)gtc->affinities.size()){
+        // pin to the package of the first worker owning our buffers.
+        hwloc_obj_t pkg = hwloc_get_ancestor_obj_by_type(gtc->topology,
+            HWLOC_OBJ_PACKAGE, gtc->affinities[first_worker]);
+        if (pkg){
+            hwloc_set_cpubind(gtc->topology, pkg->cpuset, HWLOC_CPUBIND_THREAD);
+        }
+    }
+    uint64_t curr_round = 0;
+    while(true){
+        {
+            std::unique_lock<std::mutex> lck(bell);
+            ring.wait(lck, [&]{return (curr_round != round || exit);});
+            if (exit){
+                return;
+            }
+            curr_round = round;
+        }
+        uint64_t cnt = 0;
+        // drain our own range first, then steal from the following ones.
+        for (int i = 0; i < pool_size; i++){
+            Range& r = ranges[(pid + i) % pool_size];
+            int tid;
+            while ((tid = r.next.fetch_add(1, std::memory_order_acq_rel)) < r.end){
+                cnt += job(tid);
+            }
+        }
+        // clwbs are only ordered by an sfence of the issuing thread.
+        persist_func::sfence();
+        persisted.fetch_add(cnt, std::memory_order_relaxed);
+        finished.fetch_add(1, std::memory_order_release);
+    }
+}
+uint64_t PersisterPool::run(const std::function<uint64_t(int)>& f){
+    // all persisters are idle here: finished == pool_size.
+    job = f;
+    persisted.store(0, std::memory_order_relaxed);
+    finished.store(0, std::memory_order_relaxed);
+    for (int i = 0, begin = 0; i < pool_size; i++){
+        ranges[i].next.store(begin, std::memory_order_relaxed);
+        begin = ranges[i].end;
+    }
+    {
+        std::unique_lock<std::mutex> lck(bell);
+        round++;
+    }
+    ring.notify_all();
+    // wait here until persisters finish.
+    while(finished.load(std::memory_order_acquire) < pool_size);
+    return persisted.load(std::memory_order_relaxed);
+}
+
+WriteBackFilter::WriteBackFilter(GlobalTestConfig* _gtc, int size) :
+    gtc(_gtc), task_num(_gtc->task_num){
+    if (size <= 0 || (size & (size - 1)) != 0){
+        errexit("WBFilter must be a power of two.");
+    }
+    mask = size - 1;
+    tables = new padded<Table>[task_num];
+    for (int i = 0; i < task_num; i++){
+        tables[i].ui.lines = new uintptr_t[size]();
+    }
+}
+WriteBackFilter::~WriteBackFilter(){
+    uint64_t registered = 0;
+    uint64_t avoided = 0;
+    for (int i = 0; i < task_num; i++){
+        registered += tables[i].ui.registered;
+        avoided += tables[i].ui.avoided;
+        delete[] tables[i].ui.lines;
+    }
+    delete[] tables;
+    if (registered == 0){
+        // e.g., the container recreated by a reset after recovery.
+        return;
+    }
+    if (gtc->recorder){
+        gtc->recorder->reportGlobalInfo("wb_lines_registered", (unsigned long)registered);
+        gtc->recorder->reportGlobalInfo("wb_lines_avoided", (unsigned long)avoided);
+    }
+    if (gtc->verbose){
+        std::cout<<"write-back filter avoided "<<avoided<<" of "<<registered<<" line flushes"<<std::endl;
+    }
+}
+
 void PerEpoch::AdvancerPersister::persist_epoch(uint64_t c){
-    con->container->pop_all(&do_persist, c);
+    if (con->pool){
+        con->last_backlog = con->pool->run([&](int tid){
+            uint64_t backlog = 0;
+            con->container->pop_all_local([&](std::pair<void*, size_t>& addr_size){
+                do_persist(addr_size);
+                backlog++;
+            }, tid, c);
+            return backlog;
+        });
+        return;
+    }
+    uint64_t backlog = 0;
+    con->container->pop_all([&](std::pair<void*, size_t>& addr_size){
+        do_persist(addr_size);
+        backlog++;
+    }, c);
+    con->last_backlog = backlog;
 }
 void PerEpoch::PerThreadDedicatedWait::persister_main(int worker_id){
     // pin this thread to hyperthreads of worker threads.
@@ -77,15 +217,28 @@ void PerEpoch::register_persist(PBlk* blk, size_t sz, uint64_t c){
     if (c == NULL_EPOCH){
         errexit("registering persist of epoch NULL.");
     }
+    if (filter){
+        filter->filter(blk, sz, EpochSys::tid, c, [&](void* addr, size_t addr_sz){
+            container->push(std::make_pair(addr, addr_sz), EpochSys::tid, c);
+        });
+        return;
+    }
     container->push(std::make_pair<void*, size_t>((char*)blk, (size_t)sz), EpochSys::tid, c);
 }
 void PerEpoch::register_persist_raw(PBlk* blk, uint64_t c){
+    if (filter){
+        register_persist(blk, 1, c);
+        return;
+    }
     container->push(std::make_pair<void*, size_t>((char*)blk, 1), EpochSys::tid, c);
 }
 void PerEpoch::persist_epoch(uint64_t c){
     persister->persist_epoch(c);
 }
 void PerEpoch::clear(){
+    if (filter){
+        filter->clear();
+    }
     container->clear();
 }
 
@@ -215,6 +368,9 @@ void BufferedWB::PerThreadDedicatedBusy::help_persist_local(uint64_t c){
     while(prev == signals[EpochSys::tid].ack.load(std::memory_order_acquire));
 }
 void BufferedWB::WorkerThreadPersister::help_persist_local(uint64_t c){
+    if (con->filter){
+        con->filter->invalidate(EpochSys::tid);
+    }
     for (int i = 0; i < con->dump_size; i++){
         con->container->try_pop_local(&do_persist, EpochSys::tid, c);
     }
@@ -224,6 +380,9 @@ void BufferedWB::do_persist(std::pair<void*, size_t>& addr_size){
         addr_size.first, addr_size.second);
 }
 void BufferedWB::dump(uint64_t c){
+    if (filter){
+        filter->invalidate(EpochSys::tid);
+    }
     for (int i = 0; i < dump_size; i++){
         container->try_pop_local(&do_persist, EpochSys::tid, c);
     }
@@ -237,6 +396,12 @@ void BufferedWB::register_persist(PBlk* blk, size_t sz, uint64_t c){
     if (c == NULL_EPOCH){
         errexit("registering persist of epoch NULL.");
     }
+    if (filter){
+        filter->filter(blk, sz, EpochSys::tid, c, [&](void* addr, size_t addr_sz){
+            push(std::make_pair(addr, addr_sz), c);
+        });
+        return;
+    }
     push(std::make_pair<void*, size_t>((char*)blk, (size_t)sz), c);
     
 }
@@ -244,13 +409,36 @@ void BufferedWB::register_persist_raw(PBlk* blk, uint64_t c){
     if (c == NULL_EPOCH){
         errexit("registering persist of epoch NULL.");
     }
+    if (filter){
+        register_persist(blk, 1, c);
+        return;
+    }
     push(std::make_pair<void*, size_t>((char*)blk, 1), c);
 }
 void BufferedWB::persist_epoch(uint64_t c){ // NOTE: this is not thread-safe.
+    if (pool){
+        last_backlog = pool->run([&](int tid){
+            uint64_t backlog = 0;
+            container->pop_all_local([&](std::pair<void*, size_t>& addr_size){
+                do_persist(addr_size);
+                backlog++;
+            }, tid, c);
+            return backlog;
+        });
+        return;
+    }
+    uint64_t backlog = 0;
     for (int i = 0; i < task_num; i++){
-        container->pop_all_local(&do_persist, i, c);
+        container->pop_all_local([&](std::pair<void*, size_t>& addr_size){
+            do_persist(addr_size);
+            backlog++;
+        }, i, c);
     }
+    last_backlog = backlog;
 }
 void BufferedWB::clear(){
+    if (filter){
+        filter->clear();
+    }
     container->clear();
 }
\ No newline at end of file
@@ -5,6 +5,9 @@
 #include <thread>
 #include <hwloc.h>
 #include <atomic>
+#include <functional>
+#include <vector>
+#include <cstring>
 
 #include "TestConfig.hpp"
 #include "ConcurrentPrimitives.hpp"
@@ -30,8 +33,116 @@ struct PairHash{
 // To-be-persist Containers //
 //////////////////////////////
 
+// A pool of threads (-dPersisterPool=N) that writes back an epoch's
+// per-worker buffers at the epoch boundary in place of the advancer.
+// Pool thread i owns a contiguous range of worker ids and, with
+// -dPersisterPoolPin=1, runs on the package of the first worker in it so
+// that it is NUMA-local to those buffers. Threads that finish their own
+// range steal the remaining ids of the others; the advancer only hands
+// out the job and waits.
+class PersisterPool{
+    struct Range{
+        std::atomic<int> next;
+        int end;
+    }__attribute__((aligned(CACHE_LINE_SIZE)));
+
+    GlobalTestConfig* gtc;
+    int pool_size;
+    int task_num;
+    std::vector<std::thread> persisters;
+    Range* ranges;
+    std::mutex bell;
+    std::condition_variable ring;
+    uint64_t round = 0;
+    bool exit = false;
+    // job of the current round, run for each worker id; returns the number
+    // of write-backs done.
+    std::function<uint64_t(int)> job;
+    std::atomic<int> finished;
+    std::atomic<uint64_t> persisted;
+    void persister_main(int pid);
+public:
+    PersisterPool(GlobalTestConfig* _gtc, int _pool_size);
+    ~PersisterPool();
+    // run f(tid) for all worker ids on the pool and wait for completion,
+    // including fences. return the sum of f's results.
+    uint64_t run(const std::function<uint64_t(int)>& f);
+};
+
+// A per-thread, per-epoch filter of cache lines that already wait in a
+// thread's to-be-persisted buffer (-dWBFilter=N lines per thread, a power
+// of two; 0 disables). It is direct-mapped and lossy: a line evicted by a
+// conflicting one is simply registered again. An entry stands for a
+// write-back that has not been issued yet, so a container that writes
+// back a thread's buffer before the epoch boundary must invalidate() its
+// filter, and only the thread itself may do that.
+class WriteBackFilter{
+    struct Table{
+        uint64_t epoch = NULL_EPOCH;
+        uint64_t registered = 0;
+        uint64_t avoided = 0;
+        uintptr_t* lines = nullptr;
+    };
+    GlobalTestConfig* gtc;
+    int task_num;
+    uintptr_t mask;
+    padded<Table>* tables;
+public:
+    WriteBackFilter(GlobalTestConfig* _gtc, int size);
+    ~WriteBackFilter();
+    // call push(addr, sz) for each run of lines in [p, p+sz] that thread
+    // tid has not registered yet in epoch c.
+    template<typename F>
+    void filter(void* p, size_t sz, int tid, uint64_t c, const F& push){
+        Table& t = tables[tid].ui;
+        if (c != t.epoch){
+            if (c < t.epoch){
+                push(p, sz);
+                return;
+            }
+            memset(t.lines, 0, (mask+1)*sizeof(uintptr_t));
+            t.epoch = c;
+        }
+        // same lines as persist_func::clwb_range_nofence(p, sz).
+        uintptr_t first = (uintptr_t)p & ~(uintptr_t)CACHE_LINE_MASK;
+        uintptr_t last = ((uintptr_t)p + sz) & ~(uintptr_t)CACHE_LINE_MASK;
+        uintptr_t run = 0;
+        for (uintptr_t l = first; l <= last; l += CACHE_LINE_SIZE){
+            uintptr_t& slot = t.lines[(l / CACHE_LINE_SIZE) & mask];
+            t.registered++;
+            if (slot == l){
+                t.avoided++;
+                if (run){
+                    push((void*)run, l - CACHE_LINE_SIZE - run);
+                    run = 0;
+                }
+            } else {
+                slot = l;
+                if (!run){
+                    run = l;
+                }
+            }
+        }
+        if (run){
+            push((void*)run, last - run);
+        }
+    }
+    void invalidate(int tid){
+        tables[tid].ui.epoch = NULL_EPOCH;
+    }
+    // forget all threads' lines; only while no thread registers.
+    void clear(){
+        for (int i = 0; i < task_num; i++){
+            invalidate(i);
+        }
+    }
+};
+
 class ToBePersistContainer{
 public:
+    // write-backs left for the epoch boundary and done by the last
+    // persist_epoch(), for epoch length tuning. UINT64_MAX if not tracked.
+    uint64_t last_backlog = UINT64_MAX;
     virtual void register_persist(PBlk* blk, size_t sz, uint64_t c) = 0;
     virtual void register_persist_raw(PBlk* blk, uint64_t c){
         persist_func::clwb(blk);
@@ -82,6 +193,10 @@ class PerEpoch : public ToBePersistContainer{
 
     PerThreadContainer<std::pair<void*, size_t>>* container = nullptr;
     Persister* persister = nullptr;
+    PersisterPool* pool = nullptr;
+    // nothing is written back before the epoch boundary, so the filter is
+    // never invalidated.
+    WriteBackFilter* filter = nullptr;
     static void do_persist(std::pair<void*, size_t>& addr_size);
 public:
     PerEpoch(GlobalTestConfig* gtc){
@@ -112,9 +227,22 @@ public:
         } else {
             persister = new AdvancerPersister(this);
         }
+        // only the advancer persister hands its epochs to the pool.
+        if (gtc->checkEnv("PersisterPool") && dynamic_cast<AdvancerPersister*>(persister)){
+            pool = new PersisterPool(gtc, stoi(gtc->getEnv("PersisterPool")));
+        }
+        int filter_size = 256;
+        if (gtc->checkEnv("WBFilter")){
+            filter_size = stoi(gtc->getEnv("WBFilter"));
+        }
+        if (filter_size > 0){
+            filter = new WriteBackFilter(gtc, filter_size);
+        }
     }
     ~PerEpoch(){
         delete persister;
+        delete pool;
+        delete filter;
         delete container;
     }
     void register_persist(PBlk* blk, size_t sz, uint64_t c);
@@ -191,6 +319,10 @@ class BufferedWB : public ToBePersistContainer{
     FixedCircBufferContainer<std::pair<void*, size_t>>* container = nullptr;
     GlobalTestConfig* gtc;
     Persister* persister = nullptr;
+    PersisterPool* pool = nullptr;
+    // only used by WorkerThreadPersister, which invalidates it on dumps;
+    // dedicated persisters drain buffers behind the worker's back.
+    WriteBackFilter* filter = nullptr;
     padded<int>* counters = nullptr;
     padded<std::mutex>* locks = nullptr;
     int task_num;
@@ -227,9 +359,20 @@ public:
         } else {
             persister = new WorkerThreadPersister(this);
         }
-        
+        if (gtc->checkEnv("PersisterPool")){
+            pool = new PersisterPool(gtc, stoi(gtc->getEnv("PersisterPool")));
+        }
+        int filter_size = 256;
+        if (gtc->checkEnv("WBFilter")){
+            filter_size = stoi(gtc->getEnv("WBFilter"));
+        }
+        if (filter_size > 0 && dynamic_cast<WorkerThreadPersister*>(persister)){
+            filter = new WriteBackFilter(gtc, filter_size);
+        }
     }
     ~BufferedWB(){
+        delete pool;
+        delete filter;
         delete container;
         delete counters;
         delete persister;
@@ -10,6 +10,10 @@ Recoverable::Recoverable(GlobalTestConfig* gtc){
     }
     pending_allocs = new padded<std::unordered_set<pds::PBlk*>>[gtc->task_num];
     local_descs = new padded<pds::sc_desc_t>[gtc->task_num];
+    tickets = new padded<uint64_t>[gtc->task_num];
+    for(int i = 0; i < gtc->task_num; i++){
+        tickets[i].ui = NULL_EPOCH;
+    }
     // init main thread
     pds::EpochSys::init_thread(0);
     // init epoch system
@@ -18,6 +22,7 @@ Recoverable::Recoverable(GlobalTestConfig* gtc){
 Recoverable::~Recoverable(){
     delete _esys;
     delete local_descs;
+    delete[] tickets;
     delete pending_allocs;
     delete epochs;
     Persistent::finalize();
@@ -200,6 +200,8 @@ class Recoverable{
     // local descriptors for DCSS
     // TODO: maybe put this into a derived class for NB data structures?
     padded<pds::sc_desc_t>* local_descs = nullptr;
+    // durability ticket of each thread's last operation.
+    padded<uint64_t>* tickets = nullptr;
 public:
     // return num of blocks recovered.
     virtual int recover(bool simulated = false) = 0;
@@ -226,21 +228,31 @@ public:
         }
         assert(epochs[pds::EpochSys::tid].ui != NULL_EPOCH);
     }
-    void end_op(){
-        assert(epochs[pds::EpochSys::tid].ui != NULL_EPOCH);
-        if (epochs[pds::EpochSys::tid].ui != NULL_EPOCH){
-            _esys->end_transaction(epochs[pds::EpochSys::tid].ui);
+    // return the durability ticket of the operation, also kept as
+    // last_ticket() for operations ended by MontageOpHolder.
+    uint64_t end_op(){
+        uint64_t ticket = epochs[pds::EpochSys::tid].ui;
+        assert(ticket != NULL_EPOCH);
+        if (ticket != NULL_EPOCH){
+            _esys->end_transaction(ticket);
             epochs[pds::EpochSys::tid].ui = NULL_EPOCH;
         }
         pending_allocs[pds::EpochSys::tid].ui.clear();
-    }
-    void end_readonly_op(){
-        assert(epochs[pds::EpochSys::tid].ui != NULL_EPOCH);
-        if (epochs[pds::EpochSys::tid].ui != NULL_EPOCH){
-            _esys->end_readonly_transaction(epochs[pds::EpochSys::tid].ui);
+        tickets[pds::EpochSys::tid].ui = ticket;
+        return ticket;
+    }
+    // a read may have observed writes of its own epoch, so it gets a
+    // ticket as well.
+    uint64_t end_readonly_op(){
+        uint64_t ticket = epochs[pds::EpochSys::tid].ui;
+        assert(ticket != NULL_EPOCH);
+        if (ticket != NULL_EPOCH){
+            _esys->end_readonly_transaction(ticket);
             epochs[pds::EpochSys::tid].ui = NULL_EPOCH;
         }
         assert(pending_allocs[pds::EpochSys::tid].ui.empty());
+        tickets[pds::EpochSys::tid].ui = ticket;
+        return ticket;
     }
     void abort_op(){
         assert(epochs[pds::EpochSys::tid].ui != NULL_EPOCH);
@@ -298,6 +310,11 @@ public:
     void register_update_pblk(T* b){
         _esys->register_update_pblk(b, epochs[pds::EpochSys::tid].ui);
     }
+    // register an in-place update of sz bytes at field, inside b.
+    template<typename T>
+    void register_update_field(T* b, const void* field, size_t sz){
+        _esys->register_update_field(b, field, sz, epochs[pds::EpochSys::tid].ui);
+    }
     template<typename T>
     void pdelete(T* b){
         ASSERT_DERIVE(T, pds::PBlk);
@@ -355,9 +372,32 @@ public:
     std::unordered_map<uint64_t, pds::PBlk*>* recover_pblks(const int rec_thd=10){
         return _esys->recover(rec_thd);
     }
+    // stream live blocks to on_shard from inside the recovery threads.
+    // see pds::EpochSys::RecoverCallback.
+    void recover_pblks(const pds::EpochSys::RecoverCallback& on_shard, const int rec_thd=10){
+        _esys->recover(on_shard, rec_thd);
+    }
     void sync(){
         _esys->sync(epochs[pds::EpochSys::tid].ui);
     }
+    // durability tickets, see pds::EpochSys::is_durable() and friends.
+    // unlike sync(), these let a thread acknowledge operations in batches
+    // as the durable frontier passes them.
+    uint64_t last_ticket(){
+        return tickets[pds::EpochSys::tid].ui;
+    }
+    bool is_durable(uint64_t ticket){
+        return _esys->is_durable(ticket);
+    }
+    void wait_durable(uint64_t ticket){
+        _esys->wait_durable(ticket);
+    }
+    void on_durable(uint64_t ticket, const std::function<void()>& f){
+        _esys->on_durable(ticket, f);
+    }
+    int durability_fd(){
+        return _esys->durability_fd();
+    }
     void recover_mode(){
         _esys->sys_mode = pds::RECOVER; // PDELETE -> nop
     }
@@ -386,6 +426,20 @@ public:
 // macro for concatenating two tokens into a new token
 #define TOKEN_CONCAT(a,b)  a ## b
 
+namespace pds{
+    // bytes of a field that an assignment may have written. types with a
+    // variable-length tail (e.g., PString) report their used prefix by
+    // extent(); everything else is written as a whole.
+    template<typename F>
+    inline auto field_extent(const F& f, int) -> decltype(f.extent()){
+        return f.extent();
+    }
+    template<typename F>
+    inline size_t field_extent(const F& f, long){
+        return sizeof(F);
+    }
+}
+
 /**
  *  using the type t and the name n, generate a protected declaration for the
  *  field, as well as public getters and setters
@@ -404,12 +458,19 @@ t TOKEN_CONCAT(get_unsafe_, n)(Recoverable* ds) const{\
     return ds->openread_pblk_unsafe(this)->TOKEN_CONCAT(m_, n);\
 }\
 /* set method open a pblk for write. return a new copy when necessary */\
+/* a new copy is written back as a whole; otherwise the block was */\
+/* already registered in this epoch and only the field is. */\
 template <class in_type>\
 T* TOKEN_CONCAT(set_, n)(Recoverable* ds, const in_type& TOKEN_CONCAT(tmp_, n)){\
     assert(ds->get_local_epoch() != NULL_EPOCH);\
     auto ret = ds->openwrite_pblk(this);\
     ret->TOKEN_CONCAT(m_, n) = TOKEN_CONCAT(tmp_, n);\
-    ds->register_update_pblk(ret);\
+    if (ret == this){\
+        ds->register_update_field(ret, &ret->TOKEN_CONCAT(m_, n),\
+            pds::field_extent(ret->TOKEN_CONCAT(m_, n), 0));\
+    } else {\
+        ds->register_update_pblk(ret);\
+    }\
     return ret;\
 }\
 /* set the field by the parameter. called only outside BEGIN_OP and END_OP */\
@@ -439,7 +500,12 @@ T* TOKEN_CONCAT(set_, n)(Recoverable* ds, int i, t TOKEN_CONCAT(tmp_, n)){\
     assert(ds->get_local_epoch() != NULL_EPOCH);\
     auto ret = ds->openwrite_pblk(this);\
     ret->TOKEN_CONCAT(m_, n)[i] = TOKEN_CONCAT(tmp_, n);\
-    ds->register_update_pblk(ret);\
+    if (ret == this){\
+        ds->register_update_field(ret, &ret->TOKEN_CONCAT(m_, n)[i],\
+            pds::field_extent(ret->TOKEN_CONCAT(m_, n)[i], 0));\
+    } else {\
+        ds->register_update_pblk(ret);\
+    }\
     return ret;\
 }
 
@@ -3,13 +3,51 @@
 
 #include "ConcurrentPrimitives.hpp"
 #include "HarnessUtils.hpp"
+#include "PersistFunc.hpp"
 #include <atomic>
+#include <algorithm>
 #include <vector>
 #include <unordered_set>
 #include <functional>
 
+// Persistent high-water marks of UIDGenerator, kept behind a Ralloc root
+// by EpochSys. No thread ever handed out an id at or beyond its mark, so a
+// restarted generator resumes from the marks without rescanning the heap.
+struct UIDMarks{
+    int shift;
+    uint64_t count;
+    // count marks follow the header.
+    uint64_t* marks(){
+        return (uint64_t*)((char*)this + sizeof(UIDMarks));
+    }
+    const uint64_t* marks() const{
+        return (const uint64_t*)((const char*)this + sizeof(UIDMarks));
+    }
+    static size_t alloc_size(uint64_t count){
+        return sizeof(UIDMarks) + count*sizeof(uint64_t);
+    }
+};
+
 class UIDGenerator{
-    padded<uint64_t>* curr_ids = nullptr;
+    struct IDRange{
+        uint64_t curr;
+        // ids below limit are covered by the persistent mark.
+        uint64_t limit;
+    };
+    padded<IDRange>* curr_ids = nullptr;
+    UIDMarks* persisted = nullptr;
+    int shift = 64;
+    uint64_t max = 1;
+    // ids reserved per persistent mark update.
+    static const uint64_t reserve_size = 1ULL << 16;
+
+    void reserve(int tid){
+        IDRange& r = curr_ids[tid].ui;
+        r.limit = r.curr + reserve_size;
+        persisted->marks()[tid] = r.limit;
+        persist_func::clwb(&persisted->marks()[tid]);
+        persist_func::sfence();
+    }
 public:
     UIDGenerator(){}
     UIDGenerator(uint64_t task_num){
@@ -22,21 +60,57 @@ public:
     }
     void init(uint64_t task_num){
         uint64_t buf = task_num-1;
-        int shift = 64;
-        uint64_t max = 1;
+        shift = 64;
+        max = 1;
         for (; buf != 0; buf >>= 1){
             shift--;
             max <<= 1;
         }
         if (!curr_ids){
-            curr_ids = new padded<uint64_t>[max];
+            curr_ids = new padded<IDRange>[max];
         }
         for (uint64_t i = 0; i < max; i++){
-            curr_ids[i].ui = i << shift;
+            curr_ids[i].ui.curr = shift == 64 ? 0 : i << shift;
+            curr_ids[i].ui.limit = UINT64_MAX;
         }
     }
+    uint64_t get_count(){
+        return max;
+    }
+    // Make marks the persistent high-water marks of this generator, which
+    // must have room for get_count() entries. If prev (the marks of a
+    // previous run, possibly marks itself) is given, every thread first skips
+    // past all ids handed out by any previous thread whose range overlaps its
+    // own, as the previous run may have had a different thread count.
+    void bind(UIDMarks* marks, const UIDMarks* prev = nullptr){
+        for (uint64_t i = 0; i < max; i++){
+            IDRange& r = curr_ids[i].ui;
+            uint64_t begin = shift == 64 ? 0 : i << shift;
+            uint64_t end = (shift == 64 || i == max-1) ? UINT64_MAX : (i+1) << shift;
+            for (uint64_t j = 0; prev && j < prev->count; j++){
+                uint64_t prev_begin = prev->shift == 64 ? 0 : j << prev->shift;
+                uint64_t prev_mark = prev->marks()[j];
+                if (prev_begin < end && prev_mark > begin){
+                    r.curr = std::max(r.curr, std::min(prev_mark, end));
+                }
+            }
+            // force a reservation (and a persisted mark) on first get_id().
+            r.limit = r.curr;
+        }
+        for (uint64_t i = 0; i < max; i++){
+            marks->marks()[i] = curr_ids[i].ui.curr;
+        }
+        marks->count = max;
+        marks->shift = shift;
+        persist_func::clwb_range(marks, UIDMarks::alloc_size(max));
+        persisted = marks;
+    }
     uint64_t get_id(int tid){
-        return curr_ids[tid].ui++;
+        IDRange& r = curr_ids[tid].ui;
+        if (r.curr == r.limit){
+            reserve(tid);
+        }
+        return r.curr++;
     }
 };
 
@@ -0,0 +1,1181 @@
+#ifndef MONTAGE_ART_P
+#define MONTAGE_ART_P
+
+/*
+ * An adaptive radix tree (Leis, Kemper and Neumann, ICDE'13) synchronized
+ * by optimistic lock coupling as in ART-OLC (Leis et al., DaMoN'16). The
+ * trie is transient: inner nodes adapt between 4, 16, 48 and 256 children
+ * and keep the whole compressed path as their prefix, and leaves keep a
+ * copy of their key next to the persistent key/value payload. Lookups
+ * therefore touch NVM only for the payload they return.
+ *
+ * Leaves are immutable; an update replaces the leaf in its parent. Obsolete
+ * nodes and replaced leaves go through an RCU tracker, and a leaf retired
+ * by an update reclaims its payload when the tracker frees it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <emmintrin.h>
+
+#include <iostream>
+#include <atomic>
+#include <algorithm>
+#include <functional>
+#include <vector>
+#include <utility>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <type_traits>
+
+#include "HarnessUtils.hpp"
+#include "ConcurrentPrimitives.hpp"
+#include "ROrderedMap.hpp"
+#include "RCUTracker.hpp"
+#include "CustomTypes.hpp"
+#include "Recoverable.hpp"
+
+// binary-comparable encodings of keys: byte-wise order of the encodings
+// is the order of the keys, and no encoding is a prefix of another.
+template <class K>
+struct MontageARTKey{
+    static_assert(std::is_integral<K>::value, "MontageART needs integral or string keys");
+    typedef typename std::make_unsigned<K>::type U;
+    static const unsigned MAX_LEN = sizeof(K);
+    static unsigned encode(const K& k, uint8_t* out){
+        U u = (U)k;
+        if (std::is_signed<K>::value){
+            u ^= (U)1 << (sizeof(K) * 8 - 1);
+        }
+        for (int i = sizeof(K) - 1; i >= 0; i--){
+            out[i] = u & 0xff;
+            u >>= 8;
+        }
+        return sizeof(K);
+    }
+    static K decode(const uint8_t* in, unsigned len){
+        U u = 0;
+        for (unsigned i = 0; i < sizeof(K); i++){
+            u = (u << 8) | in[i];
+        }
+        if (std::is_signed<K>::value){
+            u ^= (U)1 << (sizeof(K) * 8 - 1);
+        }
+        return (K)u;
+    }
+};
+
+// strings are terminated by a 0 byte, so they must not contain '\0'.
+template <>
+struct MontageARTKey<std::string>{
+    static const unsigned MAX_LEN = TESTS_KEY_SIZE + 1;
+    static unsigned encode(const std::string& k, uint8_t* out){
+        assert(k.size() <= TESTS_KEY_SIZE && "key is longer than TESTS_KEY_SIZE!");
+        memcpy(out, k.data(), k.size());
+        out[k.size()] = 0;
+        return k.size() + 1;
+    }
+    static std::string decode(const uint8_t* in, unsigned len){
+        return std::string((const char*)in, len - 1);
+    }
+};
+
+template <class K, class V>
+class MontageART : public ROrderedMap<K,V>, public Recoverable{
+public:
+    class Payload : public pds::PBlk{
+        GENERATE_FIELD(K, key, Payload);
+        GENERATE_FIELD(V, val, Payload);
+    public:
+        Payload(){}
+        Payload(K x, V y): m_key(x), m_val(y){}
+        Payload(const Payload& oth): pds::PBlk(oth), m_key(oth.m_key), m_val(oth.m_val){}
+        void persist(){}
+    };
+private:
+    typedef MontageARTKey<K> KeyTraits;
+    static const unsigned MAX_LEN = KeyTraits::MAX_LEN;
+
+    // an encoded search key. the bytes past len stay zero, so that reads
+    // driven by a torn prefix length stay in bounds.
+    struct KeyBuf{
+        unsigned len;
+        uint8_t bytes[2 * MAX_LEN + 1];
+        KeyBuf(const K& k){
+            memset(bytes, 0, sizeof(bytes));
+            len = KeyTraits::encode(k, bytes);
+        }
+    };
+
+    static inline int compare(const uint8_t* a, unsigned alen, const uint8_t* b, unsigned blen){
+        int c = memcmp(a, b, std::min(alen, blen));
+        if (c != 0){
+            return c;
+        }
+        return (alen < blen) ? -1 : (alen > blen ? 1 : 0);
+    }
+
+    // everything the tracker frees.
+    struct Reclaimable{
+        virtual ~Reclaimable(){}
+    };
+
+    enum NodeType : uint8_t { N4_T, N16_T, N48_T, N256_T };
+
+    struct NodeBase : public Reclaimable{
+        // bit 1 is the write lock and bit 0 marks a node replaced in its
+        // parent; every lock and unlock adds 0b10.
+        std::atomic<uint64_t> version;
+        NodeType type;
+        uint16_t count;
+        uint32_t prefix_len;
+        uint8_t prefix[MAX_LEN];
+        NodeBase(NodeType t, const uint8_t* p, uint32_t plen): version(0b100), type(t), count(0){
+            set_prefix(p, plen);
+        }
+
+        static inline bool locked_or_obsolete(uint64_t v){
+            return (v & 0b11) != 0;
+        }
+        uint64_t readLockOrRestart(bool& needRestart){
+            uint64_t v = version.load();
+            if (locked_or_obsolete(v)){
+                needRestart = true;
+            }
+            return v;
+        }
+        void readUnlockOrRestart(uint64_t v, bool& needRestart) const{
+            needRestart = (v != version.load());
+        }
+        void upgradeToWriteLockOrRestart(uint64_t& v, bool& needRestart){
+            if (version.compare_exchange_strong(v, v + 0b10)){
+                v = v + 0b10;
+            } else {
+                needRestart = true;
+            }
+        }
+        void writeLockOrRestart(bool& needRestart){
+            uint64_t v = readLockOrRestart(needRestart);
+            if (!needRestart){
+                upgradeToWriteLockOrRestart(v, needRestart);
+            }
+        }
+        void writeUnlock(){
+            version.fetch_add(0b10);
+        }
+        void writeUnlockObsolete(){
+            version.fetch_add(0b11);
+        }
+
+        void set_prefix(const uint8_t* p, uint32_t plen){
+            if (plen > 0){
+                memmove(prefix, p, plen);
+            }
+            prefix_len = plen;
+        }
+        // optimistic readers may see a torn length.
+        inline uint32_t safe_prefix_len() const{
+            return std::min<uint32_t>(prefix_len, MAX_LEN);
+        }
+    };
+
+    struct N4 : public NodeBase{
+        // sorted
+        uint8_t keys[4];
+        NodeBase* children[4] = {};
+        N4(const uint8_t* p, uint32_t plen): NodeBase(N4_T, p, plen){}
+    };
+    struct N16 : public NodeBase{
+        // sorted
+        uint8_t keys[16];
+        NodeBase* children[16] = {};
+        N16(const uint8_t* p, uint32_t plen): NodeBase(N16_T, p, plen){}
+    };
+    struct N48 : public NodeBase{
+        static const uint8_t EMPTY = 48;
+        uint8_t child_index[256];
+        NodeBase* children[48] = {};
+        N48(const uint8_t* p, uint32_t plen): NodeBase(N48_T, p, plen){
+            memset(child_index, EMPTY, sizeof(child_index));
+        }
+    };
+    struct N256 : public NodeBase{
+        NodeBase* children[256] = {};
+        N256(const uint8_t* p, uint32_t plen): NodeBase(N256_T, p, plen){}
+    };
+
+    struct Leaf : public Reclaimable{
+        MontageART* ds;
+        Payload* payload;
+        // incarnation of the tree the leaf was made in, see recover().
+        uint64_t incarnation;
+        // set when an update takes the leaf out, handing it its payload.
+        bool retired = false;
+        uint32_t len;
+        uint8_t key[MAX_LEN];
+        Leaf(MontageART* ds_, const KeyBuf& k, Payload* p): ds(ds_), payload(p), incarnation(ds_->incarnation), len(k.len){
+            memcpy(key, k.bytes, k.len);
+        }
+        ~Leaf(){
+            if (retired && incarnation == ds->incarnation){
+                ds->preclaim(payload);
+            }
+        }
+        bool matches(const KeyBuf& k) const{
+            return len == k.len && memcmp(key, k.bytes, len) == 0;
+        }
+    };
+
+    // children are tagged in the low bit when they are leaves.
+    static inline NodeBase* tag(Leaf* l){
+        return reinterpret_cast<NodeBase*>(reinterpret_cast<uintptr_t>(l) | 1);
+    }
+    static inline bool is_leaf(NodeBase* n){
+        return (reinterpret_cast<uintptr_t>(n) & 1) != 0;
+    }
+    static inline Leaf* as_leaf(NodeBase* n){
+        return reinterpret_cast<Leaf*>(reinterpret_cast<uintptr_t>(n) & ~(uintptr_t)1);
+    }
+
+    enum Mode { INSERT, PUT, REPLACE };
+
+    // a MontageOpHolder that recovery, which runs outside of operations,
+    // leaves out.
+    struct OpScope{
+        MontageART* ds;
+        OpScope(MontageART* ds_, bool online): ds(online ? ds_ : nullptr){
+            if (ds) ds->begin_op();
+        }
+        ~OpScope(){
+            if (ds) ds->end_op();
+        }
+    };
+
+    N256* root;
+    RCUTracker<Reclaimable> tracker;
+    GlobalTestConfig* gtc;
+    int task_num;
+    // bumped by every recover().
+    uint64_t incarnation = 0;
+    // scans validate against per-thread sequence numbers, odd while the
+    // thread is updating, as in MontageBTree. updaters bump theirs before
+    // taking any node lock.
+    static const int optimistic_scans = 4;
+    paddedAtomic<uint64_t>* update_seqs;
+    std::atomic<bool> scan_blocking;
+    std::mutex scan_lock;
+
+    inline void begin_update(int tid){
+        while(true){
+            update_seqs[tid].ui.fetch_add(1);
+            if(!scan_blocking.load()) return;
+            update_seqs[tid].ui.fetch_add(1);
+            while(scan_blocking.load());
+        }
+    }
+    inline void end_update(int tid){
+        update_seqs[tid].ui.fetch_add(1);
+    }
+
+    // recovery collects obsolete nodes in a graveyard and frees them at the end.
+    void retire_node(NodeBase* n, int tid, std::vector<NodeBase*>* graveyard){
+        if (graveyard){
+            graveyard->push_back(n);
+        } else {
+            tracker.retire(n, tid);
+        }
+    }
+
+    static NodeBase* get_child(NodeBase* n, uint8_t b);
+    static void insert_child(NodeBase* n, uint8_t b, NodeBase* child);
+    static void change_child(NodeBase* n, uint8_t b, NodeBase* child);
+    static void remove_child(NodeBase* n, uint8_t b);
+    static NodeBase* second_child(NodeBase* n, uint8_t b, uint8_t& second_b);
+    static int sorted_children(NodeBase* n, std::pair<uint8_t,NodeBase*>* out);
+    // fill a fresh node of a known type with sorted children, so that
+    // grow() and shrink() need no dispatch on the new node's type.
+    template <class N>
+    static NodeBase* fill_sorted(N* n, const std::pair<uint8_t,NodeBase*>* c, int cnt){
+        for (int i = 0; i < cnt; i++){
+            n->keys[i] = c[i].first;
+            n->children[i] = c[i].second;
+        }
+        n->count = cnt;
+        return n;
+    }
+    static NodeBase* fill_sorted(N48* n, const std::pair<uint8_t,NodeBase*>* c, int cnt){
+        for (int i = 0; i < cnt; i++){
+            n->child_index[c[i].first] = i;
+            n->children[i] = c[i].second;
+        }
+        n->count = cnt;
+        return n;
+    }
+    static NodeBase* fill_sorted(N256* n, const std::pair<uint8_t,NodeBase*>* c, int cnt){
+        for (int i = 0; i < cnt; i++){
+            n->children[c[i].first] = c[i].second;
+        }
+        n->count = cnt;
+        return n;
+    }
+    static bool is_full(NodeBase* n);
+    static bool is_underfull(NodeBase* n);
+    static NodeBase* grow(NodeBase* n);
+    static NodeBase* shrink(NodeBase* n);
+    static uint32_t match_prefix(NodeBase* n, const KeyBuf& k, uint32_t level);
+
+    Leaf* lookup(const KeyBuf& k);
+    Leaf* upsert(const KeyBuf& k, Leaf* leaf, Mode mode, optional<V>* old_val, int tid, std::vector<NodeBase*>* graveyard);
+    void insert_and_unlock(NodeBase* node, uint64_t v, NodeBase* parent, uint64_t parent_v, uint8_t parent_key,
+        uint8_t key, NodeBase* child, bool& needRestart, int tid, std::vector<NodeBase*>* graveyard);
+    Leaf* erase(const KeyBuf& k, optional<V>& res, int tid);
+    bool scan(NodeBase* node, uint32_t level, bool lo_tight, bool hi_tight, const KeyBuf& lo, const KeyBuf& hi, int limit, std::vector<Leaf*>& items);
+    void clear(NodeBase* n);
+
+public:
+    MontageART(GlobalTestConfig* gtc_) : Recoverable(gtc_), root(new N256(nullptr, 0)), tracker(gtc_->task_num, 100, 1000, true), gtc(gtc_){
+        task_num = gtc->task_num;
+        update_seqs = new paddedAtomic<uint64_t>[task_num]{};
+        scan_blocking.store(false);
+    };
+    ~MontageART(){};
+
+    void init_thread(GlobalTestConfig* gtc, LocalTestConfig* ltc){
+        Recoverable::init_thread(gtc, ltc);
+    }
+
+    int recover(bool simulated);
+
+    optional<V> get(K key, int tid);
+    optional<V> put(K key, V val, int tid);
+    bool insert(K key, V val, int tid);
+    optional<V> remove(K key, int tid);
+    optional<V> replace(K key, V val, int tid);
+    int range(K lo, K hi, int limit, std::function<void(const K&, const V&)> f, int tid);
+};
+
+template <class T>
+class MontageARTFactory : public RideableFactory{
+    Rideable* build(GlobalTestConfig* gtc){
+        return new MontageART<T,T>(gtc);
+    }
+};
+
+
+//-------Node operations----------
+// these may run on optimistically read nodes, so they bound every index
+// by the capacity of the node.
+template <class K, class V>
+typename MontageART<K,V>::NodeBase* MontageART<K,V>::get_child(NodeBase* n, uint8_t b){
+    switch (n->type){
+    case N4_T:{
+        N4* n4 = static_cast<N4*>(n);
+        unsigned cnt = std::min<unsigned>(n4->count, 4);
+        for (unsigned i = 0; i < cnt; i++){
+            if (n4->keys[i] == b){
+                return n4->children[i];
+            }
+        }
+        return nullptr;
+    }
+    case N16_T:{
+        N16* n16 = static_cast<N16*>(n);
+        __m128i cmp = _mm_cmpeq_epi8(_mm_set1_epi8((char)b), _mm_loadu_si128((const __m128i*)n16->keys));
+        unsigned mask = _mm_movemask_epi8(cmp) & ((1u << std::min<unsigned>(n16->count, 16)) - 1);
+        return mask ? n16->children[__builtin_ctz(mask)] : nullptr;
+    }
+    case N48_T:{
+        N48* n48 = static_cast<N48*>(n);
+        uint8_t idx = n48->child_index[b];
+        return idx < N48::EMPTY ? n48->children[idx] : nullptr;
+    }
+    default:
+        return static_cast<N256*>(n)->children[b];
+    }
+}
+
+template <class K, class V>
+void MontageART<K,V>::insert_child(NodeBase* n, uint8_t b, NodeBase* child){
+    switch (n->type){
+    case N4_T:{
+        N4* n4 = static_cast<N4*>(n);
+        unsigned pos = 0;
+        while (pos < n4->count && n4->keys[pos] < b) pos++;
+        memmove(n4->keys + pos + 1, n4->keys + pos, n4->count - pos);
+        memmove(n4->children + pos + 1, n4->children + pos, (n4->count - pos) * sizeof(NodeBase*));
+        n4->keys[pos] = b;
+        n4->children[pos] = child;
+        break;
+    }
+    case N16_T:{
+        N16* n16 = static_cast<N16*>(n);
+        unsigned pos = 0;
+        while (pos < n16->count && n16->keys[pos] < b) pos++;
+        memmove(n16->keys + pos + 1, n16->keys + pos, n16->count - pos);
+        memmove(n16->children + pos + 1, n16->children + pos, (n16->count - pos) * sizeof(NodeBase*));
+        n16->keys[pos] = b;
+        n16->children[pos] = child;
+        break;
+    }
+    case N48_T:{
+        N48* n48 = static_cast<N48*>(n);
+        // removals leave holes; take the first one.
+        unsigned pos = 0;
+        while (pos < 48 && n48->children[pos] != nullptr) pos++;
+        assert(pos < 48);
+        n48->children[pos] = child;
+        n48->child_index[b] = pos;
+        break;
+    }
+    default:
+        static_cast<N256*>(n)->children[b] = child;
+    }
+    n->count++;
+}
+
+template <class K, class V>
+void MontageART<K,V>::change_child(NodeBase* n, uint8_t b, NodeBase* child){
+    switch (n->type){
+    case N4_T:{
+        N4* n4 = static_cast<N4*>(n);
+        for (unsigned i = 0; i < n4->count; i++){
+            if (n4->keys[i] == b){
+                n4->children[i] = child;
+                return;
+            }
+        }
+        break;
+    }
+    case N16_T:{
+        N16* n16 = static_cast<N16*>(n);
+        for (unsigned i = 0; i < n16->count; i++){
+            if (n16->keys[i] == b){
+                n16->children[i] = child;
+                return;
+            }
+        }
+        break;
+    }
+    case N48_T:{
+        N48* n48 = static_cast<N48*>(n);
+        n48->children[n48->child_index[b]] = child;
+        return;
+    }
+    default:
+        static_cast<N256*>(n)->children[b] = child;
+        return;
+    }
+    assert(false && "changing a child that does not exist");
+}
+
+template <class K, class V>
+void MontageART<K,V>::remove_child(NodeBase* n, uint8_t b){
+    switch (n->type){
+    case N4_T:{
+        N4* n4 = static_cast<N4*>(n);
+        unsigned pos = 0;
+        while (n4->keys[pos] != b) pos++;
+        memmove(n4->keys + pos, n4->keys + pos + 1, n4->count - pos - 1);
+        memmove(n4->children + pos, n4->children + pos + 1, (n4->count - pos - 1) * sizeof(NodeBase*));
+        break;
+    }
+    case N16_T:{
+        N16* n16 = static_cast<N16*>(n);
+        unsigned pos = 0;
+        while (n16->keys[pos] != b) pos++;
+        memmove(n16->keys + pos, n16->keys + pos + 1, n16->count - pos - 1);
+        memmove(n16->children + pos, n16->children + pos + 1, (n16->count - pos - 1) * sizeof(NodeBase*));
+        break;
+    }
+    case N48_T:{
+        N48* n48 = static_cast<N48*>(n);
+        n48->children[n48->child_index[b]] = nullptr;
+        n48->child_index[b] = N48::EMPTY;
+        break;
+    }
+    default:
+        static_cast<N256*>(n)->children[b] = nullptr;
+    }
+    n->count--;
+}
+
+// the child of a two-child N4 other than the one at b.
+template <class K, class V>
+typename MontageART<K,V>::NodeBase* MontageART<K,V>::second_child(NodeBase* n, uint8_t b, uint8_t& second_b){
+    N4* n4 = static_cast<N4*>(n);
+    unsigned i = (n4->keys[0] == b) ? 1 : 0;
+    second_b = n4->keys[i];
+    return n4->children[i];
+}
+
+// children of n in key order; out must hold 256.
+template <class K, class V>
+int MontageART<K,V>::sorted_children(NodeBase* n, std::pair<uint8_t,NodeBase*>* out){
+    int cnt = 0;
+    switch (n->type){
+    case N4_T:{
+        N4* n4 = static_cast<N4*>(n);
+        unsigned c = std::min<unsigned>(n4->count, 4);
+        for (unsigned i = 0; i < c; i++){
+            out[cnt++] = {n4->keys[i], n4->children[i]};
+        }
+        break;
+    }
+    case N16_T:{
+        N16* n16 = static_cast<N16*>(n);
+        unsigned c = std::min<unsigned>(n16->count, 16);
+        for (unsigned i = 0; i < c; i++){
+            out[cnt++] = {n16->keys[i], n16->children[i]};
+        }
+        break;
+    }
+    case N48_T:{
+        N48* n48 = static_cast<N48*>(n);
+        for (unsigned b = 0; b < 256; b++){
+            uint8_t idx = n48->child_index[b];
+            if (idx < N48::EMPTY && n48->children[idx] != nullptr){
+                out[cnt++] = {(uint8_t)b, n48->children[idx]};
+            }
+        }
+        break;
+    }
+    default:{
+        N256* n256 = static_cast<N256*>(n);
+        for (unsigned b = 0; b < 256; b++){
+            if (n256->children[b] != nullptr){
+                out[cnt++] = {(uint8_t)b, n256->children[b]};
+            }
+        }
+    }
+    }
+    return cnt;
+}
+
+template <class K, class V>
+bool MontageART<K,V>::is_full(NodeBase* n){
+    switch (n->type){
+    case N4_T: return n->count == 4;
+    case N16_T: return n->count == 16;
+    case N48_T: return n->count == 48;
+    default: return false;
+    }
+}
+
+// nodes shrink once they are well below the capacity of the next smaller
+// type, so that a key inserted and removed at the boundary does not make
+// them flip back and forth.
+template <class K, class V>
+bool MontageART<K,V>::is_underfull(NodeBase* n){
+    switch (n->type){
+    case N16_T: return n->count <= 3;
+    case N48_T: return n->count <= 12;
+    case N256_T: return n->count <= 37;
+    default: return false;
+    }
+}
+
+// a copy of n with the next larger type.
+template <class K, class V>
+typename MontageART<K,V>::NodeBase* MontageART<K,V>::grow(NodeBase* n){
+    std::pair<uint8_t,NodeBase*> children[256];
+    int cnt = sorted_children(n, children);
+    switch (n->type){
+    case N4_T: return fill_sorted(new N16(n->prefix, n->prefix_len), children, cnt);
+    case N16_T: return fill_sorted(new N48(n->prefix, n->prefix_len), children, cnt);
+    default: return fill_sorted(new N256(n->prefix, n->prefix_len), children, cnt);
+    }
+}
+
+// a copy of n with the next smaller type.
+template <class K, class V>
+typename MontageART<K,V>::NodeBase* MontageART<K,V>::shrink(NodeBase* n){
+    std::pair<uint8_t,NodeBase*> children[256];
+    int cnt = sorted_children(n, children);
+    switch (n->type){
+    case N16_T: return fill_sorted(new N4(n->prefix, n->prefix_len), children, cnt);
+    case N48_T: return fill_sorted(new N16(n->prefix, n->prefix_len), children, cnt);
+    default: return fill_sorted(new N48(n->prefix, n->prefix_len), children, cnt);
+    }
+}
+
+// number of leading prefix bytes of n that match k from level on.
+template <class K, class V>
+uint32_t MontageART<K,V>::match_prefix(NodeBase* n, const KeyBuf& k, uint32_t level){
+    uint32_t plen = n->safe_prefix_len();
+    for (uint32_t i = 0; i < plen; i++){
+        if (n->prefix[i] != k.bytes[level + i]){
+            return i;
+        }
+    }
+    return plen;
+}
+
+
+//-------Definition----------
+// drop the nodes and leaves under n, leaving payloads alone. no
+// concurrent ops.
+template <class K, class V>
+void MontageART<K,V>::clear(NodeBase* n){
+    if (is_leaf(n)){
+        delete as_leaf(n);
+        return;
+    }
+    std::pair<uint8_t,NodeBase*> children[256];
+    int cnt = sorted_children(n, children);
+    for (int i = 0; i < cnt; i++){
+        clear(children[i].second);
+    }
+    delete n;
+}
+
+template <class K, class V>
+int MontageART<K,V>::recover(bool simulated){
+    if (simulated){
+        recover_mode(); // PDELETE --> noop
+        // clear transient structures.
+        clear(root);
+        online_mode(); // re-enable PDELETE.
+    } else {
+        clear(root);
+    }
+    // leaves retired before the crash may still be in the tracker.
+    incarnation++;
+    root = new N256(nullptr, 0);
+
+    int rec_thd = 10;
+    if (gtc->checkEnv("RecoverThread")){
+        rec_thd = stoi(gtc->getEnv("RecoverThread"));
+    }
+    // each recovery thread inserts the payloads of its shard; the inserts
+    // synchronize among themselves as online ones do.
+    std::vector<std::vector<NodeBase*>> graveyards(rec_thd);
+    std::atomic<int> rec_cnt(0);
+    auto begin = chrono::high_resolution_clock::now();
+    recover_pblks([&](const std::vector<pds::PBlk*>& blks, int shard){
+        for (pds::PBlk* blk : blks){
+            Payload* payload = reinterpret_cast<Payload*>(blk);
+            KeyBuf k((K)payload->get_unsafe_key(this));
+            if (upsert(k, new Leaf(this, k, payload), INSERT, nullptr, -1, &graveyards[shard]) != nullptr){
+                errexit("conflicting keys recovered.");
+            }
+        }
+        rec_cnt.fetch_add(blks.size(), std::memory_order_relaxed);
+    }, rec_thd);
+    for (auto& g : graveyards){
+        for (NodeBase* n : g){
+            delete n;
+        }
+    }
+    auto end = chrono::high_resolution_clock::now();
+    auto dur_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count();
+    std::cout << "Spent " << dur_ms << "ms recovering and inserting PBlk(" << rec_cnt.load() << ")" << std::endl;
+    std::cout << "Total time to recover: " << dur_ms << "ms" << std::endl;
+    return rec_cnt.load();
+}
+
+template <class K, class V>
+typename MontageART<K,V>::Leaf* MontageART<K,V>::lookup(const KeyBuf& k){
+    while(true){
+        bool restart = false;
+        NodeBase* node = root;
+        uint64_t v = node->readLockOrRestart(restart);
+        if (restart) continue;
+        uint32_t level = 0;
+        while(true){
+            uint32_t plen = node->safe_prefix_len();
+            if (match_prefix(node, k, level) < plen){
+                node->readUnlockOrRestart(v, restart);
+                if (restart) break;
+                return nullptr;
+            }
+            level += plen;
+            NodeBase* next = get_child(node, k.bytes[level]);
+            node->readUnlockOrRestart(v, restart);
+            if (restart) break;
+            if (next == nullptr){
+                return nullptr;
+            }
+            if (is_leaf(next)){
+                // leaves never change, and this one is protected by the tracker.
+                Leaf* leaf = as_leaf(next);
+                return leaf->matches(k) ? leaf : nullptr;
+            }
+            level++;
+            uint64_t nv = next->readLockOrRestart(restart);
+            if (restart) break;
+            node = next;
+            v = nv;
+        }
+    }
+}
+
+// grow node if it has to, and put child at key in it.
+template <class K, class V>
+void MontageART<K,V>::insert_and_unlock(NodeBase* node, uint64_t v, NodeBase* parent, uint64_t parent_v, uint8_t parent_key,
+    uint8_t key, NodeBase* child, bool& needRestart, int tid, std::vector<NodeBase*>* graveyard){
+    if (!is_full(node)){
+        node->upgradeToWriteLockOrRestart(v, needRestart);
+        if (needRestart) return;
+        {
+            OpScope _op(this, graveyard == nullptr);
+            insert_child(node, key, child);
+        }
+        node->writeUnlock();
+        return;
+    }
+    // the root never fills up, so there is a parent.
+    parent->upgradeToWriteLockOrRestart(parent_v, needRestart);
+    if (needRestart) return;
+    node->upgradeToWriteLockOrRestart(v, needRestart);
+    if (needRestart){
+        parent->writeUnlock();
+        return;
+    }
+    NodeBase* big = grow(node);
+    insert_child(big, key, child);
+    {
+        OpScope _op(this, graveyard == nullptr);
+        change_child(parent, parent_key, big);
+    }
+    node->writeUnlockObsolete();
+    parent->writeUnlock();
+    retire_node(node, tid, graveyard);
+}
+
+// publish leaf for k unless mode says otherwise, and return the leaf that
+// k had, or nullptr. an INSERT leaves an existing leaf in place, a PUT
+// replaces it and a REPLACE does nothing when k is absent. the value of
+// a replaced leaf goes to old_val.
+template <class K, class V>
+typename MontageART<K,V>::Leaf* MontageART<K,V>::upsert(const KeyBuf& k, Leaf* leaf, Mode mode, optional<V>* old_val, int tid, std::vector<NodeBase*>* graveyard){
+    bool online = (graveyard == nullptr);
+    while(true){
+        bool restart = false;
+        NodeBase* node = nullptr;
+        NodeBase* next = root;
+        NodeBase* parent = nullptr;
+        uint8_t parent_key = 0, node_key = 0;
+        uint64_t parent_v = 0;
+        uint32_t level = 0;
+        while(true){
+            parent = node;
+            parent_key = node_key;
+            node = next;
+            uint64_t v = node->readLockOrRestart(restart);
+            if (restart) break;
+
+            uint32_t plen = node->safe_prefix_len();
+            uint32_t matched = match_prefix(node, k, level);
+            if (matched < plen){
+                if (mode == REPLACE){
+                    node->readUnlockOrRestart(v, restart);
+                    if (restart) break;
+                    return nullptr;
+                }
+                // split the prefix: a new N4 takes the matched part and
+                // holds node and the leaf.
+                parent->upgradeToWriteLockOrRestart(parent_v, restart);
+                if (restart) break;
+                node->upgradeToWriteLockOrRestart(v, restart);
+                if (restart){
+                    parent->writeUnlock();
+                    break;
+                }
+                N4* n4 = new N4(node->prefix, matched);
+                insert_child(n4, k.bytes[level + matched], tag(leaf));
+                insert_child(n4, node->prefix[matched], node);
+                {
+                    OpScope _op(this, online);
+                    change_child(parent, parent_key, n4);
+                }
+                parent->writeUnlock();
+                node->set_prefix(node->prefix + matched + 1, plen - matched - 1);
+                node->writeUnlock();
+                return nullptr;
+            }
+            level += plen;
+            node_key = k.bytes[level];
+            next = get_child(node, node_key);
+            node->readUnlockOrRestart(v, restart);
+            if (restart) break;
+
+            if (next == nullptr){
+                if (mode == REPLACE){
+                    return nullptr;
+                }
+                insert_and_unlock(node, v, parent, parent_v, parent_key, node_key, tag(leaf), restart, tid, graveyard);
+                if (restart) break;
+                return nullptr;
+            }
+            if (parent){
+                parent->readUnlockOrRestart(parent_v, restart);
+                if (restart) break;
+            }
+            if (is_leaf(next)){
+                Leaf* old = as_leaf(next);
+                bool same = old->matches(k);
+                if ((same && mode == INSERT) || (!same && mode == REPLACE)){
+                    node->readUnlockOrRestart(v, restart);
+                    if (restart) break;
+                    return same ? old : nullptr;
+                }
+                node->upgradeToWriteLockOrRestart(v, restart);
+                if (restart) break;
+                if (same){
+                    {
+                        OpScope _op(this, online);
+                        if (old_val) *old_val = (V)old->payload->get_unsafe_val(this);// old see new is impossible under the lock
+                        pretire(old->payload);
+                        change_child(node, node_key, tag(leaf));
+                    }
+                    node->writeUnlock();
+                    return old;
+                }
+                // lazy expansion: push both leaves down into an N4 that
+                // takes their common bytes as its prefix.
+                level++;
+                uint32_t common = 0;
+                while (old->key[level + common] == k.bytes[level + common]){
+                    common++;
+                }
+                N4* n4 = new N4(k.bytes + level, common);
+                insert_child(n4, k.bytes[level + common], tag(leaf));
+                insert_child(n4, old->key[level + common], next);
+                {
+                    OpScope _op(this, online);
+                    change_child(node, node_key, n4);
+                }
+                node->writeUnlock();
+                return nullptr;
+            }
+            level++;
+            parent_v = v;
+        }
+    }
+}
+
+// unlink the leaf of k and return it, or nullptr if k is absent.
+template <class K, class V>
+typename MontageART<K,V>::Leaf* MontageART<K,V>::erase(const KeyBuf& k, optional<V>& res, int tid){
+    while(true){
+        bool restart = false;
+        NodeBase* node = nullptr;
+        NodeBase* next = root;
+        NodeBase* parent = nullptr;
+        uint8_t parent_key = 0, node_key = 0;
+        uint64_t parent_v = 0;
+        uint32_t level = 0;
+        while(true){
+            parent = node;
+            parent_key = node_key;
+            node = next;
+            uint64_t v = node->readLockOrRestart(restart);
+            if (restart) break;
+
+            uint32_t plen = node->safe_prefix_len();
+            if (match_prefix(node, k, level) < plen){
+                node->readUnlockOrRestart(v, restart);
+                if (restart) break;
+                return nullptr;
+            }
+            level += plen;
+            node_key = k.bytes[level];
+            next = get_child(node, node_key);
+            node->readUnlockOrRestart(v, restart);
+            if (restart) break;
+            if (next == nullptr){
+                return nullptr;
+            }
+            if (!is_leaf(next)){
+                level++;
+                parent_v = v;
+                continue;
+            }
+            Leaf* old = as_leaf(next);
+            if (!old->matches(k)){
+                node->readUnlockOrRestart(v, restart);
+                if (restart) break;
+                return nullptr;
+            }
+            if (parent && node->type == N4_T && node->count == 2){
+                // node goes away and its other child takes its place,
+                // absorbing its prefix.
+                parent->upgradeToWriteLockOrRestart(parent_v, restart);
+                if (restart) break;
+                node->upgradeToWriteLockOrRestart(v, restart);
+                if (restart){
+                    parent->writeUnlock();
+                    break;
+                }
+                uint8_t second_key;
+                NodeBase* second = second_child(node, node_key, second_key);
+                if (!is_leaf(second)){
+                    second->writeLockOrRestart(restart);
+                    if (restart){
+                        node->writeUnlock();
+                        parent->writeUnlock();
+                        break;
+                    }
+                }
+                {
+                    MontageOpHolder _holder(this);
+                    res = (V)old->payload->get_unsafe_val(this);// old see new is impossible under the lock
+                    pretire(old->payload);
+                    change_child(parent, parent_key, second);
+                }
+                parent->writeUnlock();
+                if (!is_leaf(second)){
+                    uint32_t plen2 = second->prefix_len;
+                    memmove(second->prefix + plen + 1, second->prefix, plen2);
+                    memcpy(second->prefix, node->prefix, plen);
+                    second->prefix[plen] = second_key;
+                    second->prefix_len = plen + 1 + plen2;
+                    second->writeUnlock();
+                }
+                node->writeUnlockObsolete();
+                retire_node(node, tid, nullptr);
+            } else if (parent && is_underfull(node)){
+                parent->upgradeToWriteLockOrRestart(parent_v, restart);
+                if (restart) break;
+                node->upgradeToWriteLockOrRestart(v, restart);
+                if (restart){
+                    parent->writeUnlock();
+                    break;
+                }
+                NodeBase* small = shrink(node);
+                remove_child(small, node_key);
+                {
+                    MontageOpHolder _holder(this);
+                    res = (V)old->payload->get_unsafe_val(this);// old see new is impossible under the lock
+                    pretire(old->payload);
+                    change_child(parent, parent_key, small);
+                }
+                node->writeUnlockObsolete();
+                parent->writeUnlock();
+                retire_node(node, tid, nullptr);
+            } else {
+                node->upgradeToWriteLockOrRestart(v, restart);
+                if (restart) break;
+                {
+                    MontageOpHolder _holder(this);
+                    res = (V)old->payload->get_unsafe_val(this);// old see new is impossible under the lock
+                    pretire(old->payload);
+                    remove_child(node, node_key);
+                }
+                node->writeUnlock();
+            }
+            return old;
+        }
+    }
+}
+
+template <class K, class V>
+optional<V> MontageART<K,V>::get(K key, int tid) {
+    optional<V> res={};
+    KeyBuf k(key);
+    tracker.start_op(tid);
+    Leaf* leaf = lookup(k);
+    if (leaf){
+        MontageOpHolder _holder(this);
+        res=(V)leaf->payload->get_unsafe_val(this);//never old see new as we find payload before BEGIN_OP
+    }
+    tracker.end_op(tid);
+    return res;
+}
+
+template <class K, class V>
+optional<V> MontageART<K,V>::put(K key, V val, int tid) {
+    optional<V> res={};
+    KeyBuf k(key);
+    Payload* payload = pnew<Payload>(key,val);
+    Leaf* leaf = new Leaf(this, k, payload);
+    tracker.start_op(tid);
+    begin_update(tid);
+    Leaf* old = upsert(k, leaf, PUT, &res, tid, nullptr);
+    end_update(tid);
+    if (old){
+        old->retired = true;
+        tracker.retire(old, tid);
+    }
+    tracker.end_op(tid);
+    return res;
+}
+
+template <class K, class V>
+bool MontageART<K,V>::insert(K key, V val, int tid){
+    KeyBuf k(key);
+    Payload* payload = pnew<Payload>(key,val);
+    Leaf* leaf = new Leaf(this, k, payload);
+    tracker.start_op(tid);
+    begin_update(tid);
+    Leaf* old = upsert(k, leaf, INSERT, nullptr, tid, nullptr);
+    end_update(tid);
+    tracker.end_op(tid);
+    if (old){
+        // never published, directly reclaiming
+        pdelete(payload);
+        delete leaf;
+    }
+    return old == nullptr;
+}
+
+template <class K, class V>
+optional<V> MontageART<K,V>::remove(K key, int tid) {
+    optional<V> res={};
+    KeyBuf k(key);
+    tracker.start_op(tid);
+    begin_update(tid);
+    Leaf* old = erase(k, res, tid);
+    end_update(tid);
+    if (old){
+        old->retired = true;
+        tracker.retire(old, tid);
+    }
+    tracker.end_op(tid);
+    return res;
+}
+
+template <class K, class V>
+optional<V> MontageART<K,V>::replace(K key, V val, int tid) {
+    optional<V> res={};
+    KeyBuf k(key);
+    Payload* payload = pnew<Payload>(key,val);
+    Leaf* leaf = new Leaf(this, k, payload);
+    tracker.start_op(tid);
+    begin_update(tid);
+    Leaf* old = upsert(k, leaf, REPLACE, &res, tid, nullptr);
+    end_update(tid);
+    if (old){
+        old->retired = true;
+        tracker.retire(old, tid);
+    } else {
+        // never published, directly reclaiming
+        pdelete(payload);
+        delete leaf;
+    }
+    tracker.end_op(tid);
+    return res;
+}
+
+// collect the leaves in [lo, hi] under node in key order, depth first.
+// lo_tight and hi_tight say whether the path to node equals lo, resp.
+// hi, so far. returns false if a node changed while being read.
+template <class K, class V>
+bool MontageART<K,V>::scan(NodeBase* node, uint32_t level, bool lo_tight, bool hi_tight,
+    const KeyBuf& lo, const KeyBuf& hi, int limit, std::vector<Leaf*>& items){
+    bool restart = false;
+    uint64_t v = node->readLockOrRestart(restart);
+    if (restart) return false;
+    uint32_t plen = node->safe_prefix_len();
+    uint8_t prefix[MAX_LEN];
+    memcpy(prefix, node->prefix, plen);
+    std::pair<uint8_t,NodeBase*> children[256];
+    int cnt = sorted_children(node, children);
+    node->readUnlockOrRestart(v, restart);
+    if (restart) return false;
+
+    for (uint32_t i = 0; i < plen && (lo_tight || hi_tight); i++){
+        if (lo_tight && prefix[i] != lo.bytes[level + i]){
+            if (prefix[i] < lo.bytes[level + i]){
+                return true;// all below lo
+            }
+            lo_tight = false;
+        }
+        if (hi_tight && prefix[i] != hi.bytes[level + i]){
+            if (prefix[i] > hi.bytes[level + i]){
+                return true;// all above hi
+            }
+            hi_tight = false;
+        }
+    }
+    level += plen;
+    for (int i = 0; i < cnt; i++){
+        uint8_t b = children[i].first;
+        if (lo_tight && b < lo.bytes[level]){
+            continue;
+        }
+        if (hi_tight && b > hi.bytes[level]){
+            break;
+        }
+        NodeBase* child = children[i].second;
+        if (is_leaf(child)){
+            Leaf* leaf = as_leaf(child);
+            if (compare(leaf->key, leaf->len, lo.bytes, lo.len) >= 0 &&
+                compare(leaf->key, leaf->len, hi.bytes, hi.len) <= 0){
+                items.push_back(leaf);
+            }
+        } else if (!scan(child, level + 1, lo_tight && b == lo.bytes[level], hi_tight && b == hi.bytes[level], lo, hi, limit, items)){
+            return false;
+        }
+        if (limit > 0 && (int)items.size() >= limit){
+            return true;
+        }
+    }
+    return true;
+}
+
+// the leaves collected are a snapshot if no thread updated while
+// collecting, i.e., no sequence number was odd or moved. values are read
+// once the snapshot is taken, under a single read-only op.
+template <class K, class V>
+int MontageART<K,V>::range(K lo, K hi, int limit, std::function<void(const K&, const V&)> f, int tid){
+    std::vector<Leaf*> items;
+    std::vector<uint64_t> seqs(task_num);
+    KeyBuf klo(lo);
+    KeyBuf khi(hi);
+    tracker.start_op(tid);
+    {
+        MontageOpHolderReadOnly _holder(this);
+        bool done=false;
+        for(int i=0;i<optimistic_scans && !done;i++){
+            bool quiescent=true;
+            for(int t=0;t<task_num && quiescent;t++){
+                seqs[t]=update_seqs[t].ui.load();
+                quiescent=(seqs[t]%2==0);
+            }
+            if(!quiescent) continue;
+            items.clear();
+            done=scan(root,0,true,true,klo,khi,limit,items);
+            for(int t=0;t<task_num && done;t++){
+                done=(update_seqs[t].ui.load()==seqs[t]);
+            }
+        }
+        if(!done){
+            std::lock_guard<std::mutex> lk(scan_lock);
+            scan_blocking.store(true);
+            for(int t=0;t<task_num;t++){
+                while(update_seqs[t].ui.load()%2!=0);
+            }
+            do{
+                items.clear();
+            }while(!scan(root,0,true,true,klo,khi,limit,items));
+            scan_blocking.store(false);
+        }
+        if(limit>0 && (int)items.size()>limit){
+            items.resize(limit);
+        }
+        for(Leaf* leaf : items){
+            f(KeyTraits::decode(leaf->key,leaf->len),(V)leaf->payload->get_unsafe_val(this));
+        }
+    }
+    tracker.end_op(tid);
+    return items.size();
+}
+
+/* Specialization for strings */
+#include <string>
+#include "PString.hpp"
+template <>
+class MontageART<std::string, std::string>::Payload : public pds::PBlk{
+    GENERATE_FIELD(pds::PString<TESTS_KEY_SIZE>, key, Payload);
+    GENERATE_FIELD(pds::PString<TESTS_VAL_SIZE>, val, Payload);
+
+public:
+    Payload(std::string k, std::string v) : m_key(this, k), m_val(this, v){}
+    Payload(const Payload& oth) : pds::PBlk(oth), m_key(this, oth.m_key), m_val(this, oth.m_val){}
+    void persist(){}
+};
+
+#endif
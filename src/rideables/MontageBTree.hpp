@@ -0,0 +1,862 @@
+#ifndef MONTAGE_BTREE_P
+#define MONTAGE_BTREE_P
+
+/*
+ * A B+-tree synchronized by optimistic lock coupling (after Leis et al.,
+ * "The ART of Practical Synchronization", DaMoN'16). Inner nodes and
+ * leaves are transient; leaves hold sorted keys next to pointers to the
+ * persistent key/value payloads.
+ *
+ * Readers never write shared memory: they validate node versions instead.
+ * Writers lock the leaf they update, and full nodes are split eagerly on
+ * the way down while holding the parent. Nodes are never merged, so they
+ * are never freed while the tree is online; replaced and removed payloads
+ * go through an RCU tracker so that readers holding them stay safe.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <iostream>
+#include <atomic>
+#include <algorithm>
+#include <functional>
+#include <vector>
+#include <utility>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <type_traits>
+
+#include "HarnessUtils.hpp"
+#include "ConcurrentPrimitives.hpp"
+#include "ROrderedMap.hpp"
+#include "RCUTracker.hpp"
+#include "CustomTypes.hpp"
+#include "Recoverable.hpp"
+
+// keys as kept in the transient nodes. they are read optimistically and
+// may be torn, so they must be trivially copyable and safe to compare
+// whatever their content.
+template <class K>
+struct MontageBTreeKey{
+    typedef K type;
+    static type make(const K& k){ return k; }
+    static K get(const type& k){ return k; }
+};
+
+template <>
+struct MontageBTreeKey<std::string>{
+    struct type{
+        uint32_t len;
+        char data[TESTS_KEY_SIZE];
+        inline uint32_t size() const{
+            return std::min<uint32_t>(len, TESTS_KEY_SIZE);
+        }
+        bool operator<(const type& oth) const{
+            int c = memcmp(data, oth.data, std::min(size(), oth.size()));
+            return c < 0 || (c == 0 && size() < oth.size());
+        }
+        bool operator==(const type& oth) const{
+            return size() == oth.size() && memcmp(data, oth.data, size()) == 0;
+        }
+    };
+    static type make(const std::string& k){
+        assert(k.size() <= TESTS_KEY_SIZE && "key is longer than TESTS_KEY_SIZE!");
+        type ret;
+        ret.len = k.size();
+        memcpy(ret.data, k.data(), k.size());
+        return ret;
+    }
+    static std::string get(const type& k){
+        return std::string(k.data, k.size());
+    }
+};
+
+template <class K, class V>
+class MontageBTree : public ROrderedMap<K,V>, public Recoverable{
+public:
+    class Payload : public pds::PBlk{
+        GENERATE_FIELD(K, key, Payload);
+        GENERATE_FIELD(V, val, Payload);
+    public:
+        Payload(){}
+        Payload(K x, V y): m_key(x), m_val(y){}
+        Payload(const Payload& oth): pds::PBlk(oth), m_key(oth.m_key), m_val(oth.m_val){}
+        void persist(){}
+    };
+private:
+    typedef MontageBTreeKey<K> KeyTraits;
+    typedef typename KeyTraits::type Key;
+    static_assert(std::is_trivially_copyable<Key>::value, "node keys must be trivially copyable");
+
+    // sized so that a node spans a few pages at most with TESTS_KEY_SIZE keys.
+    static const unsigned INNER_SLOTS = 64;
+    static const unsigned LEAF_SLOTS = 64;
+
+    struct NodeBase{
+        // bit 1 is the write lock; every lock and unlock adds 0b10, so a
+        // version read before and after a write never matches.
+        std::atomic<uint64_t> version;
+        bool is_leaf;
+        uint16_t count;
+        NodeBase(bool leaf): version(0b100), is_leaf(leaf), count(0){}
+
+        static inline bool locked(uint64_t v){
+            return (v & 0b10) == 0b10;
+        }
+        uint64_t readLockOrRestart(bool& needRestart){
+            uint64_t v = version.load();
+            if (locked(v)){
+                needRestart = true;
+            }
+            return v;
+        }
+        void readUnlockOrRestart(uint64_t v, bool& needRestart) const{
+            needRestart = (v != version.load());
+        }
+        void upgradeToWriteLockOrRestart(uint64_t& v, bool& needRestart){
+            if (version.compare_exchange_strong(v, v + 0b10)){
+                v = v + 0b10;
+            } else {
+                needRestart = true;
+            }
+        }
+        void writeUnlock(){
+            version.fetch_add(0b10);
+        }
+        // optimistic readers may see a torn count.
+        inline unsigned safe_count(unsigned cap) const{
+            return std::min<unsigned>(count, cap);
+        }
+    };
+
+    struct Inner : public NodeBase{
+        // child i holds the keys in (keys[i-1], keys[i]].
+        Key keys[INNER_SLOTS];
+        NodeBase* children[INNER_SLOTS];
+        Inner(): NodeBase(false){}
+
+        bool full() const{
+            return this->count == INNER_SLOTS - 1;
+        }
+        unsigned lowerBound(const Key& k) const{
+            unsigned lo = 0, hi = this->safe_count(INNER_SLOTS - 1);
+            while (lo < hi){
+                unsigned mid = (lo + hi) / 2;
+                if (keys[mid] < k){
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+            return lo;
+        }
+        // move the upper half into a new node; sep is the greatest key
+        // left in this one.
+        Inner* split(Key& sep){
+            Inner* right = new Inner();
+            right->count = this->count - (this->count / 2);
+            this->count = this->count - right->count - 1;
+            sep = keys[this->count];
+            memcpy(right->keys, keys + this->count + 1, sizeof(Key) * (right->count + 1));
+            memcpy(right->children, children + this->count + 1, sizeof(NodeBase*) * (right->count + 1));
+            return right;
+        }
+        // child goes right after the child that had held sep.
+        void insert(const Key& sep, NodeBase* child){
+            unsigned pos = lowerBound(sep);
+            memmove(keys + pos + 1, keys + pos, sizeof(Key) * (this->count - pos + 1));
+            memmove(children + pos + 1, children + pos, sizeof(NodeBase*) * (this->count - pos + 1));
+            keys[pos] = sep;
+            children[pos] = child;
+            std::swap(children[pos], children[pos + 1]);
+            this->count++;
+        }
+    };
+
+    struct Leaf : public NodeBase{
+        Key keys[LEAF_SLOTS];
+        Payload* payloads[LEAF_SLOTS];
+        // right sibling, set under this leaf's lock when it splits.
+        Leaf* next;
+        Leaf(): NodeBase(true), next(nullptr){}
+
+        bool full() const{
+            return this->count == LEAF_SLOTS;
+        }
+        unsigned lowerBound(const Key& k) const{
+            unsigned lo = 0, hi = this->safe_count(LEAF_SLOTS);
+            while (lo < hi){
+                unsigned mid = (lo + hi) / 2;
+                if (keys[mid] < k){
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+            return lo;
+        }
+        Leaf* split(Key& sep){
+            Leaf* right = new Leaf();
+            right->count = this->count - (this->count / 2);
+            this->count = this->count - right->count;
+            sep = keys[this->count - 1];
+            memcpy(right->keys, keys + this->count, sizeof(Key) * right->count);
+            memcpy(right->payloads, payloads + this->count, sizeof(Payload*) * right->count);
+            right->next = next;
+            next = right;
+            return right;
+        }
+        void insert(unsigned pos, const Key& k, Payload* p){
+            memmove(keys + pos + 1, keys + pos, sizeof(Key) * (this->count - pos));
+            memmove(payloads + pos + 1, payloads + pos, sizeof(Payload*) * (this->count - pos));
+            keys[pos] = k;
+            payloads[pos] = p;
+            this->count++;
+        }
+        void erase(unsigned pos){
+            memmove(keys + pos, keys + pos + 1, sizeof(Key) * (this->count - pos - 1));
+            memmove(payloads + pos, payloads + pos + 1, sizeof(Payload*) * (this->count - pos - 1));
+            this->count--;
+        }
+    };
+
+    // a payload taken out of the tree, reclaimed once no reader can hold it.
+    struct Retired{
+        MontageBTree* ds;
+        Payload* payload;
+        // incarnation of the tree the payload was retired in, see recover().
+        uint64_t incarnation;
+        Retired(MontageBTree* ds_, Payload* p): ds(ds_), payload(p), incarnation(ds_->incarnation){}
+        ~Retired(){
+            if (incarnation == ds->incarnation){
+                ds->preclaim(payload);
+            }
+        }
+    };
+
+    std::atomic<NodeBase*> root;
+    RCUTracker<Retired> tracker;
+    GlobalTestConfig* gtc;
+    int task_num;
+    // bumped by every recover().
+    uint64_t incarnation = 0;
+    // scans validate against per-thread sequence numbers, odd while the
+    // thread is updating a leaf, as in MontageNatarajanTree. updaters bump
+    // theirs before taking any node lock, so that a blocking scan never
+    // waits on a leaf locked by a thread that waits on the scan.
+    static const int optimistic_scans = 4;
+    paddedAtomic<uint64_t>* update_seqs;
+    std::atomic<bool> scan_blocking;
+    std::mutex scan_lock;
+
+    inline void begin_update(int tid){
+        while(true){
+            update_seqs[tid].ui.fetch_add(1);
+            if(!scan_blocking.load()) return;
+            update_seqs[tid].ui.fetch_add(1);
+            while(scan_blocking.load());
+        }
+    }
+    inline void end_update(int tid){
+        update_seqs[tid].ui.fetch_add(1);
+    }
+
+    void make_root(const Key& sep, NodeBase* left, NodeBase* right){
+        Inner* inner = new Inner();
+        inner->count = 1;
+        inner->keys[0] = sep;
+        inner->children[0] = left;
+        inner->children[1] = right;
+        root.store(inner);
+    }
+
+    Leaf* lock_leaf(const Key& k);
+    void collect(const Key& lo, const Key& hi, int limit, std::vector<std::pair<Key,Payload*>>& items);
+    void clear(NodeBase* n);
+    NodeBase* build(std::vector<std::pair<NodeBase*,Key>>& level);
+
+public:
+    MontageBTree(GlobalTestConfig* gtc_) : Recoverable(gtc_), root(new Leaf()), tracker(gtc_->task_num, 100, 1000, true), gtc(gtc_){
+        task_num = gtc->task_num;
+        update_seqs = new paddedAtomic<uint64_t>[task_num]{};
+        scan_blocking.store(false);
+    };
+    ~MontageBTree(){};
+
+    void init_thread(GlobalTestConfig* gtc, LocalTestConfig* ltc){
+        Recoverable::init_thread(gtc, ltc);
+    }
+
+    int recover(bool simulated);
+
+    optional<V> get(K key, int tid);
+    optional<V> put(K key, V val, int tid);
+    bool insert(K key, V val, int tid);
+    optional<V> remove(K key, int tid);
+    optional<V> replace(K key, V val, int tid);
+    int range(K lo, K hi, int limit, std::function<void(const K&, const V&)> f, int tid);
+};
+
+template <class T>
+class MontageBTreeFactory : public RideableFactory{
+    Rideable* build(GlobalTestConfig* gtc){
+        return new MontageBTree<T,T>(gtc);
+    }
+};
+
+
+//-------Definition----------
+// drop the nodes under n, leaving payloads alone. no concurrent ops.
+template <class K, class V>
+void MontageBTree<K,V>::clear(NodeBase* n){
+    if (n->is_leaf){
+        delete static_cast<Leaf*>(n);
+        return;
+    }
+    Inner* inner = static_cast<Inner*>(n);
+    for (unsigned i = 0; i <= inner->count; i++){
+        clear(inner->children[i]);
+    }
+    delete inner;
+}
+
+// build the inner levels above level, a list of (node, greatest key in
+// it) in key order, and return the root.
+template <class K, class V>
+typename MontageBTree<K,V>::NodeBase* MontageBTree<K,V>::build(std::vector<std::pair<NodeBase*,Key>>& level){
+    while (level.size() > 1){
+        std::vector<std::pair<NodeBase*,Key>> upper;
+        // fill inner nodes to 3/4 so that the first inserts do not split
+        // every one of them.
+        size_t fanout = INNER_SLOTS * 3 / 4;
+        for (size_t i = 0; i < level.size(); i += fanout){
+            size_t n = std::min(fanout, level.size() - i);
+            if (n == 1){
+                // a lone child goes into the previous node, which has room.
+                Inner* prev = static_cast<Inner*>(upper.back().first);
+                prev->keys[prev->count] = upper.back().second;
+                prev->children[prev->count + 1] = level[i].first;
+                prev->count++;
+                upper.back().second = level[i].second;
+                continue;
+            }
+            Inner* inner = new Inner();
+            inner->count = n - 1;
+            for (size_t j = 0; j < n; j++){
+                if (j + 1 < n){
+                    inner->keys[j] = level[i + j].second;
+                }
+                inner->children[j] = level[i + j].first;
+            }
+            upper.emplace_back(inner, level[i + n - 1].second);
+        }
+        level.swap(upper);
+    }
+    return level[0].first;
+}
+
+template <class K, class V>
+int MontageBTree<K,V>::recover(bool simulated){
+    if (simulated){
+        recover_mode(); // PDELETE --> noop
+        // clear transient structures.
+        clear(root.load());
+        online_mode(); // re-enable PDELETE.
+    } else {
+        clear(root.load());
+    }
+    // payloads retired before the crash may still be in the tracker.
+    incarnation++;
+
+    int rec_thd = 10;
+    if (gtc->checkEnv("RecoverThread")){
+        rec_thd = stoi(gtc->getEnv("RecoverThread"));
+    }
+    struct Entry{
+        Key key;
+        Payload* payload;
+        bool operator<(const Entry& oth) const { return key < oth.key; }
+    };
+    // phase 1: each recovery thread sorts the payloads of its shard.
+    std::vector<std::vector<Entry>> runs(rec_thd);
+    std::atomic<int> rec_cnt(0);
+    auto begin = chrono::high_resolution_clock::now();
+    recover_pblks([&](const std::vector<pds::PBlk*>& blks, int shard){
+        std::vector<Entry>& run = runs[shard];
+        run.reserve(blks.size());
+        for (pds::PBlk* blk : blks){
+            Payload* payload = reinterpret_cast<Payload*>(blk);
+            run.push_back({KeyTraits::make((K)payload->get_unsafe_key(this)), payload});
+        }
+        std::sort(run.begin(), run.end());
+        rec_cnt.fetch_add(blks.size(), std::memory_order_relaxed);
+    }, rec_thd);
+    auto sorted_end = chrono::high_resolution_clock::now();
+
+    // phase 2: cut the key space at splitters sampled from the runs; each
+    // thread merges one key range across all runs and packs it into
+    // leaves filled to 3/4.
+    std::vector<Entry> samples;
+    for (auto& run : runs){
+        size_t stride = std::max<size_t>(1, run.size() / (rec_thd * 8));
+        for (size_t i = stride / 2; i < run.size(); i += stride){
+            samples.push_back(run[i]);
+        }
+    }
+    std::sort(samples.begin(), samples.end());
+    std::vector<Entry> splitters;
+    for (int t = 1; t < rec_thd && !samples.empty(); t++){
+        splitters.push_back(samples[samples.size() * t / rec_thd]);
+    }
+    int parts = splitters.size() + 1;
+    // bounds[p][r]: start of part p in run r.
+    std::vector<std::vector<size_t>> bounds(parts + 1, std::vector<size_t>(rec_thd));
+    for (int p = 0; p <= parts; p++){
+        for (int r = 0; r < rec_thd; r++){
+            if (p == 0){
+                bounds[p][r] = 0;
+            } else if (p == parts){
+                bounds[p][r] = runs[r].size();
+            } else {
+                bounds[p][r] = std::lower_bound(runs[r].begin(), runs[r].end(), splitters[p-1]) - runs[r].begin();
+            }
+        }
+    }
+    std::vector<std::vector<std::pair<NodeBase*,Key>>> leaves(parts);
+    std::vector<std::thread> builders;
+    for (int p = 0; p < parts; p++){
+        builders.emplace_back([&, p](){
+            std::vector<Entry> part;
+            for (int r = 0; r < rec_thd; r++){
+                size_t mid = part.size();
+                part.insert(part.end(), runs[r].begin() + bounds[p][r], runs[r].begin() + bounds[p+1][r]);
+                std::inplace_merge(part.begin(), part.begin() + mid, part.end());
+            }
+            size_t fill = LEAF_SLOTS * 3 / 4;
+            Leaf* leaf = nullptr;
+            for (size_t i = 0; i < part.size(); i++){
+                if (i > 0 && part[i-1].key == part[i].key){
+                    errexit("conflicting keys recovered.");
+                }
+                if (leaf == nullptr || leaf->count == fill){
+                    Leaf* next = new Leaf();
+                    if (leaf){
+                        leaf->next = next;
+                    }
+                    leaf = next;
+                    leaves[p].emplace_back(leaf, part[i].key);
+                }
+                leaf->keys[leaf->count] = part[i].key;
+                leaf->payloads[leaf->count] = part[i].payload;
+                leaf->count++;
+                leaves[p].back().second = part[i].key;
+            }
+        });
+    }
+    for (auto& t : builders){
+        t.join();
+    }
+    auto merged_end = chrono::high_resolution_clock::now();
+
+    // phase 3: chain the parts' leaves and build the inner levels on top.
+    std::vector<std::pair<NodeBase*,Key>> level;
+    for (int p = 0; p < parts; p++){
+        if (leaves[p].empty()){
+            continue;
+        }
+        if (!level.empty()){
+            static_cast<Leaf*>(level.back().first)->next = static_cast<Leaf*>(leaves[p].front().first);
+        }
+        level.insert(level.end(), leaves[p].begin(), leaves[p].end());
+    }
+    size_t leaf_cnt = level.size();
+    if (level.empty()){
+        root.store(new Leaf());
+    } else {
+        root.store(build(level));
+    }
+    auto end = chrono::high_resolution_clock::now();
+    auto sort_ms = std::chrono::duration_cast<std::chrono::milliseconds>(sorted_end - begin).count();
+    auto merge_ms = std::chrono::duration_cast<std::chrono::milliseconds>(merged_end - sorted_end).count();
+    auto build_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - merged_end).count();
+    auto dur_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count();
+    std::cout << "Spent " << sort_ms << "ms recovering and sorting PBlk(" << rec_cnt.load() << ")" << std::endl;
+    std::cout << "Spent " << merge_ms << "ms merging into " << leaf_cnt << " leaves" << std::endl;
+    std::cout << "Spent " << build_ms << "ms building inner nodes" << std::endl;
+    std::cout << "Total time to recover: " << dur_ms << "ms" << std::endl;
+    return rec_cnt.load();
+}
+
+// descend to the leaf that k belongs to and return it write-locked, with
+// room for one more key. full nodes met on the way are split, which
+// takes their parent's lock as well, and the descent restarts.
+template <class K, class V>
+typename MontageBTree<K,V>::Leaf* MontageBTree<K,V>::lock_leaf(const Key& k){
+    while(true){
+        bool restart = false;
+        NodeBase* node = root.load();
+        uint64_t v = node->readLockOrRestart(restart);
+        if (restart || node != root.load()) continue;
+
+        Inner* parent = nullptr;
+        uint64_t pv = 0;
+        while (!restart && !node->is_leaf){
+            Inner* inner = static_cast<Inner*>(node);
+            if (inner->full()){
+                if (parent){
+                    parent->upgradeToWriteLockOrRestart(pv, restart);
+                    if (restart) break;
+                }
+                inner->upgradeToWriteLockOrRestart(v, restart);
+                if (restart){
+                    if (parent) parent->writeUnlock();
+                    break;
+                }
+                if (!parent && node != root.load()){
+                    inner->writeUnlock();
+                    restart = true;
+                    break;
+                }
+                Key sep;
+                Inner* right = inner->split(sep);
+                if (parent){
+                    parent->insert(sep, right);
+                } else {
+                    make_root(sep, inner, right);
+                }
+                inner->writeUnlock();
+                if (parent) parent->writeUnlock();
+                restart = true;
+                break;
+            }
+            if (parent){
+                parent->readUnlockOrRestart(pv, restart);
+                if (restart) break;
+            }
+            parent = inner;
+            pv = v;
+            node = inner->children[inner->lowerBound(k)];
+            inner->readUnlockOrRestart(v, restart);
+            if (restart) break;
+            v = node->readLockOrRestart(restart);
+        }
+        if (restart) continue;
+
+        Leaf* leaf = static_cast<Leaf*>(node);
+        if (leaf->full()){
+            if (parent){
+                parent->upgradeToWriteLockOrRestart(pv, restart);
+                if (restart) continue;
+            }
+            leaf->upgradeToWriteLockOrRestart(v, restart);
+            if (restart){
+                if (parent) parent->writeUnlock();
+                continue;
+            }
+            if (!parent && node != root.load()){
+                leaf->writeUnlock();
+                continue;
+            }
+            Key sep;
+            Leaf* right = leaf->split(sep);
+            if (parent){
+                parent->insert(sep, right);
+            } else {
+                make_root(sep, leaf, right);
+            }
+            leaf->writeUnlock();
+            if (parent) parent->writeUnlock();
+            continue;
+        }
+        leaf->upgradeToWriteLockOrRestart(v, restart);
+        if (restart) continue;
+        if (parent){
+            parent->readUnlockOrRestart(pv, restart);
+            if (restart){
+                leaf->writeUnlock();
+                continue;
+            }
+        }
+        return leaf;
+    }
+}
+
+template <class K, class V>
+optional<V> MontageBTree<K,V>::get(K key, int tid) {
+    optional<V> res={};
+    Key k = KeyTraits::make(key);
+    Payload* payload = nullptr;
+
+    tracker.start_op(tid);
+    while(true){
+        bool restart = false;
+        NodeBase* node = root.load();
+        uint64_t v = node->readLockOrRestart(restart);
+        if (restart || node != root.load()) continue;
+        Inner* parent = nullptr;
+        uint64_t pv = 0;
+        while (!restart && !node->is_leaf){
+            Inner* inner = static_cast<Inner*>(node);
+            if (parent){
+                parent->readUnlockOrRestart(pv, restart);
+                if (restart) break;
+            }
+            parent = inner;
+            pv = v;
+            node = inner->children[inner->lowerBound(k)];
+            inner->readUnlockOrRestart(v, restart);
+            if (restart) break;
+            v = node->readLockOrRestart(restart);
+        }
+        if (restart) continue;
+        Leaf* leaf = static_cast<Leaf*>(node);
+        unsigned pos = leaf->lowerBound(k);
+        payload = (pos < leaf->safe_count(LEAF_SLOTS) && leaf->keys[pos] == k) ? leaf->payloads[pos] : nullptr;
+        leaf->readUnlockOrRestart(v, restart);
+        if (!restart) break;
+    }
+    if (payload){
+        MontageOpHolder _holder(this);
+        res=(V)payload->get_unsafe_val(this);//never old see new as we find payload before BEGIN_OP
+    }
+    tracker.end_op(tid);
+    return res;
+}
+
+template <class K, class V>
+optional<V> MontageBTree<K,V>::put(K key, V val, int tid) {
+    optional<V> res={};
+    Key k = KeyTraits::make(key);
+    Payload* payload = pnew<Payload>(key,val);
+    Payload* old = nullptr;
+
+    tracker.start_op(tid);
+    begin_update(tid);
+    Leaf* leaf = lock_leaf(k);
+    unsigned pos = leaf->lowerBound(k);
+    {
+        MontageOpHolder _holder(this);
+        if (pos < leaf->count && leaf->keys[pos] == k){
+            // exists; replace
+            old = leaf->payloads[pos];
+            res = (V)old->get_unsafe_val(this);// old see new is impossible under the lock
+            pretire(old);
+            leaf->payloads[pos] = payload;
+        } else {
+            leaf->insert(pos, k, payload);
+        }
+    }
+    leaf->writeUnlock();
+    end_update(tid);
+    if (old){
+        tracker.retire(new Retired(this, old), tid);
+    }
+    tracker.end_op(tid);
+    return res;
+}
+
+template <class K, class V>
+bool MontageBTree<K,V>::insert(K key, V val, int tid){
+    bool res=false;
+    Key k = KeyTraits::make(key);
+    Payload* payload = pnew<Payload>(key,val);
+
+    tracker.start_op(tid);
+    begin_update(tid);
+    Leaf* leaf = lock_leaf(k);
+    unsigned pos = leaf->lowerBound(k);
+    if (pos < leaf->count && leaf->keys[pos] == k){
+        leaf->writeUnlock();
+        end_update(tid);
+        pdelete(payload);// never published, directly reclaiming
+    } else {
+        {
+            MontageOpHolder _holder(this);
+            leaf->insert(pos, k, payload);
+        }
+        leaf->writeUnlock();
+        end_update(tid);
+        res=true;
+    }
+    tracker.end_op(tid);
+    return res;
+}
+
+template <class K, class V>
+optional<V> MontageBTree<K,V>::remove(K key, int tid) {
+    optional<V> res={};
+    Key k = KeyTraits::make(key);
+    Payload* old = nullptr;
+
+    tracker.start_op(tid);
+    begin_update(tid);
+    Leaf* leaf = lock_leaf(k);
+    unsigned pos = leaf->lowerBound(k);
+    if (pos < leaf->count && leaf->keys[pos] == k){
+        {
+            MontageOpHolder _holder(this);
+            old = leaf->payloads[pos];
+            res = (V)old->get_unsafe_val(this);// old see new is impossible under the lock
+            pretire(old);
+            leaf->erase(pos);
+        }
+    }
+    leaf->writeUnlock();
+    end_update(tid);
+    if (old){
+        tracker.retire(new Retired(this, old), tid);
+    }
+    tracker.end_op(tid);
+    return res;
+}
+
+template <class K, class V>
+optional<V> MontageBTree<K,V>::replace(K key, V val, int tid) {
+    optional<V> res={};
+    Key k = KeyTraits::make(key);
+    Payload* payload = pnew<Payload>(key,val);
+    Payload* old = nullptr;
+
+    tracker.start_op(tid);
+    begin_update(tid);
+    Leaf* leaf = lock_leaf(k);
+    unsigned pos = leaf->lowerBound(k);
+    if (pos < leaf->count && leaf->keys[pos] == k){
+        {
+            MontageOpHolder _holder(this);
+            old = leaf->payloads[pos];
+            res = (V)old->get_unsafe_val(this);// old see new is impossible under the lock
+            pretire(old);
+            leaf->payloads[pos] = payload;
+        }
+    }
+    leaf->writeUnlock();
+    end_update(tid);
+    if (old){
+        tracker.retire(new Retired(this, old), tid);
+    } else {
+        pdelete(payload);// never published, directly reclaiming
+    }
+    tracker.end_op(tid);
+    return res;
+}
+
+// copy the entries in [lo, hi] leaf by leaf, following the sibling links.
+// each leaf is copied together with its link under one version check, and
+// a split copies its upper half to the new right sibling before linking
+// it, so a walk racing with splits still visits every key once.
+template <class K, class V>
+void MontageBTree<K,V>::collect(const Key& lo, const Key& hi, int limit, std::vector<std::pair<Key,Payload*>>& items){
+    Leaf* leaf = nullptr;
+    // descend to the leaf of lo.
+    while(true){
+        bool restart = false;
+        NodeBase* node = root.load();
+        uint64_t v = node->readLockOrRestart(restart);
+        if (restart || node != root.load()) continue;
+        while (!restart && !node->is_leaf){
+            Inner* inner = static_cast<Inner*>(node);
+            NodeBase* child = inner->children[inner->lowerBound(lo)];
+            inner->readUnlockOrRestart(v, restart);
+            if (restart) break;
+            node = child;
+            v = node->readLockOrRestart(restart);
+        }
+        if (!restart){
+            leaf = static_cast<Leaf*>(node);
+            break;
+        }
+    }
+    items.clear();
+    std::vector<std::pair<Key,Payload*>> copied;
+    bool done = false;
+    while (leaf != nullptr && !done){
+        bool restart = false;
+        uint64_t v = leaf->readLockOrRestart(restart);
+        if (restart) continue;
+        copied.clear();
+        bool past_hi = false;
+        unsigned cnt = leaf->safe_count(LEAF_SLOTS);
+        for (unsigned i = leaf->lowerBound(lo); i < cnt; i++){
+            if (hi < leaf->keys[i]){
+                past_hi = true;
+                break;
+            }
+            copied.emplace_back(leaf->keys[i], leaf->payloads[i]);
+        }
+        Leaf* next = leaf->next;
+        leaf->readUnlockOrRestart(v, restart);
+        if (restart) continue;
+        for (auto& item : copied){
+            items.push_back(item);
+            if (limit > 0 && (int)items.size() >= limit){
+                done = true;
+                break;
+            }
+        }
+        done = done || past_hi;
+        leaf = next;
+    }
+}
+
+// the items collected are a snapshot if no thread updated a leaf while
+// collecting, i.e., no sequence number was odd or moved. values are read
+// once the snapshot is taken, under a single read-only op.
+template <class K, class V>
+int MontageBTree<K,V>::range(K lo, K hi, int limit, std::function<void(const K&, const V&)> f, int tid){
+    std::vector<std::pair<Key,Payload*>> items;
+    std::vector<uint64_t> seqs(task_num);
+    Key klo = KeyTraits::make(lo);
+    Key khi = KeyTraits::make(hi);
+    tracker.start_op(tid);
+    {
+        MontageOpHolderReadOnly _holder(this);
+        bool done=false;
+        for(int i=0;i<optimistic_scans && !done;i++){
+            bool quiescent=true;
+            for(int t=0;t<task_num && quiescent;t++){
+                seqs[t]=update_seqs[t].ui.load();
+                quiescent=(seqs[t]%2==0);
+            }
+            if(!quiescent) continue;
+            collect(klo,khi,limit,items);
+            done=true;
+            for(int t=0;t<task_num && done;t++){
+                done=(update_seqs[t].ui.load()==seqs[t]);
+            }
+        }
+        if(!done){
+            std::lock_guard<std::mutex> lk(scan_lock);
+            scan_blocking.store(true);
+            for(int t=0;t<task_num;t++){
+                while(update_seqs[t].ui.load()%2!=0);
+            }
+            collect(klo,khi,limit,items);
+            scan_blocking.store(false);
+        }
+        for(auto& item : items){
+            f(KeyTraits::get(item.first),(V)item.second->get_unsafe_val(this));
+        }
+    }
+    tracker.end_op(tid);
+    return items.size();
+}
+
+/* Specialization for strings */
+#include <string>
+#include "PString.hpp"
+template <>
+class MontageBTree<std::string, std::string>::Payload : public pds::PBlk{
+    GENERATE_FIELD(pds::PString<TESTS_KEY_SIZE>, key, Payload);
+    GENERATE_FIELD(pds::PString<TESTS_VAL_SIZE>, val, Payload);
+
+public:
+    Payload(std::string k, std::string v) : m_key(this, k), m_val(this, v){}
+    Payload(const Payload& oth) : pds::PBlk(oth), m_key(this, oth.m_key), m_val(this, oth.m_val){}
+    void persist(){}
+};
+
+#endif
@@ -6,14 +6,23 @@
 #include "CustomTypes.hpp"
 #include "ConcurrentPrimitives.hpp"
 #include "Recoverable.hpp"
+#include "RCUTracker.hpp"
 #include <mutex>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <type_traits>
 #include <omp.h>
 
-template<typename K, typename V, size_t idxSize=1000000>
+template<typename K, typename V>
 class MontageHashTable : public RMap<K,V>, public Recoverable{
 public:
 
     class Payload : public pds::PBlk{
+        // fields are written to NVM byte for byte; types owning heap memory
+        // need a specialization like the one for strings below.
+        static_assert(std::is_trivially_copyable<K>::value && std::is_trivially_copyable<V>::value,
+            "MontageHashTable<K,V>::Payload needs a specialization for K and V");
         GENERATE_FIELD(K, key, Payload);
         GENERATE_FIELD(V, val, Payload);
     public:
@@ -23,17 +32,29 @@ public:
         void persist(){}
     }__attribute__((aligned(CACHELINE_SIZE)));
 
-    struct ListNode{
+    // transient objects whose reclamation is deferred past concurrent
+    // optimistic readers and resizes, see tracker.
+    struct Reclaimable{
+        virtual ~Reclaimable(){}
+    };
+
+    struct ListNode : public Reclaimable{
         MontageHashTable* ds;
         // Transient-to-persistent pointer
         Payload* payload = nullptr;
         // Transient-to-transient pointers
         ListNode* next = nullptr;
+        // hash of the key. chains are sorted by (hash, key), so traversals
+        // and resizing only read payloads on equal hashes.
+        size_t hash = 0;
+        // incarnation of the table in which remove() retired the payload;
+        // 0 if it was not retired.
+        uint64_t retired = 0;
         ListNode(){}
-        ListNode(MontageHashTable* ds_, K key, V val): ds(ds_){
+        ListNode(MontageHashTable* ds_, K key, V val, size_t hash_): ds(ds_), hash(hash_){
             payload = ds->pnew<Payload>(key, val);
         }
-        ListNode(Payload* _payload) : payload(_payload) {} // for recovery
+        ListNode(MontageHashTable* ds_, Payload* _payload) : ds(ds_), payload(_payload) {} // for recovery
         K get_key(){
             assert(payload!=nullptr && "payload shouldn't be null");
             // old-see-new never happens for locking ds
@@ -47,37 +68,388 @@ public:
             assert(payload!=nullptr && "payload shouldn't be null");
             payload = payload->set_val(ds, v);
         }
+        ListNode* load_next(){
+            return __atomic_load_n(&next, __ATOMIC_ACQUIRE);
+        }
+        // compare (hash, key) of this node with (h, k).
+        int compare(size_t h, const K& k){
+            if (hash != h){
+                return hash < h ? -1 : 1;
+            }
+            K curr_key = get_key();
+            if (curr_key == k){
+                return 0;
+            }
+            return curr_key < k ? -1 : 1;
+        }
         ~ListNode(){
             if (payload){
-                ds->pdelete(payload);
+                if (retired == 0){
+                    ds->pdelete(payload);
+                } else if (retired == ds->incarnation.load()){
+                    ds->preclaim(payload);
+                }
+                // otherwise retired before a simulated crash, and
+                // recovery has already dealt with the payload.
             }
         }
     }__attribute__((aligned(CACHELINE_SIZE)));
     struct Bucket{
         mutex lock;
+        // sequence number of chain changes, odd while one is in progress.
+        // writers hold the lock; get() reads without it and validates.
+        std::atomic<uint64_t> version;
         ListNode head;
-        Bucket():head(){};
+        Bucket():version(0), head(){};
+        void begin_write(){
+            version.store(version.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+        }
+        void end_write(){
+            version.store(version.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+    }__attribute__((aligned(CACHELINE_SIZE)));
+
+    // The bucket array grows and shrinks by linear hashing, one bucket at a
+    // time, so that no operation ever waits for a whole rehash. Buckets live
+    // in a directory of segments that never move: segment 0 holds
+    // min_buckets buckets and segment k>0 holds min_buckets*2^(k-1), so
+    // bucket indices stay stable as segments come and go.
+    // The table state packs the level L and the split pointer p: a key with
+    // hash h is in bucket h mod (min_buckets*2^L), or h mod
+    // (min_buckets*2^(L+1)) if that is below p. Splitting or merging a
+    // bucket moves transient nodes only, under the locks of both buckets,
+    // and publishes the new state before unlocking them; an operation
+    // rechecks its bucket under the lock. Segments emptied by merges are
+    // retired through RCU, as operations may still be locking their buckets.
+    // Removed nodes go the same way, as get() may still be reading them.
+    static const size_t min_buckets = 1024;
+    // the split pointer takes 32 bits, so levels stop at 21.
+    static const int max_segments = 23;
+    struct BucketSegment : public Reclaimable{
+        Bucket* buckets;
+        BucketSegment(size_t size): buckets(new Bucket[size]){}
+        ~BucketSegment(){
+            delete[] buckets;
+        }
+    };
+    struct TrackerHolder{
+        RCUTracker<Reclaimable>& tracker;
+        int tid;
+        TrackerHolder(RCUTracker<Reclaimable>& t, int tid_): tracker(t), tid(tid_){
+            tracker.start_op(tid);
+        }
+        ~TrackerHolder(){
+            tracker.end_op(tid);
+        }
+    };
+
+    // Lazy recovery (-dLazyRecover=1) parks recovered payloads per segment of
+    // hash values and goes online right away. A segment is rebuilt by the
+    // first operation touching one of its keys or by a background rebuilder,
+    // whichever comes first. The table does not resize meanwhile.
+    static const size_t seg_num = 1024;
+    struct Segment{
+        mutex lock;
+        std::atomic<bool> pending;
+        std::vector<Payload*> payloads;
+        Segment(): pending(false){}
     }__attribute__((aligned(CACHELINE_SIZE)));
 
     std::hash<K> hash_fn;
-    Bucket buckets[idxSize];
     GlobalTestConfig* gtc;
-    MontageHashTable(GlobalTestConfig* gtc_): Recoverable(gtc_), gtc(gtc_){};
+    std::atomic<BucketSegment*> directory[max_segments];
+    std::atomic<uint64_t> state;
+    RCUTracker<Reclaimable> tracker;
+    // bumped by recover(), see ListNode::retired.
+    std::atomic<uint64_t> incarnation;
+    // optimistic tries of get() before it takes the bucket lock.
+    static const int optimistic_reads = 4;
+    // items are counted per thread and folded into count every count_batch
+    // changes, which is also when a thread helps resizing.
+    static const int64_t count_batch = 32;
+    static const int resize_batch = 64;
+    padded<int64_t>* count_deltas;
+    std::atomic<int64_t> count;
+    double load_factor = 1.0;
+    std::mutex resize_lock;
+    uint64_t splits = 0;
+    uint64_t merges = 0;
+    Segment* segments = nullptr;
+    // true while any segment is pending; the only check on the fast path.
+    std::atomic<bool> lazy_pending;
+    std::atomic<size_t> segs_left;
+    chrono::high_resolution_clock::time_point lazy_begin;
+    std::vector<std::thread> rebuilders;
+    MontageHashTable(GlobalTestConfig* gtc_): Recoverable(gtc_), gtc(gtc_),
+        tracker(gtc_->task_num, 100, 1000, true), incarnation(1), count(0), lazy_pending(false), segs_left(0){
+        // start small and let splits follow the load.
+        size_t init_size = min_buckets;
+        if (gtc->checkEnv("HashBuckets")){
+            init_size = stoull(gtc->getEnv("HashBuckets"));
+        }
+        if (gtc->checkEnv("LoadFactor")){
+            load_factor = stod(gtc->getEnv("LoadFactor"));
+            if (load_factor <= 0){
+                errexit("LoadFactor must be positive.");
+            }
+        }
+        uint64_t level = 0;
+        while ((min_buckets << level) < init_size){
+            level++;
+        }
+        if (level + 1 >= (uint64_t)max_segments){
+            errexit("HashBuckets too large.");
+        }
+        for (int k = 0; k < max_segments; k++){
+            directory[k].store(k <= (int)level ? new BucketSegment(segment_size(k)) : nullptr);
+        }
+        state.store(level << 32);
+        count_deltas = new padded<int64_t>[gtc->task_num];
+        for (int i = 0; i < gtc->task_num; i++){
+            count_deltas[i].ui = 0;
+        }
+    };
+    ~MontageHashTable(){
+        join_rebuilders();
+        if (gtc->recorder){
+            gtc->recorder->reportGlobalInfo("hash_buckets", (unsigned long)bucket_count());
+            gtc->recorder->reportGlobalInfo("hash_splits", (unsigned long)splits);
+            gtc->recorder->reportGlobalInfo("hash_merges", (unsigned long)merges);
+        }
+        if (gtc->verbose){
+            std::cout << "MontageHashTable: " << bucket_count() << " buckets, " << splits
+                << " splits, " << merges << " merges" << std::endl;
+        }
+        for (int k = 0; k < max_segments; k++){
+            delete directory[k].load();
+        }
+        delete[] count_deltas;
+        if (segments){
+            delete[] segments;
+        }
+    }
 
     void init_thread(GlobalTestConfig* gtc, LocalTestConfig* ltc){
         Recoverable::init_thread(gtc, ltc);
     }
 
+    static size_t segment_size(int k){
+        return k == 0 ? min_buckets : min_buckets << (k - 1);
+    }
+
+    static size_t bucket_count(uint64_t s){
+        return (min_buckets << (s >> 32)) + (s & 0xffffffff);
+    }
+
+    size_t bucket_count(){
+        return bucket_count(state.load(std::memory_order_acquire));
+    }
+
+    static size_t bucket_index(size_t h, uint64_t s){
+        size_t n = min_buckets << (s >> 32);
+        size_t idx = h & (n - 1);
+        if (idx < (s & 0xffffffff)){
+            idx = h & (2 * n - 1);
+        }
+        return idx;
+    }
+
+    // nullptr if the bucket's segment is gone, i.e., s is stale.
+    Bucket* bucket_at(size_t idx){
+        int k = idx < min_buckets ? 0 : 64 - __builtin_clzll(idx / min_buckets);
+        BucketSegment* seg = directory[k].load(std::memory_order_acquire);
+        if (seg == nullptr){
+            return nullptr;
+        }
+        return &seg->buckets[k == 0 ? idx : idx - segment_size(k)];
+    }
+
+    // lock and return the bucket of hash h. callers on worker threads
+    // must hold a TrackerHolder.
+    Bucket* lock_bucket(size_t h, std::unique_lock<std::mutex>& lk){
+        while(true){
+            Bucket* b = bucket_at(bucket_index(h, state.load(std::memory_order_acquire)));
+            if (b == nullptr){
+                continue;
+            }
+            lk = std::unique_lock<std::mutex>(b->lock);
+            if (b == bucket_at(bucket_index(h, state.load(std::memory_order_acquire)))){
+                return b;
+            }
+            lk.unlock();
+        }
+    }
+
+    void help_resize(int tid){
+        int64_t& delta = count_deltas[tid].ui;
+        if (delta < count_batch && delta > -count_batch){
+            return;
+        }
+        count.fetch_add(delta, std::memory_order_relaxed);
+        delta = 0;
+        if (lazy_pending.load(std::memory_order_acquire) || !needs_resize()){
+            return;
+        }
+        if (!resize_lock.try_lock()){
+            // someone else is on it.
+            return;
+        }
+        for (int i = 0; i < resize_batch && resize_step(tid); i++);
+        tracker.empty(tid);
+        resize_lock.unlock();
+    }
+
+    bool needs_resize(){
+        int64_t n = count.load(std::memory_order_relaxed);
+        size_t buckets = bucket_count();
+        return n > load_factor * buckets ||
+            (buckets > min_buckets && n * 4 < load_factor * buckets);
+    }
+
+    // split or merge one bucket if the load calls for it. resize_lock held.
+    bool resize_step(int tid){
+        int64_t n = count.load(std::memory_order_relaxed);
+        size_t buckets = bucket_count();
+        if (n > load_factor * buckets){
+            return split();
+        } else if (buckets > min_buckets && n * 4 < load_factor * buckets){
+            merge(tid);
+            return true;
+        }
+        return false;
+    }
+
+    bool split(){
+        uint64_t s = state.load(std::memory_order_relaxed);
+        uint64_t level = s >> 32;
+        size_t p = s & 0xffffffff;
+        size_t n = min_buckets << level;
+        if (level + 1 >= (uint64_t)max_segments){
+            return false;
+        }
+        if (p == 0 && directory[level + 1].load(std::memory_order_relaxed) == nullptr){
+            directory[level + 1].store(new BucketSegment(segment_size(level + 1)), std::memory_order_release);
+        }
+        Bucket* low = bucket_at(p);
+        Bucket* high = bucket_at(p + n);
+        std::lock_guard<std::mutex> lk_low(low->lock);
+        std::lock_guard<std::mutex> lk_high(high->lock);
+        low->begin_write();
+        high->begin_write();
+        ListNode* prev = &low->head;
+        ListNode* tail = &high->head;
+        for (ListNode* curr = low->head.next; curr; curr = prev->next){
+            if ((curr->hash & (2 * n - 1)) != p){
+                prev->next = curr->next;
+                tail->next = curr;
+                tail = curr;
+            } else {
+                prev = curr;
+            }
+        }
+        tail->next = nullptr;
+        state.store(p + 1 == n ? (level + 1) << 32 : (level << 32) | (p + 1),
+            std::memory_order_release);
+        high->end_write();
+        low->end_write();
+        splits++;
+        return true;
+    }
+
+    void merge(int tid){
+        uint64_t s = state.load(std::memory_order_relaxed);
+        uint64_t level = s >> 32;
+        size_t p = s & 0xffffffff;
+        if (p == 0){
+            // (L, 0) and (L-1, 2^(L-1)*min_buckets) are the same table.
+            level--;
+            p = min_buckets << level;
+        }
+        size_t n = min_buckets << level;
+        Bucket* low = bucket_at(p - 1);
+        Bucket* high = bucket_at(p - 1 + n);
+        {
+            std::lock_guard<std::mutex> lk_low(low->lock);
+            std::lock_guard<std::mutex> lk_high(high->lock);
+            low->begin_write();
+            high->begin_write();
+            // both chains are sorted by (hash, key).
+            ListNode* prev = &low->head;
+            ListNode* other = high->head.next;
+            while (other){
+                ListNode* curr = prev->next;
+                if (curr == nullptr || other->hash < curr->hash ||
+                    (other->hash == curr->hash && other->get_key() < curr->get_key())){
+                    ListNode* next = other->next;
+                    other->next = curr;
+                    prev->next = other;
+                    other = next;
+                }
+                prev = prev->next;
+            }
+            high->head.next = nullptr;
+            state.store((level << 32) | (p - 1), std::memory_order_release);
+            high->end_write();
+            low->end_write();
+            merges++;
+        }
+        if (p - 1 == 0){
+            // segment level+1 is now empty.
+            BucketSegment* seg = directory[level + 1].exchange(nullptr, std::memory_order_acq_rel);
+            tracker.retire(seg, tid);
+            tracker.incrementEpoch();
+        }
+    }
+
     optional<V> get(K key, int tid){
-        size_t idx=hash_fn(key)%idxSize;
+        size_t h = hash_fn(key);
+        if (lazy_pending.load(std::memory_order_acquire)){
+            rebuild_segment(h % seg_num);
+        }
+        help_resize(tid);
+        TrackerHolder _tracker(tracker, tid);
+        MontageOpHolderReadOnly _holder(this);
+        // optimistic read: traverse without the lock and validate the
+        // bucket's version. nodes and payloads seen stay valid meanwhile,
+        // through the tracker and this operation's epoch.
+        for (int i = 0; i < optimistic_reads; i++){
+            Bucket* bucket = bucket_at(bucket_index(h, state.load(std::memory_order_acquire)));
+            if (bucket == nullptr){
+                continue;
+            }
+            uint64_t v = bucket->version.load(std::memory_order_acquire);
+            // a resize publishes the new state before its closing version.
+            if ((v & 1) || bucket != bucket_at(bucket_index(h, state.load(std::memory_order_acquire)))){
+                continue;
+            }
+            optional<V> ret = {};
+            for (ListNode* curr = bucket->head.load_next(); curr; curr = curr->load_next()){
+                if (curr->hash < h){
+                    continue;
+                } else if (curr->hash > h){
+                    break;
+                } else if (curr->get_key() == key){
+                    ret = curr->get_val();
+                    break;
+                }
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (bucket->version.load(std::memory_order_relaxed) == v){
+                return ret;
+            }
+        }
         // while(true){
-        std::lock_guard<std::mutex> lk(buckets[idx].lock);
-        MontageOpHolderReadOnly(this);
+        std::unique_lock<std::mutex> lk;
+        Bucket* bucket = lock_bucket(h, lk);
             // try{
-        ListNode* curr = buckets[idx].head.next;
+        ListNode* curr = bucket->head.next;
         while(curr){
-            if (curr->get_key() == key){
+            int c = curr->compare(h, key);
+            if (c == 0){
                 return curr->get_val();
+            } else if (c > 0){
+                return {};
             }
             curr = curr->next;
         }
@@ -89,31 +461,45 @@ public:
     }
 
     optional<V> put(K key, V val, int tid){
-        size_t idx=hash_fn(key)%idxSize;
-        ListNode* new_node = new ListNode(this, key, val);
+        size_t h = hash_fn(key);
+        if (lazy_pending.load(std::memory_order_acquire)){
+            rebuild_segment(h % seg_num);
+        }
+        help_resize(tid);
+        TrackerHolder _tracker(tracker, tid);
+        ListNode* new_node = new ListNode(this, key, val, h);
         // while(true){
-        std::lock_guard<std::mutex> lk(buckets[idx].lock);
+        std::unique_lock<std::mutex> lk;
+        Bucket* bucket = lock_bucket(h, lk);
         MontageOpHolder _holder(this);
         // try{
-        ListNode* curr = buckets[idx].head.next;
-        ListNode* prev = &buckets[idx].head;
+        ListNode* curr = bucket->head.next;
+        ListNode* prev = &bucket->head;
         while(curr){
-            K curr_key = curr->get_key();
-            if (curr_key == key){
+            int c = curr->compare(h, key);
+            if (c == 0){
                 optional<V> ret = curr->get_val();
+                bucket->begin_write();
                 curr->set_val(val);
+                bucket->end_write();
                 delete new_node;
                 return ret;
-            } else if (curr_key > key){
+            } else if (c > 0){
+                bucket->begin_write();
                 new_node->next = curr;
                 prev->next = new_node;
+                bucket->end_write();
+                count_deltas[tid].ui++;
                 return {};
             } else {
                 prev = curr;
                 curr = curr->next;
             }
         }
+        bucket->begin_write();
         prev->next = new_node;
+        bucket->end_write();
+        count_deltas[tid].ui++;
         return {};
         //     } catch (OldSeeNewException& e){
         //         continue;
@@ -122,29 +508,41 @@ public:
     }
 
     bool insert(K key, V val, int tid){
-        size_t idx=hash_fn(key)%idxSize;
-        ListNode* new_node = new ListNode(this, key, val);
+        size_t h = hash_fn(key);
+        if (lazy_pending.load(std::memory_order_acquire)){
+            rebuild_segment(h % seg_num);
+        }
+        help_resize(tid);
+        TrackerHolder _tracker(tracker, tid);
+        ListNode* new_node = new ListNode(this, key, val, h);
         // while(true){
-        std::lock_guard<std::mutex> lk(buckets[idx].lock);
+        std::unique_lock<std::mutex> lk;
+        Bucket* bucket = lock_bucket(h, lk);
         MontageOpHolder _holder(this);
         // try{
-        ListNode* curr = buckets[idx].head.next;
-        ListNode* prev = &buckets[idx].head;
+        ListNode* curr = bucket->head.next;
+        ListNode* prev = &bucket->head;
         while(curr){
-            K curr_key = curr->get_key();
-            if (curr_key == key){
+            int c = curr->compare(h, key);
+            if (c == 0){
                 delete new_node;
                 return false;
-            } else if (curr_key > key){
+            } else if (c > 0){
+                bucket->begin_write();
                 new_node->next = curr;
                 prev->next = new_node;
+                bucket->end_write();
+                count_deltas[tid].ui++;
                 return true;
             } else {
                 prev = curr;
                 curr = curr->next;
             }
         }
+        bucket->begin_write();
         prev->next = new_node;
+        bucket->end_write();
+        count_deltas[tid].ui++;
         return true;
         //     } catch (OldSeeNewException& e){
         //         continue;
@@ -158,21 +556,34 @@ public:
     }
 
     optional<V> remove(K key, int tid){
-        size_t idx=hash_fn(key)%idxSize;
+        size_t h = hash_fn(key);
+        if (lazy_pending.load(std::memory_order_acquire)){
+            rebuild_segment(h % seg_num);
+        }
+        help_resize(tid);
+        TrackerHolder _tracker(tracker, tid);
         // while(true){
-        std::lock_guard<std::mutex> lk(buckets[idx].lock);
+        std::unique_lock<std::mutex> lk;
+        Bucket* bucket = lock_bucket(h, lk);
         MontageOpHolder _holder(this);
         // try{
-        ListNode* curr = buckets[idx].head.next;
-        ListNode* prev = &buckets[idx].head;
+        ListNode* curr = bucket->head.next;
+        ListNode* prev = &bucket->head;
         while(curr){
-            K curr_key = curr->get_key();
-            if (curr_key == key){
+            int c = curr->compare(h, key);
+            if (c == 0){
                 optional<V> ret = curr->get_val();
+                bucket->begin_write();
                 prev->next = curr->next;
-                delete(curr);
+                bucket->end_write();
+                // get() may still be reading curr and its payload: retire
+                // the payload now and reclaim both once it is done.
+                pretire(curr->payload);
+                curr->retired = incarnation.load();
+                tracker.retire(curr, tid);
+                count_deltas[tid].ui--;
                 return ret;
-            } else if (curr_key > key){
+            } else if (c > 0){
                 return {};
             } else {
                 prev = curr;
@@ -187,20 +598,102 @@ public:
     }
 
     void clear(){
-        for (uint64_t i = 0; i < idxSize; i++){
-            ListNode* curr = buckets[i].head.next;
+        size_t buckets = bucket_count();
+        for (uint64_t i = 0; i < buckets; i++){
+            Bucket* bucket = bucket_at(i);
+            ListNode* curr = bucket->head.next;
             ListNode* next = nullptr;
             while(curr){
                 next = curr->next;
                 delete curr;
                 curr = next;
             }
-            buckets[i].head.next = nullptr;
+            bucket->head.next = nullptr;
         }
+        for (int i = 0; i < gtc->task_num; i++){
+            count_deltas[i].ui = 0;
+        }
+        count.store(0);
     }
 
 
+    // size the (empty) table for n items before recovery links them, so
+    // that chains stay short instead of being split apart afterwards.
+    void presize(size_t n){
+        uint64_t s = state.load(std::memory_order_relaxed);
+        uint64_t level = (s >> 32) + ((s & 0xffffffff) ? 1 : 0);
+        while (n > load_factor * (min_buckets << level) && level + 2 < (uint64_t)max_segments){
+            level++;
+        }
+        for (uint64_t k = 0; k <= level; k++){
+            if (directory[k].load(std::memory_order_relaxed) == nullptr){
+                directory[k].store(new BucketSegment(segment_size(k)), std::memory_order_relaxed);
+            }
+        }
+        state.store(level << 32, std::memory_order_release);
+    }
+
+    // link a recovered payload into its bucket. called by recovery threads
+    // and rebuilders, so the bucket lock is taken. the table does not
+    // resize while recovering, so no TrackerHolder is needed.
+    void insert_recovered(Payload* payload){
+        ListNode* new_node = new ListNode(this, payload);
+        K key = new_node->get_key();
+        new_node->hash = hash_fn(key);
+        std::unique_lock<std::mutex> lk;
+        Bucket* bucket = lock_bucket(new_node->hash, lk);
+        ListNode* curr = bucket->head.next;
+        ListNode* prev = &bucket->head;
+        while(curr){
+            int c = curr->compare(new_node->hash, key);
+            if (c == 0){
+                errexit("conflicting keys recovered.");
+            } else if (c > 0){
+                break;
+            } else {
+                prev = curr;
+                curr = curr->next;
+            }
+        }
+        bucket->begin_write();
+        new_node->next = curr;
+        prev->next = new_node;
+        bucket->end_write();
+    }
+
+    void rebuild_segment(size_t s){
+        Segment& seg = segments[s];
+        if (!seg.pending.load(std::memory_order_acquire)){
+            return;
+        }
+        std::lock_guard<std::mutex> lk(seg.lock);
+        if (!seg.pending.load(std::memory_order_relaxed)){
+            return;
+        }
+        for (Payload* payload : seg.payloads){
+            insert_recovered(payload);
+        }
+        count.fetch_add(seg.payloads.size(), std::memory_order_relaxed);
+        std::vector<Payload*>().swap(seg.payloads);
+        seg.pending.store(false, std::memory_order_release);
+        if (segs_left.fetch_sub(1, std::memory_order_acq_rel) == 1){
+            lazy_pending.store(false, std::memory_order_release);
+            auto dur = chrono::high_resolution_clock::now() - lazy_begin;
+            auto dur_ms = std::chrono::duration_cast<std::chrono::milliseconds>(dur).count();
+            std::cout << "Lazy recovery caught up " << dur_ms << "ms after restart" << std::endl;
+        }
+    }
+
+    void join_rebuilders(){
+        for (auto& t : rebuilders){
+            t.join();
+        }
+        rebuilders.clear();
+    }
+
     int recover(bool simulated){
+        join_rebuilders();
+        incarnation.fetch_add(1);
         if (simulated){
             recover_mode(); // PDELETE --> noop
             // clear transient structures.
@@ -208,65 +701,80 @@ public:
             online_mode(); // re-enable PDELETE.
         }
 
-        int rec_cnt = 0;
         int rec_thd = 10;
         if (gtc->checkEnv("RecoverThread")){
             rec_thd = stoi(gtc->getEnv("RecoverThread"));
         }
+        bool lazy = false;
+        if (gtc->checkEnv("LazyRecover")){
+            lazy = stoi(gtc->getEnv("LazyRecover")) != 0;
+        }
+        if (lazy && !segments){
+            segments = new Segment[seg_num];
+        }
+        // collect the live payloads shard by shard, size the table for all
+        // of them, then rebuild buckets (or, if lazy, fill segments) in
+        // parallel. shards are split by id, not by bucket, so locks are
+        // still needed.
+        std::vector<std::vector<Payload*>> shards(rec_thd);
         auto begin = chrono::high_resolution_clock::now();
-        std::unordered_map<uint64_t, pds::PBlk*>* recovered = recover_pblks(rec_thd); 
+        lazy_begin = begin;
+        recover_pblks([&](const std::vector<pds::PBlk*>& blks, int shard){
+            std::vector<Payload*>& out = shards[shard];
+            out.reserve(blks.size());
+            for (pds::PBlk* blk : blks){
+                out.push_back(reinterpret_cast<Payload*>(blk));
+            }
+        }, rec_thd);
+        std::atomic<int> rec_cnt(0);
+        for (auto& shard : shards){
+            rec_cnt.fetch_add(shard.size(), std::memory_order_relaxed);
+        }
+        presize(rec_cnt.load());
+        #pragma omp parallel for num_threads(rec_thd) schedule(static, 1)
+        for (int i = 0; i < rec_thd; i++){
+            for (Payload* payload : shards[i]){
+                if (lazy){
+                    size_t h = hash_fn((K)payload->get_unsafe_key(this));
+                    Segment& seg = segments[h % seg_num];
+                    std::lock_guard<std::mutex> lk(seg.lock);
+                    seg.payloads.push_back(payload);
+                } else {
+                    insert_recovered(payload);
+                }
+            }
+        }
+        if (!lazy){
+            count.fetch_add(rec_cnt.load(), std::memory_order_relaxed);
+        }
         auto end = chrono::high_resolution_clock::now();
         auto dur = end - begin;
         auto dur_ms = std::chrono::duration_cast<std::chrono::milliseconds>(dur).count();
-        std::cout << "Spent " << dur_ms << "ms getting PBlk(" << recovered->size() << ")" << std::endl;
-        std::vector<Payload*> payloadVector;
-        payloadVector.reserve(recovered->size());
-        begin = chrono::high_resolution_clock::now();
-        for (auto itr = recovered->begin(); itr != recovered->end(); itr++){
-            rec_cnt++;
-            Payload* payload = reinterpret_cast<Payload*>(itr->second);
-                        payloadVector.push_back(payload);
-        }
-        end = chrono::high_resolution_clock::now();
-        dur = end - begin;
-        auto dur_ms_vec = std::chrono::duration_cast<std::chrono::milliseconds>(dur).count();
-        std::cout << "Spent " << dur_ms_vec << "ms building vector" << std::endl;
-        begin = chrono::high_resolution_clock::now();
-        #pragma omp parallel num_threads(rec_thd)
-        {
-            Recoverable::init_thread(omp_get_thread_num());
-            #pragma omp for
-            for(size_t i = 0; i < payloadVector.size(); ++i){
-                //re-insert payload.
-                ListNode* new_node = new ListNode(payloadVector[i]);
-                K key = new_node->get_key();
-                size_t idx=hash_fn(key)%idxSize;
-                std::lock_guard<std::mutex> lk(buckets[idx].lock);
-                ListNode* curr = buckets[idx].head.next;
-                ListNode* prev = &buckets[idx].head;
-                while(curr){
-                    K curr_key = curr->get_key();
-                    if (curr_key == key){
-                        errexit("conflicting keys recovered.");
-                    } else if (curr_key > key){
-                        new_node->next = curr;
-                        prev->next = new_node;
-                        break;
-                    } else {
-                        prev = curr;
-                        curr = curr->next;
-                    }
-                }
-                prev->next = new_node;
+        if (!lazy){
+            std::cout << "Spent " << dur_ms << "ms recovering and inserting PBlk(" << rec_cnt.load() << ")" << std::endl;
+            std::cout << "Total time to recover: " << dur_ms << "ms" << std::endl;
+            return rec_cnt.load();
+        }
+
+        size_t pending = 0;
+        for (size_t s = 0; s < seg_num; s++){
+            if (!segments[s].payloads.empty()){
+                segments[s].pending.store(true, std::memory_order_relaxed);
+                pending++;
             }
         }
-        end = chrono::high_resolution_clock::now();
-        dur = end - begin;
-        auto dur_ms_ins = std::chrono::duration_cast<std::chrono::milliseconds>(dur).count();
-        std::cout << "Spent " << dur_ms_ins << "ms inserting(" << recovered->size() << ")" << std::endl;
-        std::cout << "Total time to recover: " << dur_ms+dur_ms_vec+dur_ms_ins << "ms" << std::endl;
-        delete recovered;
-        return rec_cnt;
+        segs_left.store(pending, std::memory_order_relaxed);
+        lazy_pending.store(pending > 0, std::memory_order_release);
+        std::cout << "Spent " << dur_ms << "ms recovering PBlk(" << rec_cnt.load() << ") into " << pending << " pending segments" << std::endl;
+        std::cout << "Total time to online: " << dur_ms << "ms" << std::endl;
+        for (int i = 0; i < rec_thd; i++){
+            rebuilders.emplace_back([this, i, rec_thd](){
+                for (size_t s = i; s < seg_num; s += rec_thd){
+                    rebuild_segment(s);
+                }
+            });
+        }
+        return rec_cnt.load();
     }
 };
 
@@ -281,7 +789,7 @@ class MontageHashTableFactory : public RideableFactory{
 #include <string>
 #include "PString.hpp"
 template <>
-class MontageHashTable<std::string, std::string, 1000000>::Payload : public pds::PBlk{
+class MontageHashTable<std::string, std::string>::Payload : public pds::PBlk{
     GENERATE_FIELD(pds::PString<TESTS_KEY_SIZE>, key, Payload);
     GENERATE_FIELD(pds::PString<TESTS_VAL_SIZE>, val, Payload);
 
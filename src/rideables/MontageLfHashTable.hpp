@@ -10,6 +10,8 @@
 #include <functional>
 #include <vector>
 #include <utility>
+#include <thread>
+#include <chrono>
 
 #include "HarnessUtils.hpp"
 #include "ConcurrentPrimitives.hpp"
@@ -19,7 +21,7 @@
 #include "Recoverable.hpp"
 
 template <class K, class V>
-class MontageLfHashTable : public RMap<K,V>, Recoverable{
+class MontageLfHashTable : public RMap<K,V>, public Recoverable{
 public:
     class Payload : public pds::PBlk{
         GENERATE_FIELD(K, key, Payload);
@@ -44,12 +46,20 @@ private:
         K key;
         MarkPtr next;
         Payload* payload;// TODO: does it have to be atomic?
+        // incarnation of the table this node was created in, see recover().
+        uint64_t incarnation;
         Node(MontageLfHashTable* ds_, K k, V v, Node* n):
-            ds(ds_),key(k),next(n),payload(ds_->pnew<Payload>(k,v)){
+            ds(ds_),key(k),next(n),payload(ds_->pnew<Payload>(k,v)),incarnation(ds_->incarnation){
             // assert(ds->epochs[pds::EpochSys::tid].ui == NULL_EPOCH);
             };
+        Node(MontageLfHashTable* ds_, K k, Payload* p): // for recovery
+            ds(ds_),key(k),next(nullptr),payload(p),incarnation(ds_->incarnation){};
         ~Node(){
-            ds->preclaim(payload);
+            // payloads of nodes from before a simulated crash were dealt
+            // with by recovery.
+            if (payload && incarnation == ds->incarnation){
+                ds->preclaim(payload);
+            }
         }
 
         void rm_payload(){
@@ -72,6 +82,9 @@ private:
     bool findNode(MarkPtr* &prev, pds::lin_var &curr, pds::lin_var &next, K key, int tid);
 
     RCUTracker<Node> tracker;
+    GlobalTestConfig* gtc;
+    // bumped by every recover().
+    uint64_t incarnation = 0;
 
     const uint64_t MARK_MASK = ~0x1;
     inline pds::lin_var getPtr(const pds::lin_var& d){
@@ -87,7 +100,7 @@ private:
         return reinterpret_cast<Node*>(d.val | 1);
     }
 public:
-    MontageLfHashTable(GlobalTestConfig* gtc) : Recoverable(gtc), tracker(gtc->task_num, 100, 1000, true) {
+    MontageLfHashTable(GlobalTestConfig* gtc_) : Recoverable(gtc_), tracker(gtc_->task_num, 100, 1000, true), gtc(gtc_) {
     };
     ~MontageLfHashTable(){};
 
@@ -95,11 +108,22 @@ public:
         Recoverable::init_thread(gtc, ltc);
     }
 
-    int recover(bool simulated){
-        errexit("recover of MontageLfHashTable not implemented.");
-        return 0;
+    // drop all transient nodes, leaving payloads alone. no concurrent ops.
+    void clear(){
+        for (int i = 0; i < idxSize; i++){
+            Node* curr = getPtr(buckets[i].ui.ptr.load(this)).template get_val<Node*>();
+            while (curr){
+                Node* next = getPtr(curr->next.ptr.load(this)).template get_val<Node*>();
+                curr->payload = nullptr;
+                delete curr;
+                curr = next;
+            }
+            buckets[i].ui.ptr.store(nullptr);
+        }
     }
 
+    int recover(bool simulated);
+
     optional<V> get(K key, int tid);
     optional<V> put(K key, V val, int tid);
     bool insert(K key, V val, int tid);
@@ -116,6 +140,89 @@ class MontageLfHashTableFactory : public RideableFactory{
 
 
 //-------Definition----------
+template <class K, class V>
+int MontageLfHashTable<K,V>::recover(bool simulated){
+    if (simulated){
+        recover_mode(); // PDELETE --> noop
+        // clear transient structures.
+        clear();
+        online_mode(); // re-enable PDELETE.
+    }
+    // nodes retired before the crash may still be in the tracker.
+    incarnation++;
+
+    int rec_thd = 10;
+    if (gtc->checkEnv("RecoverThread")){
+        rec_thd = stoi(gtc->getEnv("RecoverThread"));
+    }
+    // phase 1: inside the recovery threads, route each live payload to the
+    // rebuilder owning its bucket; rebuilder t owns the t-th contiguous
+    // range of buckets.
+    struct Entry{
+        size_t idx;
+        K key;
+        Payload* payload;
+    };
+    std::vector<std::vector<std::vector<Entry>>> routed(rec_thd,
+        std::vector<std::vector<Entry>>(rec_thd));
+    std::atomic<int> rec_cnt(0);
+    auto begin = chrono::high_resolution_clock::now();
+    recover_pblks([&](const std::vector<pds::PBlk*>& blks, int shard){
+        for (pds::PBlk* blk : blks){
+            Payload* payload = reinterpret_cast<Payload*>(blk);
+            K key = (K)payload->get_unsafe_key(this);
+            size_t idx = hash_fn(key)%idxSize;
+            routed[shard][idx*rec_thd/idxSize].push_back({idx, key, payload});
+        }
+        rec_cnt.fetch_add(blks.size(), std::memory_order_relaxed);
+    }, rec_thd);
+    auto routed_end = chrono::high_resolution_clock::now();
+
+    // phase 2: each rebuilder sorts its entries by bucket and key and links
+    // each bucket's run back to front with plain stores; no bucket is
+    // shared, so no CAS is needed.
+    std::vector<std::thread> rebuilders;
+    for (int t = 0; t < rec_thd; t++){
+        rebuilders.emplace_back([&, t](){
+            std::vector<Entry> entries;
+            for (int s = 0; s < rec_thd; s++){
+                entries.insert(entries.end(), std::make_move_iterator(routed[s][t].begin()),
+                    std::make_move_iterator(routed[s][t].end()));
+                std::vector<Entry>().swap(routed[s][t]);
+            }
+            std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b){
+                return a.idx < b.idx || (a.idx == b.idx && a.key < b.key);
+            });
+            Node* head = nullptr;
+            for (size_t i = entries.size(); i-- > 0;){
+                Entry& e = entries[i];
+                if (i + 1 == entries.size() || entries[i+1].idx != e.idx){
+                    head = nullptr;
+                } else if (entries[i+1].key == e.key){
+                    errexit("conflicting keys recovered.");
+                }
+                Node* node = new Node(this, e.key, e.payload);
+                node->next.ptr.store(head);
+                head = node;
+                if (i == 0 || entries[i-1].idx != e.idx){
+                    buckets[e.idx].ui.ptr.store(head);
+                }
+            }
+        });
+    }
+    for (auto& t : rebuilders){
+        t.join();
+    }
+    auto end = chrono::high_resolution_clock::now();
+    auto route_ms = std::chrono::duration_cast<std::chrono::milliseconds>(routed_end - begin).count();
+    auto build_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - routed_end).count();
+    auto dur_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count();
+    std::cout << "Spent " << route_ms << "ms recovering and routing PBlk(" << rec_cnt.load() << ")" << std::endl;
+    std::cout << "Spent " << build_ms << "ms rebuilding buckets" << std::endl;
+    std::cout << "Total time to recover: " << dur_ms << "ms" << std::endl;
+    return rec_cnt.load();
+}
+
 template <class K, class V> 
 optional<V> MontageLfHashTable<K,V>::get(K key, int tid) {
     optional<V> res={};
@@ -10,9 +10,13 @@
 #include "RCUTracker.hpp"
 #include "CustomTypes.hpp"
 #include "Recoverable.hpp"
+#include <vector>
+#include <queue>
+#include <functional>
+#include <chrono>
 
 template<typename T>
-class MontageMSQueue : public RQueue<T>, Recoverable{
+class MontageMSQueue : public RQueue<T>, public Recoverable{
 public:
     class Payload : public pds::PBlk{
         GENERATE_FIELD(T, val, Payload);
@@ -29,38 +33,55 @@ private:
         MontageMSQueue* ds = nullptr;
         pds::atomic_lin_var<Node*> next;
         Payload* payload;
+        // transient copy of the payload's sn; the dummy keeps the sn of the
+        // node it was, so that the next enqueue can follow it.
+        uint64_t sn = 0;
+        // incarnation of the queue this node was created in, see recover().
+        uint64_t incarnation = 0;
 
         Node(): next(nullptr), payload(nullptr){}
-        Node(MontageMSQueue* ds_): ds(ds_), next(nullptr), payload(nullptr){}
-        Node(MontageMSQueue* ds_, T v): ds(ds_), next(nullptr), payload(ds_->pnew<Payload>(v)){
+        Node(MontageMSQueue* ds_): ds(ds_), next(nullptr), payload(nullptr), incarnation(ds_->incarnation){}
+        Node(MontageMSQueue* ds_, T v): ds(ds_), next(nullptr), payload(ds_->pnew<Payload>(v)), incarnation(ds_->incarnation){
             // assert(ds->epochs[EpochSys::tid].ui == NULL_EPOCH);
         }
+        Node(MontageMSQueue* ds_, Payload* p): // for recovery
+            ds(ds_), next(nullptr), payload(p), incarnation(ds_->incarnation){}
 
         void set_sn(uint64_t s){
             assert(payload!=nullptr && "payload shouldn't be null");
+            sn = s;
             payload->set_unsafe_sn(ds,s);
         }
         ~Node(){
-            if (payload){
+            // payloads of nodes from before a simulated crash were dealt
+            // with by recovery.
+            if (payload && incarnation == ds->incarnation){
                 ds->preclaim(payload);
             }
         }
     };
 
-public:
-    std::atomic<uint64_t> global_sn;
-
 private:
     // dequeue pops node from head
     pds::atomic_lin_var<Node*> head;
     // enqueue pushes node to tail
     std::atomic<Node*> tail;
     RCUTracker<Node> tracker;
+    GlobalTestConfig* gtc;
+    // bumped by every recover().
+    uint64_t incarnation = 0;
+
+    // swing tail forward to node, unless others already moved it there or
+    // past it; sns increase along the list.
+    void advance_tail(Node* node){
+        Node* t = tail.load();
+        while(t->sn < node->sn && !tail.compare_exchange_weak(t, node));
+    }
 
 public:
-    MontageMSQueue(GlobalTestConfig* gtc): 
-        Recoverable(gtc), global_sn(0), head(nullptr), tail(nullptr), 
-        tracker(gtc->task_num, 100, 1000, true){
+    MontageMSQueue(GlobalTestConfig* gtc_): 
+        Recoverable(gtc_), head(nullptr), tail(nullptr), 
+        tracker(gtc_->task_num, 100, 1000, true), gtc(gtc_){
 
         Node* dummy = new Node(this);
         head.store(dummy);
@@ -71,17 +92,88 @@ public:
         Recoverable::init_thread(gtc, ltc);
     }
 
-    int recover(bool simulated){
-        errexit("recover of MontageMSQueue not implemented.");
-        return 0;
-    }
+    int recover(bool simulated);
 
     ~MontageMSQueue(){};
 
     void enqueue(T val, int tid);
     optional<T> dequeue(int tid);
+    // link a pre-built chain with a single CAS in one operation.
+    void enqueue_bulk(const std::vector<T>& vals, int tid);
+    // swing head past up to n nodes with a single CAS in one operation.
+    std::vector<T> dequeue_bulk(int n, int tid);
 };
 
+template<typename T>
+int MontageMSQueue<T>::recover(bool simulated){
+    // drop the transient list, leaving payloads alone; the dummy is either
+    // fresh or owns a retired payload.
+    Node* curr = head.load_val(this);
+    while (curr){
+        Node* next = curr->next.load_val(this);
+        curr->payload = nullptr;
+        delete curr;
+        curr = next;
+    }
+    // nodes retired before the crash may still be in the tracker.
+    incarnation++;
+
+    int rec_thd = 10;
+    if (gtc->checkEnv("RecoverThread")){
+        rec_thd = stoi(gtc->getEnv("RecoverThread"));
+    }
+    // phase 1: each recovery thread sorts the payloads of its shard by sn.
+    typedef std::pair<uint64_t, Payload*> Entry;
+    std::vector<std::vector<Entry>> runs(rec_thd);
+    std::atomic<int> rec_cnt(0);
+    auto begin = chrono::high_resolution_clock::now();
+    recover_pblks([&](const std::vector<pds::PBlk*>& blks, int shard){
+        std::vector<Entry>& run = runs[shard];
+        run.reserve(blks.size());
+        for (pds::PBlk* blk : blks){
+            Payload* payload = reinterpret_cast<Payload*>(blk);
+            run.emplace_back(payload->get_unsafe_sn(this), payload);
+        }
+        std::sort(run.begin(), run.end());
+        rec_cnt.fetch_add(blks.size(), std::memory_order_relaxed);
+    }, rec_thd);
+    auto sorted_end = chrono::high_resolution_clock::now();
+
+    // phase 2: merge the runs and link the nodes behind a fresh dummy in
+    // the same pass.
+    typedef std::pair<uint64_t, int> Cursor; // (sn, run)
+    std::priority_queue<Cursor, std::vector<Cursor>, std::greater<Cursor>> heads;
+    std::vector<size_t> pos(rec_thd, 0);
+    for (int r = 0; r < rec_thd; r++){
+        if (!runs[r].empty()){
+            heads.emplace(runs[r][0].first, r);
+        }
+    }
+    Node* dummy = new Node(this);
+    Node* last = dummy;
+    while (!heads.empty()){
+        int r = heads.top().second;
+        heads.pop();
+        Node* node = new Node(this, runs[r][pos[r]].second);
+        node->sn = runs[r][pos[r]].first;
+        last->next.store(node);
+        last = node;
+        if (++pos[r] < runs[r].size()){
+            heads.emplace(runs[r][pos[r]].first, r);
+        }
+    }
+    head.store(dummy);
+    tail.store(last);
+    auto end = chrono::high_resolution_clock::now();
+    auto sort_ms = std::chrono::duration_cast<std::chrono::milliseconds>(sorted_end - begin).count();
+    auto link_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - sorted_end).count();
+    auto dur_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count();
+    std::cout << "Spent " << sort_ms << "ms recovering and sorting PBlk(" << rec_cnt.load() << ")" << std::endl;
+    std::cout << "Spent " << link_ms << "ms merging and linking" << std::endl;
+    std::cout << "Total time to recover: " << dur_ms << "ms" << std::endl;
+    return rec_cnt.load();
+}
+
 template<typename T>
 void MontageMSQueue<T>::enqueue(T v, int tid){
     Node* new_node = new Node(this,v);
@@ -90,12 +182,13 @@ void MontageMSQueue<T>::enqueue(T v, int tid){
     while(true){
         // Node* cur_head = head.load();
         cur_tail = tail.load();
-        uint64_t s = global_sn.fetch_add(1);
         pds::lin_var next = cur_tail->next.load(this);
         if(cur_tail == tail.load()){
             if(next.get_val<Node*>() == nullptr) {
+                // sns increase by one along the list, so the predecessor
+                // dictates ours and no shared counter is needed.
                 // directly set m_sn and BEGIN_OP will flush it
-                new_node->set_sn(s);
+                new_node->set_sn(cur_tail->sn + 1);
                 begin_op();
                 /* set_sn must happen before PDELETE of payload since it's 
                  * before linearization point.
@@ -153,6 +246,104 @@ optional<T> MontageMSQueue<T>::dequeue(int tid){
     return res;
 }
 
+template<typename T>
+void MontageMSQueue<T>::enqueue_bulk(const std::vector<T>& vals, int tid){
+    if (vals.empty()){
+        return;
+    }
+    // payloads stay pending until begin_op registers them all at once.
+    std::vector<Node*> chain;
+    chain.reserve(vals.size());
+    for (const T& v : vals){
+        Node* new_node = new Node(this,v);
+        if (!chain.empty()){
+            chain.back()->next.store(new_node);
+        }
+        chain.push_back(new_node);
+    }
+    Node* first = chain.front();
+    Node* last = chain.back();
+    Node* cur_tail = nullptr;
+    tracker.start_op(tid);
+    while(true){
+        cur_tail = tail.load();
+        pds::lin_var next = cur_tail->next.load(this);
+        if(cur_tail == tail.load()){
+            if(next.get_val<Node*>() == nullptr) {
+                // restamp the whole chain behind the tail we are about to
+                // link to, as in enqueue.
+                uint64_t s = cur_tail->sn;
+                for (Node* n : chain){
+                    n->set_sn(++s);
+                }
+                begin_op();
+                if((cur_tail->next).CAS_verify(this, next, first)){
+                    end_op();
+                    break;
+                }
+                abort_op();
+            } else {
+                tail.compare_exchange_strong(cur_tail, next.get_val<Node*>()); // try to swing tail to next node
+            }
+        }
+    }
+    // others may have already helped the tail part of the way along the chain.
+    advance_tail(last);
+    tracker.end_op(tid);
+}
+
+template<typename T>
+std::vector<T> MontageMSQueue<T>::dequeue_bulk(int n, int tid){
+    std::vector<T> res;
+    std::vector<Node*> nodes; // dummy followed by the nodes to dequeue
+    std::vector<Payload*> payloads;
+    tracker.start_op(tid);
+    while(true){
+        pds::lin_var cur_head = head.load(this);
+        nodes.clear();
+        nodes.push_back(cur_head.get_val<Node*>());
+        while((int)nodes.size() <= n){
+            Node* next = nodes.back()->next.load_val(this);
+            if(next == nullptr){
+                break;
+            }
+            nodes.push_back(next);
+        }
+        if(cur_head != head.load(this)){
+            continue;
+        }
+        if(nodes.size() == 1){
+            // queue is empty
+            break;
+        }
+        // head must not pass tail; swing a lagging tail past the whole walk
+        // at once rather than one node per retry.
+        advance_tail(nodes.back());
+        begin_op();
+        payloads.clear();
+        for(size_t i = 1; i < nodes.size(); i++){
+            payloads.push_back(nodes[i]->payload);// get payloads for PDELETE
+        }
+        if(head.CAS_verify(this, cur_head, nodes.back())){
+            res.reserve(payloads.size());
+            for(Payload* payload : payloads){
+                res.push_back((T)payload->get_val(this));// old see new is impossible
+                pretire(payload); // semantically we are removing the nodes from queue
+            }
+            end_op();
+            // as in dequeue, each retired node takes over its successor's payload.
+            for(size_t i = 0; i < payloads.size(); i++){
+                nodes[i]->payload = payloads[i];
+                tracker.retire(nodes[i], tid);
+            }
+            break;
+        }
+        abort_op();
+    }
+    tracker.end_op(tid);
+    return res;
+}
+
 template <class T> 
 class MontageMSQueueFactory : public RideableFactory{
     Rideable* build(GlobalTestConfig* gtc){
@@ -4,15 +4,20 @@
 #include <iostream>
 #include <atomic>
 #include <algorithm>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <functional>
 #include "HarnessUtils.hpp"
 #include "ConcurrentPrimitives.hpp"
-#include "RMap.hpp"
+#include "ROrderedMap.hpp"
 #include "RCUTracker.hpp"
 #include "CustomTypes.hpp"
 #include "Recoverable.hpp"
 
 template <class K, class V>
-class MontageNatarajanTree : public RMap<K,V>, public Recoverable{
+class MontageNatarajanTree : public ROrderedMap<K,V>, public Recoverable{
 public:
     class Payload : public pds::PBlk{
         GENERATE_FIELD(K, key, Payload);
@@ -33,15 +38,21 @@ private:
         std::atomic<Node*> right;
         K key;
         Payload* payload;// TODO: does it have to be atomic?
+        // incarnation of the tree this node was created in, see recover().
+        uint64_t incarnation;
 
         Node(MontageNatarajanTree* ds_, K k, V val, Node* l=nullptr, Node* r=nullptr):
-            ds(ds_), level(finite),left(l),right(r),key(k),payload(ds_->pnew<Payload>(key, val)){ };
+            ds(ds_), level(finite),left(l),right(r),key(k),payload(ds_->pnew<Payload>(key, val)),incarnation(ds_->incarnation){ };
+        Node(MontageNatarajanTree* ds_, K k, Payload* p): // for recovery
+            ds(ds_), level(finite),left(nullptr),right(nullptr),key(k),payload(p),incarnation(ds_->incarnation){ };
         Node(MontageNatarajanTree* ds_, Level lev, Node* l=nullptr, Node* r=nullptr):
-            ds(ds_), level(lev),left(l),right(r),key(),payload(nullptr){
+            ds(ds_), level(lev),left(l),right(r),key(),payload(nullptr),incarnation(ds_->incarnation){
             assert(lev != finite && "use constructor with another signature for concrete nodes!");
         };
         ~Node(){
-            if(payload!=nullptr){
+            // payloads of leaves from before a simulated crash were dealt
+            // with by recovery.
+            if(payload!=nullptr && incarnation==ds->incarnation){
                 // this is a leaf
                 ds->preclaim(payload);
             }
@@ -83,11 +94,22 @@ private:
     };
 
     /* variables */
+    // bumped by every recover().
+    uint64_t incarnation = 0;
+    GlobalTestConfig* gtc;
     RCUTracker<Node> tracker;
     const V defV{};
     Node r{this,inf2};
     Node s{this,inf1};
     padded<SeekRecord>* records;
+    // scans validate against per-thread sequence numbers, odd while the
+    // thread is in the middle of a linearizing CAS. after optimistic_scans
+    // failed tries, a scan sets scan_blocking to hold off updates.
+    static const int optimistic_scans = 4;
+    paddedAtomic<uint64_t>* update_seqs;
+    std::atomic<bool> scan_blocking;
+    std::mutex scan_lock;
+    int task_num;
     const size_t GET_POINTER_BITS = 0xfffffffffffffffc;//for machine 64-bit or less.
 
     /* helper functions */
@@ -150,15 +172,31 @@ private:
     /* private interfaces */
     void seek(K key, int tid);
     bool cleanup(K key, int tid);
-    // void doRangeQuery(Node& k1, Node& k2, int tid, Node* root, std::map<K,V>& res);
+    Node* build(std::vector<Node*>& leaves, size_t lo, size_t hi, int spawn);
+    void clear(Node* n);
+    void collect(const K& lo, const K& hi, int limit, std::vector<Node*>& leaves);
+    inline void begin_update(int tid){
+        while(true){
+            update_seqs[tid].ui.fetch_add(1);
+            if(!scan_blocking.load()) return;
+            update_seqs[tid].ui.fetch_add(1);
+            while(scan_blocking.load());
+        }
+    }
+    inline void end_update(int tid){
+        update_seqs[tid].ui.fetch_add(1);
+    }
 public:
-    MontageNatarajanTree(GlobalTestConfig* gtc):
-        Recoverable(gtc), tracker(gtc->task_num, 100, 1000, true){
+    MontageNatarajanTree(GlobalTestConfig* gtc_):
+        Recoverable(gtc_), gtc(gtc_), tracker(gtc_->task_num, 100, 1000, true){
         r.right.store(new Node(this,inf2));
         r.left.store(&s);
         s.right.store(new Node(this,inf1));
         s.left.store(new Node(this,inf0));
         records = new padded<SeekRecord>[gtc->task_num]{};
+        task_num = gtc->task_num;
+        update_seqs = new paddedAtomic<uint64_t>[task_num]{};
+        scan_blocking.store(false);
     };
     ~MontageNatarajanTree(){};
 
@@ -166,17 +204,14 @@ public:
         Recoverable::init_thread(gtc, ltc);
     }
 
-    int recover(bool simulated){
-        errexit("recover of MontageNatarajanTree not implemented.");
-        return 0;
-    }
+    int recover(bool simulated);
 
     optional<V> get(K key, int tid);
     optional<V> put(K key, V val, int tid);
     bool insert(K key, V val, int tid);
     optional<V> remove(K key, int tid);
     optional<V> replace(K key, V val, int tid);
-    // std::map<K, V> rangeQuery(K key1, K key2, int& len, int tid);
+    int range(K lo, K hi, int limit, std::function<void(const K&, const V&)> f, int tid);
 };
 
 template<class T>
@@ -187,6 +222,162 @@ class MontageNatarajanTreeFactory : public RideableFactory{
 };
 
 //-------Definition----------
+// drop the subtree at n, leaving payloads alone. no concurrent ops.
+template <class K, class V>
+void MontageNatarajanTree<K,V>::clear(Node* n){
+    n=getPtr(n);
+    if(n==nullptr) return;
+    clear(n->left.load());
+    clear(n->right.load());
+    n->payload=nullptr;
+    delete n;
+}
+
+// balanced external tree over leaves[lo,hi), which are sorted. every
+// routing node carries the smallest key of its right subtree, as insert
+// would have it. the top spawn levels build their left halves in parallel.
+template <class K, class V>
+typename MontageNatarajanTree<K,V>::Node* MontageNatarajanTree<K,V>::build(
+    std::vector<Node*>& leaves, size_t lo, size_t hi, int spawn){
+    if(hi-lo==1) return leaves[lo];
+    size_t mid=(lo+hi)/2;
+    Node* left=nullptr;
+    Node* right=nullptr;
+    if(spawn>0){
+        std::thread t([&](){left=build(leaves,lo,mid,spawn-1);});
+        right=build(leaves,mid,hi,spawn-1);
+        t.join();
+    } else {
+        left=build(leaves,lo,mid,0);
+        right=build(leaves,mid,hi,0);
+    }
+    Node* internal=new Node(this,inf2);
+    internal->set(leaves[mid]->key,left,right);
+    return internal;
+}
+
+template <class K, class V>
+int MontageNatarajanTree<K,V>::recover(bool simulated){
+    if (simulated){
+        recover_mode(); // PDELETE --> noop
+        // clear transient structures.
+        clear(s.left.load());
+        online_mode(); // re-enable PDELETE.
+    } else {
+        clear(s.left.load());
+    }
+    // nodes retired before the crash may still be in the tracker.
+    incarnation++;
+
+    int rec_thd = 10;
+    if (gtc->checkEnv("RecoverThread")){
+        rec_thd = stoi(gtc->getEnv("RecoverThread"));
+    }
+    struct Entry{
+        K key;
+        Payload* payload;
+        bool operator<(const Entry& oth) const { return key < oth.key; }
+    };
+    // phase 1: each recovery thread sorts the payloads of its shard.
+    std::vector<std::vector<Entry>> runs(rec_thd);
+    std::atomic<int> rec_cnt(0);
+    auto begin = chrono::high_resolution_clock::now();
+    recover_pblks([&](const std::vector<pds::PBlk*>& blks, int shard){
+        std::vector<Entry>& run = runs[shard];
+        run.reserve(blks.size());
+        for (pds::PBlk* blk : blks){
+            Payload* payload = reinterpret_cast<Payload*>(blk);
+            run.push_back({(K)payload->get_unsafe_key(this), payload});
+        }
+        std::sort(run.begin(), run.end());
+        rec_cnt.fetch_add(blks.size(), std::memory_order_relaxed);
+    }, rec_thd);
+    auto sorted_end = chrono::high_resolution_clock::now();
+
+    // phase 2: cut the key space at splitters sampled from the runs; each
+    // thread merges one key range across all runs and makes its leaves in
+    // place.
+    std::vector<Entry> samples;
+    for (auto& run : runs){
+        size_t stride = std::max<size_t>(1, run.size() / (rec_thd * 8));
+        for (size_t i = stride / 2; i < run.size(); i += stride){
+            samples.push_back(run[i]);
+        }
+    }
+    std::sort(samples.begin(), samples.end());
+    std::vector<Entry> splitters;
+    for (int t = 1; t < rec_thd && !samples.empty(); t++){
+        splitters.push_back(samples[samples.size() * t / rec_thd]);
+    }
+    int parts = splitters.size() + 1;
+    // bounds[p][r]: start of part p in run r.
+    std::vector<std::vector<size_t>> bounds(parts + 1, std::vector<size_t>(rec_thd));
+    std::vector<size_t> offsets(parts + 1, 0);
+    for (int p = 0; p <= parts; p++){
+        for (int r = 0; r < rec_thd; r++){
+            if (p == 0){
+                bounds[p][r] = 0;
+            } else if (p == parts){
+                bounds[p][r] = runs[r].size();
+            } else {
+                bounds[p][r] = std::lower_bound(runs[r].begin(), runs[r].end(), splitters[p-1]) - runs[r].begin();
+            }
+            if (p > 0){
+                offsets[p] += bounds[p][r] - bounds[p-1][r];
+            }
+        }
+        if (p > 0){
+            offsets[p] += offsets[p-1];
+        }
+    }
+    std::vector<Node*> leaves(rec_cnt.load());
+    std::vector<std::thread> mergers;
+    for (int p = 0; p < parts; p++){
+        mergers.emplace_back([&, p](){
+            std::vector<Entry> part;
+            part.reserve(offsets[p+1] - offsets[p]);
+            for (int r = 0; r < rec_thd; r++){
+                size_t mid = part.size();
+                part.insert(part.end(), runs[r].begin() + bounds[p][r], runs[r].begin() + bounds[p+1][r]);
+                std::inplace_merge(part.begin(), part.begin() + mid, part.end());
+            }
+            for (size_t i = 0; i < part.size(); i++){
+                if (i > 0 && part[i-1].key == part[i].key){
+                    errexit("conflicting keys recovered.");
+                }
+                leaves[offsets[p] + i] = new Node(this, part[i].key, part[i].payload);
+            }
+        });
+    }
+    for (auto& t : mergers){
+        t.join();
+    }
+    auto merged_end = chrono::high_resolution_clock::now();
+
+    // phase 3: build the routing nodes bottom up.
+    int spawn = 0;
+    while ((1 << (spawn + 1)) <= rec_thd){
+        spawn++;
+    }
+    // as after inserts, all keys hang left of an inf0 routing node whose
+    // right child is the inf0 leaf; seek() relies on it.
+    if (leaves.empty()){
+        s.left.store(new Node(this,inf0));
+    } else {
+        s.left.store(new Node(this,inf0,build(leaves, 0, leaves.size(), spawn),new Node(this,inf0)));
+    }
+    auto end = chrono::high_resolution_clock::now();
+    auto sort_ms = std::chrono::duration_cast<std::chrono::milliseconds>(sorted_end - begin).count();
+    auto merge_ms = std::chrono::duration_cast<std::chrono::milliseconds>(merged_end - sorted_end).count();
+    auto build_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - merged_end).count();
+    auto dur_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count();
+    std::cout << "Spent " << sort_ms << "ms recovering and sorting PBlk(" << rec_cnt.load() << ")" << std::endl;
+    std::cout << "Spent " << merge_ms << "ms merging into " << parts << " parts" << std::endl;
+    std::cout << "Spent " << build_ms << "ms building the tree" << std::endl;
+    std::cout << "Total time to recover: " << dur_ms << "ms" << std::endl;
+    return rec_cnt.load();
+}
+
 template <class K, class V>
 void MontageNatarajanTree<K,V>::seek(K key, int tid){
     SeekRecord* seekRecord=&(records[tid].ui);
@@ -270,23 +461,6 @@ bool MontageNatarajanTree<K,V>::cleanup(K key, int tid){
     return res;
 }
 
-/* to test rangeQuery */
-// template <>
-// optional<int> MontageNatarajanTree<int,int>::get(int key, int tid){
-// 	int len=0;
-// 	auto x = rangeQuery(key-500,key,len,tid);
-// 	Node keyNode{key,defV,nullptr,nullptr};//node to be compared
-// 	optional<int> res={};
-// 	SeekRecord* seekRecord=&(records[tid].ui);
-// 	Node* leaf=nullptr;
-// 	seek(key,tid);
-// 	leaf=getPtr(seekRecord->leaf);
-// 	if(nodeEqual(&keyNode,leaf)){
-// 		res = leaf->val;
-// 	}
-// 	return res;
-// }
-
 template <class K, class V>
 optional<V> MontageNatarajanTree<K,V>::get(K key, int tid){
     optional<V> res={};
@@ -347,14 +521,17 @@ optional<V> MontageNatarajanTree<K,V>::put(K key, V val, int tid){
                 newInternal->set(std::max(key,leaf->key),newLeft,newRight);
 
             Node* tmpExpected=getPtr(leaf);
+            begin_update(tid);
             begin_op();
             if(childAddr->compare_exchange_strong(tmpExpected,getPtr(newInternal))){
                 end_op();
+                end_update(tid);
                 res={};
                 break;//insertion succeeds
             }
             else{//fails; help conflicting delete operation
                 abort_op();
+                end_update(tid);
                 Node* tmpChild=childAddr->load();
                 if(getPtr(tmpChild)==leaf && (getFlg(tmpChild)||getTg(tmpChild)))
                     cleanup(key,tid);
@@ -366,16 +543,19 @@ optional<V> MontageNatarajanTree<K,V>::put(K key, V val, int tid){
                 childAddr=&(parent->left);
             else
                 childAddr=&(parent->right);
+            begin_update(tid);
             begin_op();
             res=leaf->get_val();
             if(childAddr->compare_exchange_strong(leaf,newLeaf)){
                 leaf->rm_payload();
                 end_op();
+                end_update(tid);
                 delete(newInternal);// this is always local so no need to use tracker
                 tracker.retire(leaf,tid);
                 break;
             }
             abort_op();
+            end_update(tid);
         }
     }
 
@@ -427,14 +607,17 @@ bool MontageNatarajanTree<K,V>::insert(K key, V val, int tid){
                 newInternal->set(std::max(key,leaf->key),newLeft,newRight);
 
             Node* tmpExpected=getPtr(leaf);
+            begin_update(tid);
             begin_op();
             if(childAddr->compare_exchange_strong(tmpExpected,getPtr(newInternal))){
                 end_op();
+                end_update(tid);
                 res=true;
                 break;
             }
             else{//fails; help conflicting delete operation
                 abort_op();
+                end_update(tid);
                 Node* tmpChild=childAddr->load();
                 if(getPtr(tmpChild)==leaf && (getFlg(tmpChild)||getTg(tmpChild)))
                     cleanup(key,tid);
@@ -480,6 +663,7 @@ optional<V> MontageNatarajanTree<K,V>::remove(K key, int tid){
             }
 
             Node* tmpExpected=leaf;
+            begin_update(tid);
             begin_op();
             res=leaf->get_val();
             if(childAddr->compare_exchange_strong(tmpExpected,
@@ -490,11 +674,13 @@ optional<V> MontageNatarajanTree<K,V>::remove(K key, int tid){
                  */
                 leaf->rm_payload();
                 end_op();
+                end_update(tid);
                 injecting=false;
                 if(cleanup(key,tid)) break;
             }
             else{
                 abort_op();
+                end_update(tid);
                 Node* tmpChild=childAddr->load();
                 if(getPtr(tmpChild)==leaf && (getFlg(tmpChild)||getTg(tmpChild)))
                     cleanup(key,tid);
@@ -514,6 +700,73 @@ optional<V> MontageNatarajanTree<K,V>::remove(K key, int tid){
     return res;
 }
 
+// in-order walk of the leaves in [lo, hi]. leaves behind a flagged edge
+// are logically removed and skipped. cleanup() only splices out such
+// leaves and freezes the edges it bypasses, so a walk racing with it still
+// reaches every live leaf exactly once.
+template <class K, class V>
+void MontageNatarajanTree<K,V>::collect(const K& lo, const K& hi, int limit, std::vector<Node*>& leaves){
+    leaves.clear();
+    std::vector<Node*> stack;
+    stack.push_back(s.left.load());
+    while(!stack.empty()){
+        Node* field=stack.back();
+        stack.pop_back();
+        Node* n=getPtr(field);
+        Node* l=n->left.load();
+        if(getPtr(l)==nullptr){
+            if(!getFlg(field) && !isInf(n) && !(n->key<lo) && !(hi<n->key)){
+                leaves.push_back(n);
+                if(limit>0 && (int)leaves.size()>=limit) return;
+            }
+            continue;
+        }
+        if(!nodeLess(hi,n)) stack.push_back(n->right.load());
+        if(nodeLess(lo,n)) stack.push_back(l);
+    }
+}
+
+// the leaves collected are a snapshot if no thread linearized an update
+// while collecting, i.e., no sequence number was odd or moved. values are
+// read once the snapshot is taken, under a single read-only op.
+template <class K, class V>
+int MontageNatarajanTree<K,V>::range(K lo, K hi, int limit, std::function<void(const K&, const V&)> f, int tid){
+    std::vector<Node*> leaves;
+    std::vector<uint64_t> seqs(task_num);
+    tracker.start_op(tid);
+    {
+        MontageOpHolderReadOnly _holder(this);
+        bool done=false;
+        for(int i=0;i<optimistic_scans && !done;i++){
+            bool quiescent=true;
+            for(int t=0;t<task_num && quiescent;t++){
+                seqs[t]=update_seqs[t].ui.load();
+                quiescent=(seqs[t]%2==0);
+            }
+            if(!quiescent) continue;
+            collect(lo,hi,limit,leaves);
+            done=true;
+            for(int t=0;t<task_num && done;t++){
+                done=(update_seqs[t].ui.load()==seqs[t]);
+            }
+        }
+        if(!done){
+            std::lock_guard<std::mutex> lk(scan_lock);
+            scan_blocking.store(true);
+            for(int t=0;t<task_num;t++){
+                while(update_seqs[t].ui.load()%2!=0);
+            }
+            collect(lo,hi,limit,leaves);
+            scan_blocking.store(false);
+        }
+        for(Node* leaf : leaves){
+            f(leaf->key,leaf->get_unsafe_val());
+        }
+    }
+    tracker.end_op(tid);
+    return leaves.size();
+}
+
 template <class K, class V>
 optional<V> MontageNatarajanTree<K,V>::replace(K key, V val, int tid){
     optional<V> res={};
@@ -12,6 +12,10 @@
 #include "Recoverable.hpp"
 #include "Recoverable.hpp"
 #include <mutex>
+#include <vector>
+#include <queue>
+#include <functional>
+#include <chrono>
 
 
 template<typename T>
@@ -38,6 +42,8 @@ private:
         // Node(): next(nullptr){}; 
         Node(MontageQueue* ds_, T v, uint64_t n=0): 
             ds(ds_), next(nullptr), payload(ds_->pnew<Payload>(v, n)), val(v){};
+        Node(MontageQueue* ds_, Payload* p): // for recovery
+            ds(ds_), next(nullptr), payload(p){};
         // Node(T v, uint64_t n): next(nullptr), val(v){};
 
         void set_sn(uint64_t s){
@@ -64,10 +70,11 @@ private:
     // enqueue pushes node to tail
     Node* tail;
     std::mutex lock;
+    GlobalTestConfig* gtc;
 
 public:
-    MontageQueue(GlobalTestConfig* gtc): 
-        Recoverable(gtc), global_sn(0), head(nullptr), tail(nullptr){
+    MontageQueue(GlobalTestConfig* gtc_): 
+        Recoverable(gtc_), global_sn(0), head(nullptr), tail(nullptr), gtc(gtc_){
     }
 
     ~MontageQueue(){};
@@ -76,15 +83,83 @@ public:
         Recoverable::init_thread(gtc, ltc);
     }
 
-    int recover(bool simulated){
-        errexit("recover of MontageQueue not implemented.");
-        return 0;
-    }
+    int recover(bool simulated);
 
     void enqueue(T val, int tid);
     optional<T> dequeue(int tid);
+    // take the lock and open an operation once per batch.
+    void enqueue_bulk(const std::vector<T>& vals, int tid);
+    std::vector<T> dequeue_bulk(int n, int tid);
 };
 
+template<typename T>
+int MontageQueue<T>::recover(bool simulated){
+    if (simulated){
+        recover_mode(); // PDELETE --> noop
+        // clear transient structures.
+        while (head){
+            Node* tmp = head;
+            head = head->next;
+            delete tmp;
+        }
+        tail = nullptr;
+        online_mode(); // re-enable PDELETE.
+    }
+    int rec_thd = 10;
+    if (gtc->checkEnv("RecoverThread")){
+        rec_thd = stoi(gtc->getEnv("RecoverThread"));
+    }
+    // phase 1: each recovery thread sorts the payloads of its shard by sn.
+    typedef std::pair<uint64_t, Payload*> Entry;
+    std::vector<std::vector<Entry>> runs(rec_thd);
+    std::atomic<int> rec_cnt(0);
+    auto begin = chrono::high_resolution_clock::now();
+    recover_pblks([&](const std::vector<pds::PBlk*>& blks, int shard){
+        std::vector<Entry>& run = runs[shard];
+        run.reserve(blks.size());
+        for (pds::PBlk* blk : blks){
+            Payload* payload = reinterpret_cast<Payload*>(blk);
+            run.emplace_back(payload->get_unsafe_sn(this), payload);
+        }
+        std::sort(run.begin(), run.end());
+        rec_cnt.fetch_add(blks.size(), std::memory_order_relaxed);
+    }, rec_thd);
+    auto sorted_end = chrono::high_resolution_clock::now();
+
+    // phase 2: merge the runs and link the nodes in the same pass.
+    typedef std::pair<uint64_t, int> Cursor; // (sn, run)
+    std::priority_queue<Cursor, std::vector<Cursor>, std::greater<Cursor>> heads;
+    std::vector<size_t> pos(rec_thd, 0);
+    for (int r = 0; r < rec_thd; r++){
+        if (!runs[r].empty()){
+            heads.emplace(runs[r][0].first, r);
+        }
+    }
+    while (!heads.empty()){
+        int r = heads.top().second;
+        heads.pop();
+        Node* node = new Node(this, runs[r][pos[r]].second);
+        if (tail == nullptr){
+            head = tail = node;
+        } else {
+            tail->next = node;
+            tail = node;
+        }
+        global_sn = runs[r][pos[r]].first + 1;
+        if (++pos[r] < runs[r].size()){
+            heads.emplace(runs[r][pos[r]].first, r);
+        }
+    }
+    auto end = chrono::high_resolution_clock::now();
+    auto sort_ms = std::chrono::duration_cast<std::chrono::milliseconds>(sorted_end - begin).count();
+    auto link_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - sorted_end).count();
+    auto dur_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count();
+    std::cout << "Spent " << sort_ms << "ms recovering and sorting PBlk(" << rec_cnt.load() << ")" << std::endl;
+    std::cout << "Spent " << link_ms << "ms merging and linking" << std::endl;
+    std::cout << "Total time to recover: " << dur_ms << "ms" << std::endl;
+    return rec_cnt.load();
+}
+
 template<typename T>
 void MontageQueue<T>::enqueue(T val, int tid){
     Node* new_node = new Node(this, val);
@@ -127,6 +202,68 @@ optional<T> MontageQueue<T>::dequeue(int tid){
     // }
 }
 
+template<typename T>
+void MontageQueue<T>::enqueue_bulk(const std::vector<T>& vals, int tid){
+    if (vals.empty()){
+        return;
+    }
+    // build the chain outside the critical section.
+    Node* first = nullptr;
+    Node* last = nullptr;
+    for (const T& v : vals){
+        Node* new_node = new Node(this, v);
+        if (last == nullptr){
+            first = new_node;
+        } else {
+            last->next = new_node;
+        }
+        last = new_node;
+    }
+    std::lock_guard<std::mutex> lk(lock);
+    // no read or write so impossible to have old see new exception
+    for (Node* n = first; n != nullptr; n = n->next){
+        n->set_sn(global_sn);
+        global_sn++;
+    }
+    MontageOpHolder _holder(this);
+    if(tail == nullptr) {
+        head = first;
+    } else {
+        tail->next = first;
+    }
+    tail = last;
+}
+
+template<typename T>
+std::vector<T> MontageQueue<T>::dequeue_bulk(int n, int tid){
+    std::vector<T> res;
+    lock.lock();
+    MontageOpHolder _holder(this);
+    Node* first = nullptr;
+    Node* last = nullptr;
+    while(head != nullptr && (int)res.size() < n) {
+        res.push_back(head->get_val());
+        if(first == nullptr) {
+            first = head;
+        }
+        last = head;
+        head = head->next;
+    }
+    if(head == nullptr) {
+        tail = nullptr;
+    }
+    lock.unlock();
+    if(last != nullptr) {
+        last->next = nullptr; // detach the dequeued run from the queue
+    }
+    while(first != nullptr) {
+        Node* tmp = first;
+        first = first->next;
+        delete(tmp);
+    }
+    return res;
+}
+
 template <class T> 
 class MontageQueueFactory : public RideableFactory{
     Rideable* build(GlobalTestConfig* gtc){
@@ -0,0 +1,443 @@
+#ifndef MONTAGE_RBTREE_HPP
+#define MONTAGE_RBTREE_HPP
+
+/*
+ * A balanced counterpart of UnbalancedTree: a red-black tree that
+ * rebalances top-down (Guibas and Sedgewick, FOCS'78), so that updates fix
+ * colors and rotate on their way down and never walk back up. This lets
+ * every operation lock hand over hand from the root. Lookups hold two
+ * nodes at a time; updates hold a window of up to four (great-grandparent
+ * to current), which covers every node a rotation touches.
+ *
+ * A node's color is read and written only under its parent's lock.
+ *
+ * Payloads are laid out as in UnbalancedTree, and removal likewise only
+ * marks them deleted.
+ */
+
+#include "TestConfig.hpp"
+#include "RMap.hpp"
+#include "Recoverable.hpp"
+#include "CustomTypes.hpp"
+#include <mutex>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+
+
+template<typename K, typename V>
+class MontageRBTree : public RMap<K,V>, public Recoverable{
+public:
+    class Payload : public pds::PBlk{
+        GENERATE_FIELD(K, key, Payload);
+        GENERATE_FIELD(V, val, Payload);
+        GENERATE_FIELD(int, deleted, Payload);
+    public:
+        Payload(){}
+        Payload(K x, V y): m_key(x), m_val(y), m_deleted(false){}
+        Payload(const Payload& oth): pds::PBlk(oth), m_key(oth.m_key), m_val(oth.m_val), m_deleted(oth.m_deleted){}
+        void persist(){}
+    };
+
+    struct TreeNode{
+        MontageRBTree* ds = nullptr;
+        // Transient copy of the key, so that searches never read payloads
+        K key;
+        // Transient-to-persistent pointer
+        Payload* payload = nullptr;
+        // Transient-to-transient pointers, left and right
+        TreeNode* child[2] = {nullptr, nullptr};
+        bool red = true;
+
+        std::mutex lock;
+
+        TreeNode(){}
+        TreeNode(MontageRBTree* ds_, K key_, V val): ds(ds_), key(key_){
+            payload = ds->pnew<Payload>(key_, val);
+        }
+        TreeNode(MontageRBTree* ds_, K key_, Payload* payload_): ds(ds_), key(key_), payload(payload_){}
+        V get_val(){
+            assert(payload!=nullptr && "payload shouldn't be null");
+            return (V)payload->get_val(ds);
+        }
+        int get_deleted(){
+            assert(payload!=nullptr && "payload shouldn't be null");
+            return (int)payload->get_deleted(ds);
+        }
+        void set_val(V v){
+            assert(payload!=nullptr && "payload shouldn't be null");
+            payload = payload->set_val(ds, v);
+        }
+        void set_deleted(int d){
+            assert(payload!=nullptr && "payload shouldn't be null");
+            payload = payload->set_deleted(ds, d);
+        }
+    };
+
+private:
+    // the nodes an update holds locked, each the parent of the next. the
+    // oldest is let go once there are more than four, and all of them
+    // on destruction, e.g., on OldSeeNewException.
+    class Window{
+        TreeNode* nodes[4];
+        int cnt = 0;
+    public:
+        ~Window(){
+            clear();
+        }
+        void clear(){
+            for (int i = 0; i < cnt; i++){
+                nodes[i]->lock.unlock();
+            }
+            cnt = 0;
+        }
+        void push(TreeNode* n){
+            n->lock.lock();
+            if (cnt == 4){
+                nodes[0]->lock.unlock();
+                for (int i = 1; i < 4; i++){
+                    nodes[i-1] = nodes[i];
+                }
+                cnt--;
+            }
+            nodes[cnt++] = n;
+        }
+        // the i-th node from the bottom, or nullptr.
+        TreeNode* up(int i){
+            return (i < cnt) ? nodes[cnt - 1 - i] : nullptr;
+        }
+    };
+
+    // sentinel above the root, which is its right child. it is black and
+    // never holds a key.
+    TreeNode head;
+    GlobalTestConfig* gtc;
+
+    static inline bool is_red(TreeNode* n){
+        return n != nullptr && n->red;
+    }
+
+    // rotate the child of n on side !dir up into n's place; returns it.
+    static TreeNode* rotate(TreeNode* n, int dir){
+        TreeNode* save = n->child[!dir];
+        n->child[!dir] = save->child[dir];
+        save->child[dir] = n;
+        n->red = true;
+        save->red = false;
+        return save;
+    }
+    static TreeNode* rotate_twice(TreeNode* n, int dir){
+        n->child[!dir] = rotate(n->child[!dir], !dir);
+        return rotate(n, dir);
+    }
+
+    // lock hand over hand down to the node of key and return it, still
+    // held by lock_holder, or nullptr.
+    TreeNode* find(HOHLockHolder* lock_holder, K key){
+        lock_holder->hold(&head.lock);
+        TreeNode* curr = head.child[1];
+        while (curr){
+            lock_holder->hold(&curr->lock);
+            if (curr->key == key){
+                return curr;
+            }
+            curr = curr->child[curr->key < key];
+        }
+        return nullptr;
+    }
+
+    // top-down insertion. on its way to key it turns every node with two
+    // red children red and its children black, and rotates away a red
+    // node with a red parent right after it appears. a rotation that is
+    // not the last step leaves the window off the path, so the descent
+    // starts over; each one moves the imbalance closer to the root.
+    // returns the node of key, held in window, and whether it is new in
+    // inserted.
+    TreeNode* descend(K key, V val, bool& inserted, Window& window);
+
+    // drop the nodes under n, leaving payloads alone. no concurrent ops.
+    void clear(TreeNode* n){
+        if (n){
+            clear(n->child[0]);
+            clear(n->child[1]);
+            delete n;
+        }
+    }
+    TreeNode* build(const std::vector<std::pair<K,Payload*>>& sorted, size_t lo, size_t hi, int depth, int red_depth);
+
+public:
+    MontageRBTree(GlobalTestConfig* gtc_): Recoverable(gtc_), gtc(gtc_){
+        head.red = false;
+    }
+
+    void init_thread(GlobalTestConfig* gtc, LocalTestConfig* ltc){
+        Recoverable::init_thread(gtc, ltc);
+    }
+
+    int recover(bool simulated);
+
+    optional<V> get(K key, int tid){
+        while(true){
+            MontageOpHolder _holder(this);
+            try{
+                HOHLockHolder lock_holder;
+                TreeNode* curr = find(&lock_holder, key);
+                // may throw OldSeeNewException:
+                if (!curr || curr->get_deleted()){
+                    return {};
+                }
+                optional<V> ret = curr->get_val();
+                return ret;
+            } catch(pds::OldSeeNewException& e){
+                continue;
+            }
+        }
+    }
+
+    optional<V> put(K key, V val, int tid){
+        while(true){
+            MontageOpHolder _holder(this);
+            try{
+                Window window;
+                bool inserted = false;
+                TreeNode* curr = descend(key, val, inserted, window);
+                if (inserted){
+                    return {};
+                }
+                // may throw OldSeeNewException:
+                optional<V> ret = curr->get_val();
+                curr->set_val(val);
+                if (curr->get_deleted()){
+                    curr->set_deleted(false);
+                    return {};
+                } else {
+                    return ret;
+                }
+            } catch(pds::OldSeeNewException& e){
+                continue;
+            }
+        }
+    }
+
+    bool insert(K key, V val, int tid){
+        while(true){
+            MontageOpHolder _holder(this);
+            try{
+                Window window;
+                bool inserted = false;
+                TreeNode* curr = descend(key, val, inserted, window);
+                if (inserted){
+                    return true;
+                }
+                // may throw OldSeeNewException:
+                if (curr->get_deleted()){
+                    curr->set_deleted(false);
+                    curr->set_val(val);
+                    return true;
+                } else {
+                    return false;
+                }
+            } catch(pds::OldSeeNewException& e){
+                continue;
+            }
+        }
+    }
+
+    optional<V> replace(K key, V val, int tid){
+        while(true){
+            MontageOpHolder _holder(this);
+            try{
+                HOHLockHolder lock_holder;
+                TreeNode* curr = find(&lock_holder, key);
+                // may throw OldSeeNewException:
+                if (!curr || curr->get_deleted()){
+                    return {};
+                }
+                optional<V> ret = curr->get_val();
+                curr->set_val(val);
+                return ret;
+            } catch(pds::OldSeeNewException& e){
+                continue;
+            }
+        }
+    }
+
+    optional<V> remove(K key, int tid){
+        while(true){
+            MontageOpHolder _holder(this);
+            try{
+                HOHLockHolder lock_holder;
+                TreeNode* curr = find(&lock_holder, key);
+                // may throw OldSeeNewException:
+                if (!curr || curr->get_deleted()){
+                    return {};
+                }
+                curr->set_deleted(true);
+                return curr->get_val();
+            } catch(pds::OldSeeNewException& e){
+                continue;
+            }
+        }
+    }
+};
+
+template<typename K, typename V>
+typename MontageRBTree<K,V>::TreeNode* MontageRBTree<K,V>::descend(K key, V val, bool& inserted, Window& window){
+restart:
+    window.clear();
+    window.push(&head);
+    int dir = 1;
+    TreeNode* q = head.child[1];
+    if (q){
+        window.push(q);
+    }
+    while(true){
+        TreeNode* p = window.up(q ? 1 : 0);
+        if (q == nullptr){
+            q = new TreeNode(this, key, val);
+            q->red = (p != &head);
+            p->child[dir] = q;
+            window.push(q);
+            inserted = true;
+        } else if (is_red(q->child[0]) && is_red(q->child[1])){
+            q->red = (p != &head);
+            q->child[0]->red = false;
+            q->child[1]->red = false;
+        }
+        if (q->red && p->red){
+            // p is red, so neither the root nor the head: g and its
+            // parent exist and are held.
+            TreeNode* g = window.up(2);
+            TreeNode* gg = window.up(3);
+            int pdir = (g->child[1] == p);
+            int qdir = (p->child[1] == q);
+            gg->child[gg->child[1] == g] = (pdir == qdir) ? rotate(g, !pdir) : rotate_twice(g, !pdir);
+            if (!inserted){
+                goto restart;
+            }
+        }
+        if (inserted || q->key == key){
+            return q;
+        }
+        dir = (q->key < key);
+        q = q->child[dir];
+        if (q){
+            window.push(q);
+        }
+    }
+}
+
+// a tree of sorted[lo, hi) halved at each node. its nodes are black but for
+// the ones at red_depth, which is the last level when it is not full.
+template<typename K, typename V>
+typename MontageRBTree<K,V>::TreeNode* MontageRBTree<K,V>::build(const std::vector<std::pair<K,Payload*>>& sorted, size_t lo, size_t hi, int depth, int red_depth){
+    if (lo >= hi){
+        return nullptr;
+    }
+    size_t mid = lo + (hi - lo) / 2;
+    TreeNode* n = new TreeNode(this, sorted[mid].first, sorted[mid].second);
+    n->red = (depth == red_depth);
+    n->child[0] = build(sorted, lo, mid, depth + 1, red_depth);
+    n->child[1] = build(sorted, mid + 1, hi, depth + 1, red_depth);
+    return n;
+}
+
+template<typename K, typename V>
+int MontageRBTree<K,V>::recover(bool simulated){
+    if (simulated){
+        recover_mode(); // PDELETE --> noop
+        // clear transient structures.
+        clear(head.child[1]);
+        online_mode(); // re-enable PDELETE.
+    } else {
+        clear(head.child[1]);
+    }
+    head.child[1] = nullptr;
+
+    int rec_thd = 10;
+    if (gtc->checkEnv("RecoverThread")){
+        rec_thd = stoi(gtc->getEnv("RecoverThread"));
+    }
+    // each recovery thread sorts the payloads of its shard, deleted ones
+    // included as they stay in the tree.
+    std::vector<std::vector<std::pair<K,Payload*>>> runs(rec_thd);
+    std::atomic<int> rec_cnt(0);
+    // payloads not marked deleted, which is what the tree maps.
+    std::atomic<int> live_cnt(0);
+    auto begin = chrono::high_resolution_clock::now();
+    recover_pblks([&](const std::vector<pds::PBlk*>& blks, int shard){
+        auto& run = runs[shard];
+        run.reserve(blks.size());
+        int live = 0;
+        for (pds::PBlk* blk : blks){
+            Payload* payload = reinterpret_cast<Payload*>(blk);
+            run.emplace_back((K)payload->get_unsafe_key(this), payload);
+            if (!payload->get_unsafe_deleted(this)){
+                live++;
+            }
+        }
+        live_cnt.fetch_add(live, std::memory_order_relaxed);
+        std::sort(run.begin(), run.end(), [](const std::pair<K,Payload*>& a, const std::pair<K,Payload*>& b){
+            return a.first < b.first;
+        });
+        rec_cnt.fetch_add(blks.size(), std::memory_order_relaxed);
+    }, rec_thd);
+    auto sorted_end = chrono::high_resolution_clock::now();
+
+    std::vector<std::pair<K,Payload*>> sorted;
+    sorted.reserve(rec_cnt.load());
+    for (auto& run : runs){
+        size_t mid = sorted.size();
+        sorted.insert(sorted.end(), run.begin(), run.end());
+        std::inplace_merge(sorted.begin(), sorted.begin() + mid, sorted.end(), [](const std::pair<K,Payload*>& a, const std::pair<K,Payload*>& b){
+            return a.first < b.first;
+        });
+    }
+    for (size_t i = 1; i < sorted.size(); i++){
+        if (sorted[i-1].first == sorted[i].first){
+            errexit("conflicting keys recovered.");
+        }
+    }
+    // all external nodes of a halved tree lie on the two deepest levels,
+    // full_levels being the number of full ones.
+    int full_levels = 0;
+    while (((size_t)2 << full_levels) - 1 <= sorted.size()){
+        full_levels++;
+    }
+    head.child[1] = build(sorted, 0, sorted.size(), 0, full_levels);
+    if (head.child[1]){
+        head.child[1]->red = false;
+    }
+    auto end = chrono::high_resolution_clock::now();
+    auto sort_ms = std::chrono::duration_cast<std::chrono::milliseconds>(sorted_end - begin).count();
+    auto build_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - sorted_end).count();
+    auto dur_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count();
+    std::cout << "Spent " << sort_ms << "ms recovering and sorting PBlk(" << rec_cnt.load() << ", " << live_cnt.load() << " not deleted)" << std::endl;
+    std::cout << "Spent " << build_ms << "ms merging and building the tree" << std::endl;
+    std::cout << "Total time to recover: " << dur_ms << "ms" << std::endl;
+    return live_cnt.load();
+}
+
+template <class T>
+class MontageRBTreeFactory : public RideableFactory{
+    Rideable* build(GlobalTestConfig* gtc){
+        return new MontageRBTree<T, T>(gtc);
+    }
+};
+
+
+/* Specialization for strings */
+#include <string>
+#include "PString.hpp"
+template <>
+class MontageRBTree<std::string, std::string>::Payload : public pds::PBlk{
+    GENERATE_FIELD(pds::PString<TESTS_KEY_SIZE>, key, Payload);
+    GENERATE_FIELD(pds::PString<TESTS_VAL_SIZE>, val, Payload);
+    GENERATE_FIELD(int, deleted, Payload);
+
+public:
+    Payload(std::string k, std::string v) : m_key(this, k), m_val(this, v), m_deleted(false){}
+    Payload(const Payload& oth) : pds::PBlk(oth), m_key(this, oth.m_key), m_val(this, oth.m_val), m_deleted(oth.m_deleted){}
+    void persist(){}
+};
+#endif
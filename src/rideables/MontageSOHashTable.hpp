@@ -0,0 +1,626 @@
+#ifndef MONTAGE_SO_HASHTABLE_P
+#define MONTAGE_SO_HASHTABLE_P
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <iostream>
+#include <atomic>
+#include <algorithm>
+#include <functional>
+#include <vector>
+#include <utility>
+#include <thread>
+#include <chrono>
+
+#include "HarnessUtils.hpp"
+#include "ConcurrentPrimitives.hpp"
+#include "RMap.hpp"
+#include "RCUTracker.hpp"
+#include "CustomTypes.hpp"
+#include "Recoverable.hpp"
+
+// Lock-free hash table on split-ordered lists (Shalev and Shavit, JACM'06).
+// All items live in one lock-free list sorted by their bit-reversed hashes,
+// and buckets are shortcuts into it, each a dummy node. Doubling the bucket
+// count moves no items: new buckets are spliced into the list lazily, on
+// their first access.
+template <class K, class V>
+class MontageSOHashTable : public RMap<K,V>, public Recoverable{
+public:
+    class Payload : public pds::PBlk{
+        GENERATE_FIELD(K, key, Payload);
+        GENERATE_FIELD(V, val, Payload);
+    public:
+        Payload(){}
+        Payload(K x, V y): m_key(x), m_val(y){}
+        Payload(const Payload& oth): pds::PBlk(oth), m_key(oth.m_key), m_val(oth.m_val){}
+        void persist(){}
+    };
+private:
+    struct Node;
+
+    struct MarkPtr{
+        pds::atomic_lin_var<Node*> ptr;
+        MarkPtr(Node* n):ptr(n){};
+        MarkPtr():ptr(nullptr){};
+    };
+
+    struct Node{
+        MontageSOHashTable* ds;
+        // split-order key: odd for items, even for dummies.
+        uint64_t so;
+        K key;
+        MarkPtr next;
+        Payload* payload;
+        // incarnation of the table this node was created in, see recover().
+        uint64_t incarnation;
+        Node(MontageSOHashTable* ds_, uint64_t s, K k, V v):
+            ds(ds_),so(s),key(k),next(nullptr),payload(ds_->pnew<Payload>(k,v)),incarnation(ds_->incarnation){};
+        Node(MontageSOHashTable* ds_, uint64_t s, K k, Payload* p): // for recovery
+            ds(ds_),so(s),key(k),next(nullptr),payload(p),incarnation(ds_->incarnation){};
+        Node(MontageSOHashTable* ds_, uint64_t s): // dummy
+            ds(ds_),so(s),key(),next(nullptr),payload(nullptr),incarnation(ds_->incarnation){};
+        ~Node(){
+            if (payload && incarnation == ds->incarnation){
+                ds->preclaim(payload);
+            }
+        }
+
+        void rm_payload(){
+            // call it before END_OP but after linearization point
+            assert(payload!=nullptr && "payload shouldn't be null");
+            ds->pretire(payload);
+        }
+        V get_val(){
+            // call it within BEGIN_OP and END_OP
+            assert(payload!=nullptr && "payload shouldn't be null");
+            return (V)payload->get_val(ds);
+        }
+        V get_unsafe_val(){
+            return (V)payload->get_unsafe_val(ds);
+        }
+    };
+
+    // bucket b's dummy is in segment k, which holds min_buckets<<(k-1)
+    // buckets (min_buckets for k=0) and is allocated on first use.
+    static const size_t min_buckets = 16;
+    static const int max_segments = 48;
+    std::atomic<std::atomic<Node*>*> directory[max_segments];
+    // always a power of two.
+    std::atomic<size_t> size;
+    size_t init_size = min_buckets;
+    double load_factor = 1.0;
+    // items are counted per thread and folded into count every count_batch
+    // changes, which is also when the table checks whether to grow.
+    static const int64_t count_batch = 32;
+    padded<int64_t>* count_deltas;
+    std::atomic<int64_t> count;
+    std::atomic<uint64_t> dummies;
+
+    std::hash<K> hash_fn;
+    RCUTracker<Node> tracker;
+    GlobalTestConfig* gtc;
+    // bumped by every recover().
+    uint64_t incarnation = 0;
+
+    const uint64_t MARK_MASK = ~0x1;
+    inline pds::lin_var getPtr(const pds::lin_var& d){
+        return pds::lin_var(d.val & MARK_MASK, d.cnt);
+    }
+    inline bool getMark(const pds::lin_var& d){
+        return (bool)(d.val & 1);
+    }
+    inline Node* setMark(const pds::lin_var& d){
+        return reinterpret_cast<Node*>(d.val | 1);
+    }
+
+    static uint64_t reverse_bits(uint64_t x){
+        x = ((x >> 1) & 0x5555555555555555ULL) | ((x & 0x5555555555555555ULL) << 1);
+        x = ((x >> 2) & 0x3333333333333333ULL) | ((x & 0x3333333333333333ULL) << 2);
+        x = ((x >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((x & 0x0F0F0F0F0F0F0F0FULL) << 4);
+        return __builtin_bswap64(x);
+    }
+    static uint64_t so_regular(size_t h){
+        return reverse_bits(h | (1ULL << 63));
+    }
+    static uint64_t so_dummy(size_t b){
+        return reverse_bits(b);
+    }
+    static size_t segment_size(int k){
+        return k == 0 ? min_buckets : min_buckets << (k - 1);
+    }
+
+    std::atomic<Node*>* slot(size_t b){
+        int k = b < min_buckets ? 0 : 64 - __builtin_clzll(b / min_buckets);
+        std::atomic<Node*>* seg = directory[k].load(std::memory_order_acquire);
+        if (seg == nullptr){
+            std::atomic<Node*>* fresh = new std::atomic<Node*>[segment_size(k)]();
+            if (directory[k].compare_exchange_strong(seg, fresh)){
+                seg = fresh;
+            } else {
+                delete[] fresh;
+            }
+        }
+        return &seg[k == 0 ? b : b - segment_size(k)];
+    }
+
+    Node* get_bucket(size_t b, int tid){
+        Node* dummy = slot(b)->load(std::memory_order_acquire);
+        if (dummy == nullptr){
+            dummy = initialize_bucket(b, tid);
+        }
+        return dummy;
+    }
+
+    // splice b's dummy into the list right after its parent's.
+    Node* initialize_bucket(size_t b, int tid){
+        size_t parent = b ^ (1ULL << (63 - __builtin_clzll(b)));
+        Node* start = get_bucket(parent, tid);
+        Node* dummy = new Node(this, so_dummy(b));
+        MarkPtr* prev = nullptr;
+        pds::lin_var curr;
+        pds::lin_var next;
+        while(true){
+            if(findNode(prev,curr,next,&start->next,dummy->so,dummy->key,tid)){
+                // someone else got there first.
+                delete dummy;
+                dummy = curr.get_val<Node*>();
+                break;
+            }
+            dummy->next.ptr.store(curr);
+            if(prev->ptr.CAS(curr,dummy)){
+                dummies.fetch_add(1, std::memory_order_relaxed);
+                break;
+            }
+        }
+        slot(b)->store(dummy, std::memory_order_release);
+        return dummy;
+    }
+
+    void count_change(int tid, int64_t d){
+        int64_t& delta = count_deltas[tid].ui;
+        delta += d;
+        if (delta < count_batch && delta > -count_batch){
+            return;
+        }
+        int64_t n = count.fetch_add(delta, std::memory_order_relaxed) + delta;
+        delta = 0;
+        size_t s = size.load(std::memory_order_relaxed);
+        if (n > load_factor * s && 2 * s <= (min_buckets << (max_segments - 1))){
+            size.compare_exchange_strong(s, 2 * s);
+        }
+    }
+
+    bool findNode(MarkPtr* &prev, pds::lin_var &curr, pds::lin_var &next, MarkPtr* head, uint64_t so, const K& key, int tid);
+    bool findNode(MarkPtr* &prev, pds::lin_var &curr, pds::lin_var &next, size_t h, const K& key, int tid){
+        MarkPtr* head = &get_bucket(h & (size.load(std::memory_order_acquire) - 1), tid)->next;
+        return findNode(prev,curr,next,head,so_regular(h),key,tid);
+    }
+public:
+    MontageSOHashTable(GlobalTestConfig* gtc_) : Recoverable(gtc_), count(0), dummies(0),
+        tracker(gtc_->task_num, 100, 1000, true), gtc(gtc_) {
+        if (gtc->checkEnv("HashBuckets")){
+            while (init_size < stoull(gtc->getEnv("HashBuckets"))){
+                init_size *= 2;
+            }
+        }
+        if (gtc->checkEnv("LoadFactor")){
+            load_factor = stod(gtc->getEnv("LoadFactor"));
+            if (load_factor <= 0){
+                errexit("LoadFactor must be positive.");
+            }
+        }
+        for (int k = 0; k < max_segments; k++){
+            directory[k].store(nullptr);
+        }
+        size.store(init_size);
+        Node* head = new Node(this, so_dummy(0));
+        slot(0)->store(head);
+        dummies.store(1);
+        count_deltas = new padded<int64_t>[gtc->task_num];
+        for (int i = 0; i < gtc->task_num; i++){
+            count_deltas[i].ui = 0;
+        }
+    };
+    ~MontageSOHashTable(){
+        if (gtc->recorder){
+            gtc->recorder->reportGlobalInfo("hash_buckets", (unsigned long)size.load());
+        }
+        if (gtc->verbose){
+            std::cout << "MontageSOHashTable: " << size.load() << " buckets, "
+                << dummies.load() << " initialized" << std::endl;
+        }
+        for (int k = 0; k < max_segments; k++){
+            delete[] directory[k].load();
+        }
+        delete[] count_deltas;
+    };
+
+    void init_thread(GlobalTestConfig* gtc, LocalTestConfig* ltc){
+        Recoverable::init_thread(gtc, ltc);
+    }
+
+    // drop all transient nodes, leaving payloads alone. no concurrent ops.
+    void clear(){
+        Node* curr = slot(0)->load();
+        while (curr){
+            Node* next = getPtr(curr->next.ptr.load(this)).template get_val<Node*>();
+            curr->payload = nullptr;
+            delete curr;
+            curr = next;
+        }
+        for (int k = 0; k < max_segments; k++){
+            delete[] directory[k].load();
+            directory[k].store(nullptr);
+        }
+        for (int i = 0; i < gtc->task_num; i++){
+            count_deltas[i].ui = 0;
+        }
+        count.store(0);
+        dummies.store(0);
+    }
+
+    int recover(bool simulated);
+
+    optional<V> get(K key, int tid);
+    optional<V> put(K key, V val, int tid);
+    bool insert(K key, V val, int tid);
+    optional<V> remove(K key, int tid);
+    optional<V> replace(K key, V val, int tid);
+};
+
+template <class T>
+class MontageSOHashTableFactory : public RideableFactory{
+    Rideable* build(GlobalTestConfig* gtc){
+        return new MontageSOHashTable<T,T>(gtc);
+    }
+};
+
+
+//-------Definition----------
+template <class K, class V>
+int MontageSOHashTable<K,V>::recover(bool simulated){
+    if (simulated){
+        recover_mode(); // PDELETE --> noop
+        // clear transient structures.
+        clear();
+        online_mode(); // re-enable PDELETE.
+    } else {
+        // drop the empty list built by the constructor.
+        clear();
+    }
+    // nodes retired before the crash may still be in the tracker.
+    incarnation++;
+
+    int rec_thd = 10;
+    if (gtc->checkEnv("RecoverThread")){
+        rec_thd = stoi(gtc->getEnv("RecoverThread"));
+    }
+    // the list is cut into parts by the top bits of split-order keys, each
+    // rebuilt by one thread. every part starts with a dummy as long as there
+    // are no more parts than min_buckets.
+    int parts = 1;
+    while (parts * 2 <= rec_thd && parts * 2 <= (int)min_buckets){
+        parts *= 2;
+    }
+    int part_bits = __builtin_ctz(parts);
+    auto part_of = [&](uint64_t so){
+        return part_bits == 0 ? 0 : (int)(so >> (64 - part_bits));
+    };
+    struct Entry{
+        uint64_t so;
+        K key;
+        Payload* payload; // nullptr for dummies
+    };
+    // phase 1: inside the recovery threads, route each live payload to the
+    // rebuilder of its part.
+    std::vector<std::vector<std::vector<Entry>>> routed(rec_thd,
+        std::vector<std::vector<Entry>>(parts));
+    std::atomic<int> rec_cnt(0);
+    auto begin = chrono::high_resolution_clock::now();
+    recover_pblks([&](const std::vector<pds::PBlk*>& blks, int shard){
+        for (pds::PBlk* blk : blks){
+            Payload* payload = reinterpret_cast<Payload*>(blk);
+            K key = (K)payload->get_unsafe_key(this);
+            uint64_t so = so_regular(hash_fn(key));
+            routed[shard][part_of(so)].push_back({so, key, payload});
+        }
+        rec_cnt.fetch_add(blks.size(), std::memory_order_relaxed);
+    }, rec_thd);
+    auto routed_end = chrono::high_resolution_clock::now();
+
+    // phase 2: size the table for what was recovered, then each rebuilder
+    // sorts its part together with the dummies falling into it and links it
+    // with plain stores. parts are stitched together at the end.
+    size_t s = init_size;
+    while (rec_cnt.load() > load_factor * s){
+        s *= 2;
+    }
+    size.store(s);
+    for (size_t b = 0; b < s; b += min_buckets){
+        slot(b); // allocate segments up front
+    }
+    std::vector<Node*> heads(parts, nullptr);
+    std::vector<Node*> tails(parts, nullptr);
+    std::vector<std::thread> rebuilders;
+    for (int p = 0; p < parts; p++){
+        rebuilders.emplace_back([&, p](){
+            std::vector<Entry> entries;
+            for (int sh = 0; sh < rec_thd; sh++){
+                entries.insert(entries.end(), std::make_move_iterator(routed[sh][p].begin()),
+                    std::make_move_iterator(routed[sh][p].end()));
+                std::vector<Entry>().swap(routed[sh][p]);
+            }
+            // buckets whose reversed index falls into part p.
+            size_t first = part_bits == 0 ? 0 : reverse_bits(p) >> (64 - part_bits);
+            for (size_t b = first; b < s; b += parts){
+                entries.push_back({so_dummy(b), K(), nullptr});
+            }
+            std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b){
+                return a.so < b.so || (a.so == b.so && a.key < b.key);
+            });
+            Node* prev = nullptr;
+            for (size_t i = 0; i < entries.size(); i++){
+                Entry& e = entries[i];
+                if (i > 0 && entries[i-1].so == e.so && entries[i-1].key == e.key){
+                    errexit("conflicting keys recovered.");
+                }
+                Node* node;
+                if (e.payload == nullptr){
+                    node = new Node(this, e.so);
+                    slot(reverse_bits(e.so))->store(node);
+                } else {
+                    node = new Node(this, e.so, e.key, e.payload);
+                }
+                if (prev){
+                    prev->next.ptr.store(node);
+                } else {
+                    heads[p] = node;
+                }
+                prev = node;
+            }
+            tails[p] = prev;
+        });
+    }
+    for (auto& t : rebuilders){
+        t.join();
+    }
+    for (int p = 0; p + 1 < parts; p++){
+        tails[p]->next.ptr.store(heads[p+1]);
+    }
+    count.store(rec_cnt.load());
+    dummies.store(s);
+    auto end = chrono::high_resolution_clock::now();
+    auto route_ms = std::chrono::duration_cast<std::chrono::milliseconds>(routed_end - begin).count();
+    auto build_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - routed_end).count();
+    auto dur_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count();
+    std::cout << "Spent " << route_ms << "ms recovering and routing PBlk(" << rec_cnt.load() << ")" << std::endl;
+    std::cout << "Spent " << build_ms << "ms rebuilding " << s << " buckets" << std::endl;
+    std::cout << "Total time to recover: " << dur_ms << "ms" << std::endl;
+    return rec_cnt.load();
+}
+
+template <class K, class V>
+optional<V> MontageSOHashTable<K,V>::get(K key, int tid) {
+    optional<V> res={};
+    MarkPtr* prev=nullptr;
+    pds::lin_var curr;
+    pds::lin_var next;
+
+    tracker.start_op(tid);
+    // hold epoch from advancing so that the node we find won't be deleted
+    if(findNode(prev,curr,next,hash_fn(key),key,tid)) {
+        MontageOpHolder _holder(this);
+        res=curr.get_val<Node*>()->get_unsafe_val();//never old see new as we find node before BEGIN_OP
+    }
+    tracker.end_op(tid);
+
+    return res;
+}
+
+template <class K, class V>
+optional<V> MontageSOHashTable<K,V>::put(K key, V val, int tid) {
+    optional<V> res={};
+    MarkPtr* prev=nullptr;
+    pds::lin_var curr;
+    pds::lin_var next;
+    size_t h = hash_fn(key);
+    Node* tmpNode = new Node(this, so_regular(h), key, val);
+
+    tracker.start_op(tid);
+    while(true) {
+        if(findNode(prev,curr,next,h,key,tid)) {
+            // exists; replace
+            tmpNode->next.ptr.store(curr);
+            begin_op();
+            res=curr.get_val<Node*>()->get_val();
+            if(prev->ptr.CAS_verify(this,curr,tmpNode)) {
+                curr.get_val<Node*>()->rm_payload();
+                end_op();
+                // mark curr; since findNode only finds the first node >= key, it's ok to have duplicated keys temporarily
+                while(!curr.get_val<Node*>()->next.ptr.CAS(next,setMark(next)));
+                if(tmpNode->next.ptr.CAS(curr,next)) {
+                    tracker.retire(curr.get_val<Node*>(),tid);
+                } else {
+                    findNode(prev,curr,next,h,key,tid);
+                }
+                break;
+            }
+            abort_op();
+        }
+        else {
+            //does not exist; insert.
+            res={};
+            tmpNode->next.ptr.store(curr);
+            begin_op();
+            if(prev->ptr.CAS_verify(this,curr,tmpNode)) {
+                end_op();
+                count_change(tid, 1);
+                break;
+            }
+            abort_op();
+        }
+    }
+    tracker.end_op(tid);
+    return res;
+}
+
+template <class K, class V>
+bool MontageSOHashTable<K,V>::insert(K key, V val, int tid){
+    bool res=false;
+    MarkPtr* prev=nullptr;
+    pds::lin_var curr;
+    pds::lin_var next;
+    size_t h = hash_fn(key);
+    Node* tmpNode = new Node(this, so_regular(h), key, val);
+
+    tracker.start_op(tid);
+    while(true) {
+        if(findNode(prev,curr,next,h,key,tid)) {
+            res=false;
+            delete tmpNode;
+            break;
+        }
+        else {
+            //does not exist, insert.
+            tmpNode->next.ptr.store(curr);
+            begin_op();
+            if(prev->ptr.CAS_verify(this,curr,tmpNode)) {
+                end_op();
+                count_change(tid, 1);
+                res=true;
+                break;
+            }
+            abort_op();
+        }
+    }
+    tracker.end_op(tid);
+
+    return res;
+}
+
+template <class K, class V>
+optional<V> MontageSOHashTable<K,V>::remove(K key, int tid) {
+    optional<V> res={};
+    MarkPtr* prev=nullptr;
+    pds::lin_var curr;
+    pds::lin_var next;
+    size_t h = hash_fn(key);
+
+    tracker.start_op(tid);
+    while(true) {
+        if(!findNode(prev,curr,next,h,key,tid)) {
+            res={};
+            break;
+        }
+        begin_op();
+        res=curr.get_val<Node*>()->get_val();
+        if(!curr.get_val<Node*>()->next.ptr.CAS_verify(this,next,setMark(next))) {
+            abort_op();
+            continue;
+        }
+        curr.get_val<Node*>()->rm_payload();
+        end_op();
+        count_change(tid, -1);
+        if(prev->ptr.CAS(curr,next)) {
+            tracker.retire(curr.get_val<Node*>(),tid);
+        } else {
+            findNode(prev,curr,next,h,key,tid);
+        }
+        break;
+    }
+    tracker.end_op(tid);
+
+    return res;
+}
+
+template <class K, class V>
+optional<V> MontageSOHashTable<K,V>::replace(K key, V val, int tid) {
+    optional<V> res={};
+    MarkPtr* prev=nullptr;
+    pds::lin_var curr;
+    pds::lin_var next;
+    size_t h = hash_fn(key);
+    Node* tmpNode = new Node(this, so_regular(h), key, val);
+
+    tracker.start_op(tid);
+    while(true){
+        if(findNode(prev,curr,next,h,key,tid)){
+            tmpNode->next.ptr.store(curr);
+            begin_op();
+            res=curr.get_val<Node*>()->get_val();
+            if(prev->ptr.CAS_verify(this,curr,tmpNode)){
+                curr.get_val<Node*>()->rm_payload();
+                end_op();
+                // mark curr; since findNode only finds the first node >= key, it's ok to have duplicated keys temporarily
+                while(!curr.get_val<Node*>()->next.ptr.CAS(next,setMark(next)));
+                if(tmpNode->next.ptr.CAS(curr,next)) {
+                    tracker.retire(curr.get_val<Node*>(),tid);
+                } else {
+                    findNode(prev,curr,next,h,key,tid);
+                }
+                break;
+            }
+            abort_op();
+        }
+        else{//does not exist
+            res={};
+            delete tmpNode;
+            break;
+        }
+    }
+    tracker.end_op(tid);
+    return res;
+}
+
+// find the first node >= (so, key) in the list following head, which must
+// be a dummy's next and precede (so, key).
+template <class K, class V>
+bool MontageSOHashTable<K,V>::findNode(MarkPtr* &prev, pds::lin_var &curr, pds::lin_var &next, MarkPtr* head, uint64_t so, const K& key, int tid){
+    while(true){
+        bool cmark=false;
+        prev=head;
+        curr=getPtr(prev->ptr.load(this));
+
+        while(true){//to lock old and curr
+            if(curr.get_val<Node*>()==nullptr) return false;
+            next=curr.get_val<Node*>()->next.ptr.load(this);
+            cmark=getMark(next);
+            next=getPtr(next);
+            uint64_t cso=curr.get_val<Node*>()->so;
+            if(prev->ptr.load(this)!=curr) break;//retry
+            if(!cmark) {
+                if(cso>so) return false;
+                if(cso==so){
+                    auto& ckey=curr.get_val<Node*>()->key;
+                    if(ckey>=key) return ckey==key;
+                }
+                prev=&(curr.get_val<Node*>()->next);
+            } else {
+                if(prev->ptr.CAS(curr,next)) {
+                    tracker.retire(curr.get_val<Node*>(),tid);
+                } else {
+                    break;//retry
+                }
+            }
+            curr=next;
+        }
+    }
+}
+
+/* Specialization for strings */
+#include <string>
+#include "PString.hpp"
+template <>
+class MontageSOHashTable<std::string, std::string>::Payload : public pds::PBlk{
+    GENERATE_FIELD(pds::PString<TESTS_KEY_SIZE>, key, Payload);
+    GENERATE_FIELD(pds::PString<TESTS_VAL_SIZE>, val, Payload);
+
+public:
+    Payload(std::string k, std::string v) : m_key(this, k), m_val(this, v){}
+    Payload(const Payload& oth) : pds::PBlk(oth), m_key(this, oth.m_key), m_val(this, oth.m_val){}
+    void persist(){}
+};
+
+#endif
@@ -0,0 +1,749 @@
+#ifndef MONTAGE_SKIPLIST_P
+#define MONTAGE_SKIPLIST_P
+
+/*
+ * A lock-free skiplist (after Fraser, "Practical lock-freedom", 2004)
+ * whose towers live in DRAM. Only key/value payloads are persistent.
+ *
+ * A key is logically in the map iff its node is linked at level 0 and
+ * its payload word is unmarked. Inserts linearize at the level 0 link,
+ * removes at marking the payload word, and updates of existing keys at
+ * swapping the payload word; all three are CAS_verify's. Nodes are then
+ * unlinked by marking their towers top-down and searching for their key.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <iostream>
+#include <atomic>
+#include <algorithm>
+#include <functional>
+#include <vector>
+#include <utility>
+#include <thread>
+#include <chrono>
+#include <mutex>
+
+#include "HarnessUtils.hpp"
+#include "ConcurrentPrimitives.hpp"
+#include "ROrderedMap.hpp"
+#include "RCUTracker.hpp"
+#include "CustomTypes.hpp"
+#include "Recoverable.hpp"
+
+template <class K, class V>
+class MontageSkipList : public ROrderedMap<K,V>, public Recoverable{
+public:
+    class Payload : public pds::PBlk{
+        GENERATE_FIELD(K, key, Payload);
+        GENERATE_FIELD(V, val, Payload);
+    public:
+        Payload(){}
+        Payload(K x, V y): m_key(x), m_val(y){}
+        Payload(const Payload& oth): pds::PBlk(oth), m_key(oth.m_key), m_val(oth.m_val){}
+        void persist(){}
+    };
+private:
+    static const int MAX_LEVEL = 24;
+
+    struct Node{
+        MontageSkipList* ds;
+        K key;
+        // low bit marks the key as logically removed.
+        pds::atomic_lin_var<Payload*> payload;
+        // level 0; low bit marks the node as being unlinked.
+        pds::atomic_lin_var<Node*> next;
+        int height;
+        // levels 1 to height-1, marked the same way as next.
+        std::atomic<Node*>* up;
+        // inserter and remover each drop one; whoever drops the last one
+        // unlinks the whole tower and retires the node, so that no level
+        // gets linked after the node is retired.
+        std::atomic<int> owners;
+        // incarnation of the list this node was created in, see recover().
+        uint64_t incarnation;
+        Node(MontageSkipList* ds_, K k, Payload* p, int h, int o):
+            ds(ds_),key(k),payload(p),next(nullptr),height(h),
+            up(h > 1 ? new std::atomic<Node*>[h-1] : nullptr),owners(o),
+            incarnation(ds_->incarnation){
+            for (int i = 0; i < h-1; i++){
+                up[i].store(nullptr);
+            }
+        };
+        ~Node(){
+            // payloads of nodes from before a simulated crash were dealt
+            // with by recovery.
+            Payload* p = ds->getPayload(payload.load(ds));
+            if (p && incarnation == ds->incarnation){
+                ds->preclaim(p);
+            }
+            delete[] up;
+        }
+    };
+
+    Node* head;
+    RCUTracker<Node> tracker;
+    GlobalTestConfig* gtc;
+    int task_num;
+    // per-thread xorshift states for tower heights.
+    padded<uint64_t>* seeds;
+    // bumped by every recover().
+    uint64_t incarnation = 0;
+    // scans validate against per-thread sequence numbers, odd while the
+    // thread is in the middle of a linearizing CAS, as in
+    // MontageNatarajanTree.
+    static const int optimistic_scans = 4;
+    paddedAtomic<uint64_t>* update_seqs;
+    std::atomic<bool> scan_blocking;
+    std::mutex scan_lock;
+
+    const uint64_t MARK_MASK = ~0x1;
+    inline pds::lin_var getPtr(const pds::lin_var& d){
+        return pds::lin_var(d.val & MARK_MASK, d.cnt);
+    }
+    inline bool getMark(const pds::lin_var& d){
+        return (bool)(d.val & 1);
+    }
+    inline Payload* getPayload(const pds::lin_var& d){
+        return reinterpret_cast<Payload*>(d.val & MARK_MASK);
+    }
+    template <class T>
+    inline T* setMark(const pds::lin_var& d){
+        return reinterpret_cast<T*>(d.val | 1);
+    }
+    inline Node* getPtr(Node* n){
+        return reinterpret_cast<Node*>((uint64_t)n & MARK_MASK);
+    }
+    inline bool getMark(Node* n){
+        return (bool)((uint64_t)n & 1);
+    }
+    inline Node* setMark(Node* n){
+        return reinterpret_cast<Node*>((uint64_t)n | 1);
+    }
+
+    int random_height(int tid){
+        uint64_t& x = seeds[tid].ui;
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        int h = 1;
+        uint64_t bits = x;
+        while (h < MAX_LEVEL && (bits & 1)){
+            h++;
+            bits >>= 1;
+        }
+        return h;
+    }
+
+    inline void begin_update(int tid){
+        while(true){
+            update_seqs[tid].ui.fetch_add(1);
+            if(!scan_blocking.load()) return;
+            update_seqs[tid].ui.fetch_add(1);
+            while(scan_blocking.load());
+        }
+    }
+    inline void end_update(int tid){
+        update_seqs[tid].ui.fetch_add(1);
+    }
+
+    bool find(K key, Node** preds, Node** succs, pds::lin_var& pred_next);
+    void link_tower(Node* n, Node** preds, Node** succs, int tid);
+    void finish_remove(Node* n, int tid);
+    void release(Node* n, int tid);
+    Node* first_at_least(const K& lo);
+    void collect(const K& lo, const K& hi, int limit, std::vector<std::pair<K,Payload*>>& items);
+
+public:
+    MontageSkipList(GlobalTestConfig* gtc_) : Recoverable(gtc_), tracker(gtc_->task_num, 100, 1000, true), gtc(gtc_){
+        head = new Node(this, K(), nullptr, MAX_LEVEL, 1);
+        task_num = gtc->task_num;
+        seeds = new padded<uint64_t>[task_num];
+        for (int i = 0; i < task_num; i++){
+            seeds[i].ui = 0x9E3779B97F4A7C15ULL * (i + 1);
+        }
+        update_seqs = new paddedAtomic<uint64_t>[task_num]{};
+        scan_blocking.store(false);
+    };
+    ~MontageSkipList(){};
+
+    void init_thread(GlobalTestConfig* gtc, LocalTestConfig* ltc){
+        Recoverable::init_thread(gtc, ltc);
+    }
+
+    // drop all transient nodes, leaving payloads alone. no concurrent ops.
+    void clear(){
+        Node* curr = getPtr(head->next.load(this)).template get_val<Node*>();
+        while (curr){
+            Node* next = getPtr(curr->next.load(this)).template get_val<Node*>();
+            curr->payload.store(nullptr);
+            delete curr;
+            curr = next;
+        }
+        head->next.store(nullptr);
+        for (int i = 0; i < MAX_LEVEL-1; i++){
+            head->up[i].store(nullptr);
+        }
+    }
+
+    int recover(bool simulated);
+
+    optional<V> get(K key, int tid);
+    optional<V> put(K key, V val, int tid);
+    bool insert(K key, V val, int tid);
+    optional<V> remove(K key, int tid);
+    optional<V> replace(K key, V val, int tid);
+    int range(K lo, K hi, int limit, std::function<void(const K&, const V&)> f, int tid);
+};
+
+template <class T>
+class MontageSkipListFactory : public RideableFactory{
+    Rideable* build(GlobalTestConfig* gtc){
+        return new MontageSkipList<T,T>(gtc);
+    }
+};
+
+
+//-------Definition----------
+template <class K, class V>
+int MontageSkipList<K,V>::recover(bool simulated){
+    if (simulated){
+        recover_mode(); // PDELETE --> noop
+        // clear transient structures.
+        clear();
+        online_mode(); // re-enable PDELETE.
+    }
+    // nodes retired before the crash may still be in the tracker.
+    incarnation++;
+
+    int rec_thd = 10;
+    if (gtc->checkEnv("RecoverThread")){
+        rec_thd = stoi(gtc->getEnv("RecoverThread"));
+    }
+    struct Entry{
+        K key;
+        Payload* payload;
+        bool operator<(const Entry& oth) const { return key < oth.key; }
+    };
+    // phase 1: each recovery thread sorts the payloads of its shard.
+    std::vector<std::vector<Entry>> runs(rec_thd);
+    std::atomic<int> rec_cnt(0);
+    auto begin = chrono::high_resolution_clock::now();
+    recover_pblks([&](const std::vector<pds::PBlk*>& blks, int shard){
+        std::vector<Entry>& run = runs[shard];
+        run.reserve(blks.size());
+        for (pds::PBlk* blk : blks){
+            Payload* payload = reinterpret_cast<Payload*>(blk);
+            run.push_back({(K)payload->get_unsafe_key(this), payload});
+        }
+        std::sort(run.begin(), run.end());
+        rec_cnt.fetch_add(blks.size(), std::memory_order_relaxed);
+    }, rec_thd);
+    auto sorted_end = chrono::high_resolution_clock::now();
+
+    // phase 2: cut the key space at splitters sampled from the runs; each
+    // thread merges one key range across all runs and links its nodes at
+    // every level. the i-th key overall gets 1 + ctz(i+1) levels, which
+    // makes the rebuilt list perfectly balanced.
+    std::vector<Entry> samples;
+    for (auto& run : runs){
+        size_t stride = std::max<size_t>(1, run.size() / (rec_thd * 8));
+        for (size_t i = stride / 2; i < run.size(); i += stride){
+            samples.push_back(run[i]);
+        }
+    }
+    std::sort(samples.begin(), samples.end());
+    std::vector<Entry> splitters;
+    for (int t = 1; t < rec_thd && !samples.empty(); t++){
+        splitters.push_back(samples[samples.size() * t / rec_thd]);
+    }
+    int parts = splitters.size() + 1;
+    // bounds[p][r]: start of part p in run r.
+    std::vector<std::vector<size_t>> bounds(parts + 1, std::vector<size_t>(rec_thd));
+    std::vector<size_t> offsets(parts + 1, 0);
+    for (int p = 0; p <= parts; p++){
+        for (int r = 0; r < rec_thd; r++){
+            if (p == 0){
+                bounds[p][r] = 0;
+            } else if (p == parts){
+                bounds[p][r] = runs[r].size();
+            } else {
+                bounds[p][r] = std::lower_bound(runs[r].begin(), runs[r].end(), splitters[p-1]) - runs[r].begin();
+            }
+            if (p > 0){
+                offsets[p] += bounds[p][r] - bounds[p-1][r];
+            }
+        }
+        if (p > 0){
+            offsets[p] += offsets[p-1];
+        }
+    }
+    // firsts[p][l] and lasts[p][l]: ends of part p's chain at level l.
+    std::vector<std::vector<Node*>> firsts(parts, std::vector<Node*>(MAX_LEVEL, nullptr));
+    std::vector<std::vector<Node*>> lasts(parts, std::vector<Node*>(MAX_LEVEL, nullptr));
+    std::vector<std::thread> builders;
+    for (int p = 0; p < parts; p++){
+        builders.emplace_back([&, p](){
+            std::vector<Entry> part;
+            part.reserve(offsets[p+1] - offsets[p]);
+            for (int r = 0; r < rec_thd; r++){
+                size_t mid = part.size();
+                part.insert(part.end(), runs[r].begin() + bounds[p][r], runs[r].begin() + bounds[p+1][r]);
+                std::inplace_merge(part.begin(), part.begin() + mid, part.end());
+            }
+            std::vector<Node*>& first = firsts[p];
+            std::vector<Node*>& last = lasts[p];
+            for (size_t i = 0; i < part.size(); i++){
+                if (i > 0 && part[i-1].key == part[i].key){
+                    errexit("conflicting keys recovered.");
+                }
+                int h = std::min(MAX_LEVEL, 1 + __builtin_ctzll(offsets[p] + i + 1));
+                Node* node = new Node(this, part[i].key, part[i].payload, h, 1);
+                for (int l = 0; l < h; l++){
+                    if (last[l] == nullptr){
+                        first[l] = node;
+                    } else if (l == 0){
+                        last[l]->next.store(node);
+                    } else {
+                        last[l]->up[l-1].store(node);
+                    }
+                    last[l] = node;
+                }
+            }
+        });
+    }
+    for (auto& t : builders){
+        t.join();
+    }
+    // stitch the parts together, level by level.
+    for (int l = 0; l < MAX_LEVEL; l++){
+        Node* last = head;
+        for (int p = 0; p < parts; p++){
+            if (firsts[p][l] == nullptr){
+                continue;
+            }
+            if (l == 0){
+                last->next.store(firsts[p][l]);
+            } else {
+                last->up[l-1].store(firsts[p][l]);
+            }
+            last = lasts[p][l];
+        }
+    }
+    auto end = chrono::high_resolution_clock::now();
+    auto sort_ms = std::chrono::duration_cast<std::chrono::milliseconds>(sorted_end - begin).count();
+    auto build_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - sorted_end).count();
+    auto dur_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count();
+    std::cout << "Spent " << sort_ms << "ms recovering and sorting PBlk(" << rec_cnt.load() << ")" << std::endl;
+    std::cout << "Spent " << build_ms << "ms merging and linking " << parts << " parts" << std::endl;
+    std::cout << "Total time to recover: " << dur_ms << "ms" << std::endl;
+    return rec_cnt.load();
+}
+
+// fill preds and succs with the nodes around key at every level, unlinking
+// marked nodes on the way. pred_next is what preds[0]->next held when
+// succs[0] was read, for CAS_verify. returns whether succs[0] has key.
+template <class K, class V>
+bool MontageSkipList<K,V>::find(K key, Node** preds, Node** succs, pds::lin_var& pred_next){
+retry:
+    Node* pred = head;
+    for (int l = MAX_LEVEL-1; l > 0; l--){
+        Node* curr = getPtr(pred->up[l-1].load());
+        while (curr != nullptr){
+            Node* succ = curr->up[l-1].load();
+            if (getMark(succ)){
+                if (!pred->up[l-1].compare_exchange_strong(curr, getPtr(succ))){
+                    goto retry;
+                }
+                curr = getPtr(succ);
+                continue;
+            }
+            if (!(curr->key < key)){
+                break;
+            }
+            pred = curr;
+            curr = succ;
+        }
+        preds[l] = pred;
+        succs[l] = curr;
+    }
+    pds::lin_var curr = pred->next.load(this);
+    if (getMark(curr)){
+        goto retry;
+    }
+    while (curr.get_val<Node*>() != nullptr){
+        Node* c = curr.get_val<Node*>();
+        pds::lin_var succ = c->next.load(this);
+        if (getMark(succ)){
+            if (!pred->next.CAS(curr, getPtr(succ))){
+                goto retry;
+            }
+            curr = pred->next.load(this);
+            if (getMark(curr)){
+                goto retry;
+            }
+            continue;
+        }
+        if (!(c->key < key)){
+            break;
+        }
+        pred = c;
+        curr = succ;
+    }
+    preds[0] = pred;
+    succs[0] = curr.get_val<Node*>();
+    pred_next = curr;
+    return succs[0] != nullptr && succs[0]->key == key;
+}
+
+// link levels 1 and up of n, which is linked at level 0, bottom up. stops
+// early once n gets marked.
+template <class K, class V>
+void MontageSkipList<K,V>::link_tower(Node* n, Node** preds, Node** succs, int tid){
+    pds::lin_var pred_next;
+    for (int l = 1; l < n->height; l++){
+        while (true){
+            Node* old = n->up[l-1].load();
+            if (getMark(old)){
+                return;
+            }
+            Node* succ = succs[l];
+            if (old != succ && !n->up[l-1].compare_exchange_strong(old, succ)){
+                return; // marked in between
+            }
+            if (preds[l]->up[l-1].compare_exchange_strong(succ, n)){
+                break;
+            }
+            if (!find(n->key, preds, succs, pred_next) || succs[0] != n){
+                return; // n got unlinked
+            }
+        }
+    }
+}
+
+// mark n's tower top-down, level 0 last, and drop the remover's share.
+template <class K, class V>
+void MontageSkipList<K,V>::finish_remove(Node* n, int tid){
+    for (int l = n->height-1; l > 0; l--){
+        Node* succ = n->up[l-1].load();
+        while (!getMark(succ) && !n->up[l-1].compare_exchange_strong(succ, setMark(succ)));
+    }
+    while (true){
+        pds::lin_var succ = n->next.load(this);
+        if (getMark(succ)){
+            return; // someone else is finishing this remove
+        }
+        if (n->next.CAS(succ, setMark<Node>(succ))){
+            break;
+        }
+    }
+    release(n, tid);
+}
+
+template <class K, class V>
+void MontageSkipList<K,V>::release(Node* n, int tid){
+    if (n->owners.fetch_sub(1) == 1){
+        Node* preds[MAX_LEVEL];
+        Node* succs[MAX_LEVEL];
+        pds::lin_var pred_next;
+        find(n->key, preds, succs, pred_next);
+        tracker.retire(n, tid);
+    }
+}
+
+template <class K, class V>
+optional<V> MontageSkipList<K,V>::get(K key, int tid) {
+    optional<V> res={};
+    Node* preds[MAX_LEVEL];
+    Node* succs[MAX_LEVEL];
+    pds::lin_var pred_next;
+
+    tracker.start_op(tid);
+    if(find(key,preds,succs,pred_next)) {
+        MontageOpHolder _holder(this);
+        pds::lin_var p=succs[0]->payload.load(this);
+        if(!getMark(p)){
+            res=(V)getPayload(p)->get_unsafe_val(this);//never old see new as we find node before BEGIN_OP
+        }
+    }
+    tracker.end_op(tid);
+
+    return res;
+}
+
+template <class K, class V>
+optional<V> MontageSkipList<K,V>::put(K key, V val, int tid) {
+    optional<V> res={};
+    Node* preds[MAX_LEVEL];
+    Node* succs[MAX_LEVEL];
+    pds::lin_var pred_next;
+    Payload* payload = pnew<Payload>(key,val);
+    Node* tmpNode = nullptr;
+
+    tracker.start_op(tid);
+    while(true) {
+        if(find(key,preds,succs,pred_next)) {
+            Node* curr=succs[0];
+            pds::lin_var p=curr->payload.load(this);
+            if(getMark(p)){
+                finish_remove(curr,tid);
+                continue;
+            }
+            // exists; swap payloads in place
+            begin_update(tid);
+            begin_op();
+            res=(V)getPayload(p)->get_unsafe_val(this);//only kept if CAS_verify below succeeds, which rules out old see new
+            if(curr->payload.CAS_verify(this,p,payload)) {
+                pretire(getPayload(p));
+                end_op();
+                end_update(tid);
+                // the old payload is reclaimed once no reader can hold it,
+                // through an unlinked node retired in its stead.
+                Node* husk=new Node(this,key,getPayload(p),1,1);
+                tracker.retire(husk,tid);
+                if(tmpNode){
+                    tmpNode->payload.store(nullptr);
+                    delete tmpNode;
+                }
+                break;
+            }
+            abort_op();
+            end_update(tid);
+        }
+        else {
+            //does not exist; insert.
+            res={};
+            if(!tmpNode){
+                tmpNode=new Node(this,key,payload,random_height(tid),2);
+            }
+            tmpNode->next.store(succs[0]);
+            begin_update(tid);
+            begin_op();
+            if(preds[0]->next.CAS_verify(this,pred_next,tmpNode)) {
+                end_op();
+                end_update(tid);
+                link_tower(tmpNode,preds,succs,tid);
+                release(tmpNode,tid);
+                break;
+            }
+            abort_op();
+            end_update(tid);
+        }
+    }
+    tracker.end_op(tid);
+    return res;
+}
+
+template <class K, class V>
+bool MontageSkipList<K,V>::insert(K key, V val, int tid){
+    bool res=false;
+    Node* preds[MAX_LEVEL];
+    Node* succs[MAX_LEVEL];
+    pds::lin_var pred_next;
+    Node* tmpNode = new Node(this,key,pnew<Payload>(key,val),random_height(tid),2);
+
+    tracker.start_op(tid);
+    while(true) {
+        if(find(key,preds,succs,pred_next)) {
+            Node* curr=succs[0];
+            if(getMark(curr->payload.load(this))){
+                finish_remove(curr,tid);
+                continue;
+            }
+            res=false;
+            delete tmpNode;
+            break;
+        }
+        else {
+            //does not exist, insert.
+            tmpNode->next.store(succs[0]);
+            begin_update(tid);
+            begin_op();
+            if(preds[0]->next.CAS_verify(this,pred_next,tmpNode)) {
+                end_op();
+                end_update(tid);
+                link_tower(tmpNode,preds,succs,tid);
+                release(tmpNode,tid);
+                res=true;
+                break;
+            }
+            abort_op();
+            end_update(tid);
+        }
+    }
+    tracker.end_op(tid);
+
+    return res;
+}
+
+template <class K, class V>
+optional<V> MontageSkipList<K,V>::remove(K key, int tid) {
+    optional<V> res={};
+    Node* preds[MAX_LEVEL];
+    Node* succs[MAX_LEVEL];
+    pds::lin_var pred_next;
+
+    tracker.start_op(tid);
+    while(true) {
+        if(!find(key,preds,succs,pred_next)) {
+            res={};
+            break;
+        }
+        Node* curr=succs[0];
+        pds::lin_var p=curr->payload.load(this);
+        if(getMark(p)){
+            // already removed; help unlink it
+            finish_remove(curr,tid);
+            res={};
+            break;
+        }
+        begin_update(tid);
+        begin_op();
+        res=(V)getPayload(p)->get_unsafe_val(this);//only kept if CAS_verify below succeeds, which rules out old see new
+        if(!curr->payload.CAS_verify(this,p,setMark<Payload>(p))) {
+            abort_op();
+            end_update(tid);
+            continue;
+        }
+        pretire(getPayload(p));
+        end_op();
+        end_update(tid);
+        finish_remove(curr,tid);
+        break;
+    }
+    tracker.end_op(tid);
+
+    return res;
+}
+
+template <class K, class V>
+optional<V> MontageSkipList<K,V>::replace(K key, V val, int tid) {
+    optional<V> res={};
+    Node* preds[MAX_LEVEL];
+    Node* succs[MAX_LEVEL];
+    pds::lin_var pred_next;
+    Payload* payload = pnew<Payload>(key,val);
+
+    tracker.start_op(tid);
+    while(true){
+        if(!find(key,preds,succs,pred_next)){
+            //does not exist
+            res={};
+            pdelete(payload);
+            break;
+        }
+        Node* curr=succs[0];
+        pds::lin_var p=curr->payload.load(this);
+        if(getMark(p)){
+            finish_remove(curr,tid);
+            continue;
+        }
+        begin_update(tid);
+        begin_op();
+        res=(V)getPayload(p)->get_unsafe_val(this);//only kept if CAS_verify below succeeds, which rules out old see new
+        if(curr->payload.CAS_verify(this,p,payload)){
+            pretire(getPayload(p));
+            end_op();
+            end_update(tid);
+            Node* husk=new Node(this,key,getPayload(p),1,1);
+            tracker.retire(husk,tid);
+            break;
+        }
+        abort_op();
+        end_update(tid);
+    }
+    tracker.end_op(tid);
+    return res;
+}
+
+// first node at level 0 with a key no less than lo, found without helping.
+template <class K, class V>
+typename MontageSkipList<K,V>::Node* MontageSkipList<K,V>::first_at_least(const K& lo){
+    Node* pred = head;
+    for (int l = MAX_LEVEL-1; l > 0; l--){
+        Node* curr = getPtr(pred->up[l-1].load());
+        while (curr != nullptr && curr->key < lo){
+            pred = curr;
+            curr = getPtr(curr->up[l-1].load());
+        }
+    }
+    Node* curr = getPtr(pred->next.load(this)).template get_val<Node*>();
+    while (curr != nullptr && curr->key < lo){
+        curr = getPtr(curr->next.load(this)).template get_val<Node*>();
+    }
+    return curr;
+}
+
+// walk level 0 from lo, keeping the keys whose payload is unmarked. a
+// node being unlinked still leads on to its successor, so a walk racing
+// with removals reaches every live key exactly once.
+template <class K, class V>
+void MontageSkipList<K,V>::collect(const K& lo, const K& hi, int limit, std::vector<std::pair<K,Payload*>>& items){
+    items.clear();
+    for (Node* curr = first_at_least(lo); curr != nullptr && !(hi < curr->key);
+        curr = getPtr(curr->next.load(this)).template get_val<Node*>()){
+        pds::lin_var p = curr->payload.load(this);
+        if (!getMark(p)){
+            items.emplace_back(curr->key, getPayload(p));
+            if (limit > 0 && (int)items.size() >= limit) return;
+        }
+    }
+}
+
+// the items collected are a snapshot if no thread linearized an update
+// while collecting, i.e., no sequence number was odd or moved. values are
+// read once the snapshot is taken, under a single read-only op.
+template <class K, class V>
+int MontageSkipList<K,V>::range(K lo, K hi, int limit, std::function<void(const K&, const V&)> f, int tid){
+    std::vector<std::pair<K,Payload*>> items;
+    std::vector<uint64_t> seqs(task_num);
+    tracker.start_op(tid);
+    {
+        MontageOpHolderReadOnly _holder(this);
+        bool done=false;
+        for(int i=0;i<optimistic_scans && !done;i++){
+            bool quiescent=true;
+            for(int t=0;t<task_num && quiescent;t++){
+                seqs[t]=update_seqs[t].ui.load();
+                quiescent=(seqs[t]%2==0);
+            }
+            if(!quiescent) continue;
+            collect(lo,hi,limit,items);
+            done=true;
+            for(int t=0;t<task_num && done;t++){
+                done=(update_seqs[t].ui.load()==seqs[t]);
+            }
+        }
+        if(!done){
+            std::lock_guard<std::mutex> lk(scan_lock);
+            scan_blocking.store(true);
+            for(int t=0;t<task_num;t++){
+                while(update_seqs[t].ui.load()%2!=0);
+            }
+            collect(lo,hi,limit,items);
+            scan_blocking.store(false);
+        }
+        for(auto& item : items){
+            f(item.first,(V)item.second->get_unsafe_val(this));
+        }
+    }
+    tracker.end_op(tid);
+    return items.size();
+}
+
+/* Specialization for strings */
+#include <string>
+#include "PString.hpp"
+template <>
+class MontageSkipList<std::string, std::string>::Payload : public pds::PBlk{
+    GENERATE_FIELD(pds::PString<TESTS_KEY_SIZE>, key, Payload);
+    GENERATE_FIELD(pds::PString<TESTS_VAL_SIZE>, val, Payload);
+
+public:
+    Payload(std::string k, std::string v) : m_key(this, k), m_val(this, v){}
+    Payload(const Payload& oth) : pds::PBlk(oth), m_key(this, oth.m_key), m_val(this, oth.m_val){}
+    void persist(){}
+};
+
+#endif
@@ -1,121 +1,251 @@
 #ifndef PRIORITY_QUEUE
 #define PRIORITY_QUEUE
 
+/*
+ * A relaxed concurrent priority queue in the style of MultiQueues
+ * (Rihani, Sanders and Dementiev, SPAA'15): HeapsPerThread sequential
+ * binary max-heaps per thread, each behind its own lock. Enqueue pushes
+ * into a random heap; dequeue samples two heaps and pops from the one
+ * with the greater top. Both are O(log n) in the size of one heap.
+ * Only payloads are persistent; recovery redistributes them over the
+ * heaps and heapifies them in parallel.
+ */
+
 #include <iostream>
 #include <atomic>
 #include <algorithm>
-#include <memory>
+#include <mutex>
+#include <vector>
+#include <thread>
+#include <chrono>
 #include "HarnessUtils.hpp"
 #include "ConcurrentPrimitives.hpp"
-#include "RCUTracker.hpp"
 #include "CustomTypes.hpp"
 #include "Recoverable.hpp"
 #include "HeapQueue.hpp"
 
-//Wentao: TODO to fix later
 template<typename K, typename V>
 class PriorityQueue : public HeapQueue<K,V>, public Recoverable{
-public: 
+public:
   class Payload : public pds::PBlk{
     GENERATE_FIELD(K, key, Payload);
     GENERATE_FIELD(V, val, Payload);
-    GENERATE_FIELD(uint64_t, sn, Payload);
   public:
     Payload(){}
-    Payload(K k, V v):m_key(k),  m_val(v), m_sn(0){}
-    Payload(const Payload& oth): pds::PBlk(oth), m_key(oth.m_key), m_val(oth.m_val), m_sn(oth.m_sn){}
+    Payload(K k, V v):m_key(k),  m_val(v){}
+    Payload(const Payload& oth): pds::PBlk(oth), m_key(oth.m_key), m_val(oth.m_val){}
     void persist(){}
   };
 
 private:
-  struct Node{
-    PriorityQueue* ds;
+  // transient copy of the key, so that sifting never reads payloads.
+  struct Entry{
     K key;
-    Node* next;
     Payload* payload;
-
-    Node():key(0), next(nullptr), payload(nullptr){};
-    Node(PriorityQueue* ds_, K k, V val):
-      ds(ds_), key(k), next(nullptr), payload(ds->pnew<Payload>(k, val)){};
-
-    V get_val(){
-      assert(payload != nullptr && "payload shouldn't be null");
-      return (V)payload->get_val(ds);
-    }
-
-    void set_sn(uint64_t s){
-      assert(payload != nullptr && "payload shouldn't be null");
-      payload->set_sn(ds,s);
+    Entry(K k, Payload* p): key(k), payload(p){}
+    bool operator<(const Entry& oth) const{
+      return key < oth.key;
     }
+  };
 
-    ~Node(){
-      ds->pdelete(payload);
-    }
+  struct Heap{
+    std::mutex lock;
+    std::vector<Entry> entries;
+    // entries.size(), readable without the lock to skip empty heaps.
+    std::atomic<size_t> size;
+    Heap(): size(0){}
   };
 
-public:
-  std::atomic<uint64_t> global_sn;
+  GlobalTestConfig* gtc;
+  int heap_cnt;
+  padded<Heap>* heaps;
+  // per-thread xorshift states for picking heaps.
+  padded<uint64_t>* seeds;
 
-private:
-  std::mutex mtx;
-  Node* head;
+  int random_heap(int tid){
+    uint64_t& x = seeds[tid].ui;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return x % heap_cnt;
+  }
+
+  // pop the top of h, which must be locked and nonempty.
+  V pop(Heap& h){
+    MontageOpHolder _holder(this);
+    std::pop_heap(h.entries.begin(), h.entries.end());
+    Payload* payload = h.entries.back().payload;
+    h.entries.pop_back();
+    h.size.store(h.entries.size(), std::memory_order_relaxed);
+    // the enqueuing operation ended before we took the lock, so
+    // old-see-new is impossible.
+    V res = (V)payload->get_unsafe_val(this);
+    pdelete(payload);
+    return res;
+  }
 
 public:
-  PriorityQueue(int task_num): global_sn(0){
-    head = new Node();
+  PriorityQueue(GlobalTestConfig* gtc_): Recoverable(gtc_), gtc(gtc_){
+    int heaps_per_thd = 2;
+    if (gtc->checkEnv("HeapsPerThread")){
+      heaps_per_thd = stoi(gtc->getEnv("HeapsPerThread"));
+    }
+    heap_cnt = std::max(1, heaps_per_thd * gtc->task_num);
+    heaps = new padded<Heap>[heap_cnt];
+    seeds = new padded<uint64_t>[gtc->task_num];
+    for (int i = 0; i < gtc->task_num; i++){
+      seeds[i].ui = 0x9E3779B97F4A7C15ULL * (i + 1);
+    }
   }
   ~PriorityQueue(){};
 
+  void init_thread(GlobalTestConfig* gtc, LocalTestConfig* ltc){
+    Recoverable::init_thread(gtc, ltc);
+  }
+
+  int recover(bool simulated);
+
   void enqueue(K key, V val, int tid);
   optional<V> dequeue(int tid);
 };
 
 template<typename K, typename V>
-void PriorityQueue<K,V>::enqueue(K key, V val, int tid){
-  Node* new_node = new Node(this, key, val);
-  std::unique_lock<std::mutex> lock(mtx);
-  if(head->next == nullptr){
-    head->next = new_node;
-  }else{
-    if(key >= head->next->key){
-      new_node->next = head->next;
-      head->next = new_node;
-    }else{
-      Node* tmp = head->next;
-      while(tmp->next != nullptr && key < tmp->next->key){
-        tmp = tmp->next;
-      }
-      new_node->next = tmp->next;
-      tmp->next = new_node;
+int PriorityQueue<K,V>::recover(bool simulated){
+  // payloads are dealt with by recovery; just forget about them.
+  for (int i = 0; i < heap_cnt; i++){
+    heaps[i].ui.entries.clear();
+    heaps[i].ui.size.store(0);
+  }
+  int rec_thd = 10;
+  if (gtc->checkEnv("RecoverThread")){
+    rec_thd = stoi(gtc->getEnv("RecoverThread"));
+  }
+  // phase 1: each recovery thread collects the entries of its shard.
+  std::vector<std::vector<Entry>> runs(rec_thd);
+  std::atomic<int> rec_cnt(0);
+  auto begin = chrono::high_resolution_clock::now();
+  recover_pblks([&](const std::vector<pds::PBlk*>& blks, int shard){
+    std::vector<Entry>& run = runs[shard];
+    run.reserve(blks.size());
+    for (pds::PBlk* blk : blks){
+      Payload* payload = reinterpret_cast<Payload*>(blk);
+      run.emplace_back((K)payload->get_unsafe_key(this), payload);
     }
+    rec_cnt.fetch_add(blks.size(), std::memory_order_relaxed);
+  }, rec_thd);
+  auto collected = chrono::high_resolution_clock::now();
+
+  // phase 2: heap i takes the i-th slice of the concatenated runs, and
+  // the heaps are filled and heapified in parallel.
+  std::vector<size_t> offsets(rec_thd + 1, 0);
+  for (int r = 0; r < rec_thd; r++){
+    offsets[r + 1] = offsets[r] + runs[r].size();
+  }
+  size_t total = offsets[rec_thd];
+  std::vector<std::thread> builders;
+  for (int t = 0; t < rec_thd; t++){
+    builders.emplace_back([&, t](){
+      for (int i = t; i < heap_cnt; i += rec_thd){
+        size_t lo = total * i / heap_cnt;
+        size_t hi = total * (i + 1) / heap_cnt;
+        Heap& h = heaps[i].ui;
+        h.entries.reserve(hi - lo);
+        int r = std::upper_bound(offsets.begin(), offsets.end(), lo) - offsets.begin() - 1;
+        for (size_t g = lo; g < hi; g++){
+          while (g >= offsets[r + 1]){
+            r++;
+          }
+          h.entries.push_back(runs[r][g - offsets[r]]);
+        }
+        std::make_heap(h.entries.begin(), h.entries.end());
+        h.size.store(h.entries.size());
+      }
+    });
+  }
+  for (auto& b : builders){
+    b.join();
+  }
+  auto end = chrono::high_resolution_clock::now();
+  auto collect_ms = std::chrono::duration_cast<std::chrono::milliseconds>(collected - begin).count();
+  auto build_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - collected).count();
+  auto dur_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count();
+  std::cout << "Spent " << collect_ms << "ms recovering PBlk(" << rec_cnt.load() << ")" << std::endl;
+  std::cout << "Spent " << build_ms << "ms building " << heap_cnt << " heaps" << std::endl;
+  std::cout << "Total time to recover: " << dur_ms << "ms" << std::endl;
+  return rec_cnt.load();
+}
+
+template<typename K, typename V>
+void PriorityQueue<K,V>::enqueue(K key, V val, int tid){
+  // pending until the operation below registers it.
+  Payload* payload = pnew<Payload>(key, val);
+  int i = random_heap(tid);
+  while (!heaps[i].ui.lock.try_lock()){
+    i = random_heap(tid);
+  }
+  Heap& h = heaps[i].ui;
+  {
+    MontageOpHolder _holder(this);
+    h.entries.emplace_back(key, payload);
+    std::push_heap(h.entries.begin(), h.entries.end());
+    h.size.store(h.entries.size(), std::memory_order_relaxed);
   }
-  uint64_t s = global_sn.fetch_add(1);
-  begin_op();
-  new_node->set_sn(s);
-  end_op();
+  h.lock.unlock();
 }
 
 template<typename K, typename V>
 optional<V> PriorityQueue<K,V>::dequeue(int tid){
-  std::unique_lock<std::mutex> lock(mtx);
   optional<V> res = {};
-  if(head->next == nullptr){
-    res.reset();
-  }else{
-    Node* target = head->next;
-    head->next = target->next;
-    begin_op();
-    res = (V)target->payload->get_val();
-    delete(target);
-    end_op();
+  for (int attempt = 0; attempt < heap_cnt; attempt++){
+    Heap& a = heaps[random_heap(tid)].ui;
+    Heap& b = heaps[random_heap(tid)].ui;
+    if (a.size.load(std::memory_order_relaxed) == 0 &&
+      b.size.load(std::memory_order_relaxed) == 0){
+      continue;
+    }
+    if (!a.lock.try_lock()){
+      continue;
+    }
+    if (&a != &b && !b.lock.try_lock()){
+      a.lock.unlock();
+      continue;
+    }
+    // pop from the heap with the greater top, and let go of the other.
+    Heap* h = &a;
+    if (a.entries.empty() || (!b.entries.empty() && a.entries.front() < b.entries.front())){
+      h = &b;
+    }
+    Heap* other = (h == &a) ? &b : &a;
+    if (other != h){
+      other->lock.unlock();
+    }
+    if (!h->entries.empty()){
+      res = pop(*h);
+    }
+    h->lock.unlock();
+    if (res){
+      return res;
+    }
+  }
+  // the samples looked empty or busy; sweep all heaps before reporting
+  // the queue empty.
+  for (int i = 0; i < heap_cnt; i++){
+    Heap& h = heaps[i].ui;
+    if (h.size.load(std::memory_order_relaxed) == 0){
+      continue;
+    }
+    std::lock_guard<std::mutex> lk(h.lock);
+    if (!h.entries.empty()){
+      return pop(h);
+    }
   }
   return res;
 }
 
-template <class T> 
+template <class T>
 class PriorityQueueFactory : public RideableFactory{
     Rideable* build(GlobalTestConfig* gtc){
-        return new PriorityQueue<T,T>(gtc->task_num);
+        return new PriorityQueue<T,T>(gtc);
     }
 };
 
@@ -126,12 +256,11 @@ template<>
 class PriorityQueue<std::string, std::string>::Payload : public pds::PBlk{
   GENERATE_FIELD(pds::PString<TESTS_KEY_SIZE>, key, Payload);
   GENERATE_FIELD(pds::PString<TESTS_VAL_SIZE>, val, Payload);
-  GENERATE_FIELD(uint64_t, sn, Payload);
 
 public:
-  Payload(std::string k, std::string v):m_key(this, k),  m_val(this, v), m_sn(0){}
-  Payload(const Payload& oth): pds::PBlk(oth), m_key(this, oth.m_key),  m_val(this, oth.m_val), m_sn(oth.m_sn){}
+  Payload(std::string k, std::string v):m_key(this, k),  m_val(this, v){}
+  Payload(const Payload& oth): pds::PBlk(oth), m_key(this, oth.m_key),  m_val(this, oth.m_val){}
   void persist(){}
 };
 
-#endif
\ No newline at end of file
+#endif
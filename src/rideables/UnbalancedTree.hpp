@@ -68,6 +68,10 @@ public:
         root = nullptr;
     }
 
+    void init_thread(GlobalTestConfig* gtc, LocalTestConfig* ltc){
+        Recoverable::init_thread(gtc, ltc);
+    }
+
     int recover(bool simulated){
         errexit("recover of UnbalancedTree not implemented");
         return 0;
@@ -119,7 +123,8 @@ public:
         while(true){
             MontageOpHolder _holder(this);
             if (!root){
-                root = new TreeNode(key, val);
+                root = new TreeNode(this, key, val);
+                return NONE;
             } else {
                 try{
                     HOHLockHolder lock_holder;
@@ -137,9 +142,9 @@ public:
         K curr_key = curr->get_key();
         if (curr_key == key){
             optional<V> ret = curr->get_val();
-            curr->payload = curr->payload->set_val(val);
+            curr->set_val(val);
             if (curr->get_deleted()){
-                curr->payload = curr->payload->set_deleted(false);
+                curr->set_deleted(false);
                 return NONE;
             } else {
                 return ret;
@@ -148,14 +153,14 @@ public:
             if (curr->left){
                 return do_put(lock_holder, curr->left, key, val);
             } else {
-                curr->left = new TreeNode(key, val);
+                curr->left = new TreeNode(this, key, val);
                 return NONE;
             }
         } else {
             if (curr->right){
                 return do_put(lock_holder, curr->right, key, val);
             } else {
-                curr->right = new TreeNode(key, val);
+                curr->right = new TreeNode(this, key, val);
                 return NONE;
             }
         }
@@ -165,7 +170,7 @@ public:
         while(true){
             MontageOpHolder _holder(this);
             if (!root){
-                root = new TreeNode(key, val);
+                root = new TreeNode(this, key, val);
                 return true;
             } else {
                 try{
@@ -183,8 +188,8 @@ public:
         K curr_key = curr->get_key();
         if (curr_key == key){
             if (curr->get_deleted()){
-                curr->payload = curr->payload->set_deleted(false);
-                curr->payload = curr->payload->set_val(val);
+                curr->set_deleted(false);
+                curr->set_val(val);
                 return true;
             } else {
                 return false;
@@ -193,14 +198,14 @@ public:
             if (curr->left){
                 return do_insert(lock_holder, curr->left, key, val);
             } else {
-                curr->left = new TreeNode(key, val);
+                curr->left = new TreeNode(this, key, val);
                 return true;
             }
         } else {
             if (curr->right){
                 return do_insert(lock_holder, curr->right, key, val);
             } else {
-                curr->right = new TreeNode(key, val);
+                curr->right = new TreeNode(this, key, val);
                 return true;
             }
         }
@@ -234,7 +239,7 @@ public:
             if (curr->get_deleted()){
                 return NONE;
             } else {
-                curr->payload = curr->payload->set_deleted(true);
+                curr->set_deleted(true);
                 return curr->get_val();
             }
         } else if (curr_key > key){
@@ -1,13 +1,16 @@
-// This test is obsolete
-#if 0 
-
 #ifndef HEAPCHURNTEST_HPP
 #define HEAPCHURNTEST_HPP
 
+/*
+ * This is a test with a time length for priority queues, with keys
+ * drawn uniformly from [0, range).
+ */
+
 #include "AllocatorMacro.hpp"
 #include "Persistent.hpp"
 #include "TestConfig.hpp"
 #include "HeapQueue.hpp"
+#include <random>
 
 template <class V>
 class HeapChurnTest : public Test{
@@ -86,7 +89,7 @@ public:
     }
 
     void cleanup(GlobalTestConfig* gtc){
-        delete g;
+        delete q;
     }
     void getRideable(GlobalTestConfig* gtc){
         Rideable* ptr = gtc->allocRideable();
@@ -97,11 +100,12 @@ public:
     }
     void doPrefill(GlobalTestConfig* gtc){
         if(this->prefill > 0){
-            int stride = this->range/this->prefill;
+            // spread the prefilled keys evenly over the range
+            int stride = std::max(1, this->range/this->prefill);
             int i = 0;
-            for(i = 0; i < this->prefill; i += stride){
-                V k = this->fromInt(i);
-                V v = this->fromInt(i);
+            for(i = 0; i < this->prefill; i++){
+                V k = this->fromInt((uint64_t)i * stride % this->range);
+                V v = k;
                 q->enqueue(k, v, 0);
             }
             if(gtc->verbose){
@@ -132,6 +136,4 @@ inline std::string HeapChurnTest<std::string>::fromInt(uint64_t v){
     return std::to_string(v);
 }
 
-#endif
-
-#endif // 0
\ No newline at end of file
+#endif
\ No newline at end of file
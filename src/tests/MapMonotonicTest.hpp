@@ -0,0 +1,69 @@
+#ifndef MAPMONOTONICTEST_HPP
+#define MAPMONOTONICTEST_HPP
+
+/*
+ * This is a test with a time length for mappings, where keys are issued
+ * in increasing order, as time-ordered IDs are. The prefill inserts keys
+ * 0 to prefill-1 in order, every insert takes the next unused key, and the
+ * other operations pick a random key issued so far.
+ */
+
+#include "MapChurnTest.hpp"
+#include <atomic>
+#include <climits>
+#include <iostream>
+
+template <class K, class V>
+class MapMonotonicTest : public MapChurnTest<K,V>{
+public:
+	std::atomic<uint64_t> next_key;
+	MapMonotonicTest(int p_gets, int p_puts, int p_inserts, int p_removes, int prefill):
+		MapChurnTest<K,V>(p_gets, p_puts, p_inserts, p_removes, prefill, prefill){}
+
+	void init(GlobalTestConfig* gtc){
+		MapChurnTest<K,V>::init(gtc);
+		// keys from ChurnTest only serve as random numbers from here on.
+		this->range = INT_MAX;
+	}
+
+	void doPrefill(GlobalTestConfig* gtc){
+		for(int i=0;i<this->prefill;i++){
+			K k = this->fromInt(i);
+			this->m->insert(k,k,0);
+		}
+		next_key.store(this->prefill);
+		if(gtc->verbose){
+			printf("Prefilled %d in order\n",this->prefill);
+		}
+	}
+
+	void operation(uint64_t key, int op, int tid){
+		if(op>=this->prop_puts && op<this->prop_inserts){
+			key = next_key.fetch_add(1);
+		}
+		else{
+			key = key%std::max<uint64_t>(1,next_key.load());
+		}
+		MapChurnTest<K,V>::operation(key, op, tid);
+	}
+
+	void cleanup(GlobalTestConfig* gtc){
+		if(gtc->verbose){
+			printf("Keys issued:%lu\n",next_key.load());
+		}
+		MapChurnTest<K,V>::cleanup(gtc);
+	}
+};
+
+template<>
+inline void MapMonotonicTest<std::string,std::string>::doPrefill(GlobalTestConfig* gtc){
+	for(int i=0;i<this->prefill;i++){
+		this->m->insert(this->fromInt(i),this->value_buffer,0);
+	}
+	next_key.store(this->prefill);
+	if(gtc->verbose){
+		printf("Prefilled %d in order\n",this->prefill);
+	}
+}
+
+#endif
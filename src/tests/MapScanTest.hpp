@@ -0,0 +1,73 @@
+#ifndef MAPSCANTEST_HPP
+#define MAPSCANTEST_HPP
+
+/*
+ * This is a test with a time length for ordered mappings, where range
+ * scans take the place of gets.
+ */
+
+#include "MapChurnTest.hpp"
+#include "ROrderedMap.hpp"
+#include <iostream>
+
+template <class K, class V>
+class MapScanTest : public MapChurnTest<K,V>{
+public:
+	ROrderedMap<K,V>* om;
+	int scan_len;
+	K hi;
+	padded<uint64_t>* scans;
+	padded<uint64_t>* scanned;
+	MapScanTest(int p_scans, int p_puts, int p_inserts, int p_removes, int range, int prefill, int scan_len):
+		MapChurnTest<K,V>(p_scans, p_puts, p_inserts, p_removes, range, prefill), scan_len(scan_len){}
+
+	void init(GlobalTestConfig* gtc){
+		if(gtc->checkEnv("ScanLength")){
+			scan_len = atoi((gtc->getEnv("ScanLength")).c_str());
+		}
+		scans = new padded<uint64_t>[gtc->task_num]{};
+		scanned = new padded<uint64_t>[gtc->task_num]{};
+		MapChurnTest<K,V>::init(gtc);
+		hi = this->fromInt(this->range-1);
+		if(gtc->verbose){
+			printf("Scan length:%d\n",scan_len);
+		}
+	}
+
+	void allocRideable(GlobalTestConfig* gtc){
+		Rideable* ptr = gtc->allocRideable();
+		om = dynamic_cast<ROrderedMap<K, V>*>(ptr);
+		if (!om) {
+			 errexit("MapScanTest must be run on ROrderedMap<K,V> type object.");
+		}
+		this->m = om;
+	}
+
+	void operation(uint64_t key, int op, int tid){
+		if(op<this->prop_gets){
+			K k = this->fromInt(key);
+			scanned[tid].ui += om->range(k,hi,scan_len,[](const K&, const V&){},tid);
+			scans[tid].ui++;
+		}
+		else{
+			MapChurnTest<K,V>::operation(key, op, tid);
+		}
+	}
+
+	void cleanup(GlobalTestConfig* gtc){
+		uint64_t total_scans = 0;
+		uint64_t total_scanned = 0;
+		for(int i=0;i<gtc->task_num;i++){
+			total_scans += scans[i].ui;
+			total_scanned += scanned[i].ui;
+		}
+		if(gtc->verbose){
+			printf("Scans:%lu Keys scanned:%lu\n",total_scans,total_scanned);
+		}
+		delete[] scans;
+		delete[] scanned;
+		MapChurnTest<K,V>::cleanup(gtc);
+	}
+};
+
+#endif
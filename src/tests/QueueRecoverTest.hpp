@@ -0,0 +1,107 @@
+#ifndef QUEUERECOVERTEST_HPP
+#define QUEUERECOVERTEST_HPP
+
+/*
+ * This is a test to verify correctness of queues' recovery and to time it
+ * against the number of items left in the queue.
+ */
+
+#include <deque>
+#include "TestConfig.hpp"
+#include "AllocatorMacro.hpp"
+#include "Persistent.hpp"
+#include "Recoverable.hpp"
+#include "RQueue.hpp"
+
+class QueueRecoverTest : public Test{
+public:
+    RQueue<std::string>* q;
+    Recoverable* rec;
+    size_t ins_cnt = 1000000;
+    QueueRecoverTest(){}
+
+    void parInit(GlobalTestConfig* gtc, LocalTestConfig* ltc){
+        q->init_thread(gtc, ltc);
+    }
+
+    void init(GlobalTestConfig* gtc){
+        if (gtc->task_num != 1){
+            errexit("QueueRecoverTest only runs on single thread.");
+        }
+        Rideable* ptr = gtc->allocRideable();
+        q = dynamic_cast<RQueue<std::string>*>(ptr);
+        if (!q){
+            errexit("QueueRecoverTest must be run on RQueue<string> type object.");
+        }
+        rec = dynamic_cast<Recoverable*>(ptr);
+        if (!rec){
+            errexit("QueueRecoverTest must be run on Recoverable type object.");
+        }
+        if (gtc->checkEnv("InsCnt")){
+            ins_cnt = stoll(gtc->getEnv("InsCnt"));
+        }
+
+        /* set interval to inf so this won't be killed by timeout */
+        gtc->interval = numeric_limits<double>::max();
+    }
+
+    int execute(GlobalTestConfig* gtc, LocalTestConfig* ltc){
+        int tid = ltc->tid;
+        // enqueue ins_cnt items and dequeue the first quarter of them, so
+        // that the recovered queue does not start at the first item.
+        std::deque<size_t> reference;
+        auto begin = chrono::high_resolution_clock::now();
+        for (size_t i = 0; i < ins_cnt; i++){
+            q->enqueue(std::to_string(i), tid);
+            reference.push_back(i);
+            if (i % 4 == 3){
+                q->dequeue(tid);
+                reference.pop_front();
+            }
+        }
+        auto end = chrono::high_resolution_clock::now();
+        auto dur_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count();
+        std::cout<<"enqueue finished. Spent "<< dur_ms << "ms" <<std::endl;
+        rec->flush();
+        std::cout<<"epochsys flushed."<<std::endl;
+        rec->simulate_crash();
+        std::cout<<"crashed."<<std::endl;
+
+        begin = chrono::high_resolution_clock::now();
+        int rec_cnt = rec->recover(true);
+        end = chrono::high_resolution_clock::now();
+        dur_ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count();
+        if (gtc->recorder){
+            gtc->recorder->reportGlobalInfo("Duration (ms)", dur_ms);
+        }
+        std::cout<<"Recovered "<<rec_cnt<<" items in "<<dur_ms<<"ms"<<std::endl;
+        if (rec_cnt != (int)reference.size()){
+            std::cout<<"recovered:"<<rec_cnt<<" expecting:"<<reference.size()<<std::endl;
+            exit(1);
+        }
+
+        // the recovered queue must hand out the same items in the same order
+        // and keep going after them.
+        q->enqueue(std::to_string(ins_cnt), tid);
+        reference.push_back(ins_cnt);
+        for (size_t expected : reference){
+            optional<std::string> v = q->dequeue(tid);
+            if (!v || std::stoull(*v) != expected){
+                std::cout<<"expecting "<<expected<<", got "<<(v ? *v : "nothing")<<std::endl;
+                exit(1);
+            }
+        }
+        if (q->dequeue(tid)){
+            std::cout<<"queue not empty after all recovered items."<<std::endl;
+            exit(1);
+        }
+        std::cout<<"all items recovered in order."<<std::endl;
+        return ins_cnt;
+    }
+
+    void cleanup(GlobalTestConfig* gtc){
+        delete q;
+    }
+};
+
+#endif
@@ -67,13 +67,18 @@ public:
     uint64_t total_ops;
     uint64_t* thd_ops;
     unsigned int enq;
+    // number of items moved per queue operation; above 1 the test goes
+    // through enqueue_bulk/dequeue_bulk.
+    int batch;
     std::string value_buffer;
-    QueueTest(uint64_t o, unsigned int e = 50){
+    std::vector<std::string> batch_buffer;
+    QueueTest(uint64_t o, unsigned int e = 50, int b = 1){
         //wl is a or b
         // trace_prefix = YCSB_PREFIX + wl + "-";
         // q = nullptr;
         total_ops = o;
         enq = e;
+        batch = b;
         assert(enq <= 100 && "enq must <= 100!");
     }
     // ~QueueTest(){
@@ -117,6 +122,14 @@ public:
             value_buffer += (char)((i % 2 == 0 ? 'A' : 'a') + (gen_v() % 26));
         }
         value_buffer += '\0';
+        if(gtc->checkEnv("BatchSize")){
+            batch = atoi((gtc->getEnv("BatchSize")).c_str());
+            assert(batch>0&&"BatchSize must be positive!");
+        }
+        batch_buffer.assign(batch, value_buffer);
+        if(gtc->verbose){
+            printf("Batch size:%d\n", batch);
+        }
         getRideable(gtc);
         
         thd_num = to_string(gtc->task_num);
@@ -157,13 +170,23 @@ public:
     int execute(GlobalTestConfig* gtc, LocalTestConfig* ltc){
         int tid = ltc->tid;
         std::mt19937_64 gen_p(ltc->seed);
-        for (size_t i = 0; i < thd_ops[ltc->tid]; i++) {
+        for (size_t i = 0; i < thd_ops[ltc->tid]; i += batch) {
             unsigned p = gen_p()%100;
-            if (p<enq) {
-                q->enqueue(value_buffer, ltc->tid);
+            if (batch == 1) {
+                if (p<enq) {
+                    q->enqueue(value_buffer, ltc->tid);
+                }
+                else {
+                    q->dequeue(tid);
+                }
             }
             else {
-                q->dequeue(tid);
+                if (p<enq) {
+                    q->enqueue_bulk(batch_buffer, ltc->tid);
+                }
+                else {
+                    q->dequeue_bulk(batch, tid);
+                }
             }
         }
         return thd_ops[ltc->tid];
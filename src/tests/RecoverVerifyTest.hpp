@@ -113,6 +113,10 @@ int RecoverVerifyTest<K,V>::execute(GlobalTestConfig* gtc, LocalTestConfig* ltc)
     std::cout<<"epochsys flushed."<<std::endl;
     rec->simulate_crash();
     std::cout<<"crashed."<<std::endl;
+    // restart metrics: time from restart until the first operation returns,
+    // and lookup throughput right after it, i.e., while a lazily recovering
+    // rideable is still catching up.
+    begin = chrono::high_resolution_clock::now();
     int rec_cnt = rec->recover(true);
     std::cout<<"recover returned."<<std::endl;
     if (rec_cnt == (int)reference.size()){
@@ -122,12 +126,23 @@ int RecoverVerifyTest<K,V>::execute(GlobalTestConfig* gtc, LocalTestConfig* ltc)
         exit(1);
     }
     
+    bool first = true;
+    auto verify_begin = begin;
     for (auto itr = reference.begin(); itr != reference.end(); itr++){
         if (!m->get(itr->first, tid)){
             std::cout<<"key:"<<itr->first<<"not recovered."<<std::endl;
             exit(1);
         }
+        if (first){
+            first = false;
+            verify_begin = chrono::high_resolution_clock::now();
+            dur = verify_begin - begin;
+            std::cout<<"Time to first operation: "<< std::chrono::duration_cast<std::chrono::microseconds>(dur).count() << "us" <<std::endl;
+        }
     }
+    dur = chrono::high_resolution_clock::now() - verify_begin;
+    auto dur_us = std::chrono::duration_cast<std::chrono::microseconds>(dur).count();
+    std::cout<<"Verified "<<reference.size()<<" keys in "<<dur_us<<"us ("<<(reference.size()*1000.0/(dur_us+1))<<" ops/ms)"<<std::endl;
     std::cout<<"all records recovered."<<std::endl;
     return ops;
 }
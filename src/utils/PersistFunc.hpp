@@ -23,25 +23,140 @@ limitations under the License.
 
 // #include "sysextend.h"
 
+#ifdef NVM_EMULATION
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#endif
+
 namespace persist_func{
+#ifdef NVM_EMULATION
+	// NVM timing model for DRAM-only machines (make nvm-emu). Every line
+	// written back stalls the issuing thread for flush_cost, then holds
+	// the shared write bandwidth for line_time and becomes durable
+	// write_latency later. A fence waits until all lines the thread wrote
+	// back are durable. Issue stalls as well once the write-pending queue
+	// of queue_depth lines ahead of it is full.
+	// Threads reserve bandwidth for batch_lines lines at a time (or for
+	// what they have at a fence) with one CAS, rather than one per line.
+	namespace emulation{
+		inline uint64_t write_latency = 300; // ns
+		inline uint64_t flush_cost = 30; // ns
+		inline uint64_t line_time = 32; // ns, 2000MB/s
+		inline uint64_t queue_depth = 64; // lines
+		inline const uint64_t batch_lines = 16;
+		alignas(CACHE_LINE_SIZE) inline std::atomic<uint64_t> channel_free(0);
+		inline thread_local uint64_t drain_until = 0;
+		// lines written back but not yet given channel time, and when
+		// the first and the last of them were issued.
+		inline thread_local uint64_t batched = 0;
+		inline thread_local uint64_t batch_begin = 0;
+		inline thread_local uint64_t batch_end = 0;
+
+		// bandwidth in MB/s, 0 for unlimited.
+		inline void configure(uint64_t latency_ns, uint64_t flush_ns,
+			uint64_t bandwidth, uint64_t depth){
+			write_latency = latency_ns;
+			flush_cost = flush_ns;
+			line_time = bandwidth == 0 ? 0 : CACHE_LINE_SIZE * 1000 / bandwidth;
+			queue_depth = depth;
+		}
+
+		inline uint64_t now(){
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now().time_since_epoch()).count();
+		}
+
+		inline void spin_until(uint64_t t){
+			while (now() < t);
+		}
+
+		// give the batched lines their channel time, back to back from
+		// when the first was issued. none is durable before it was issued.
+		inline void reserve(){
+			if (batched == 0){
+				return;
+			}
+			uint64_t t = batch_begin;
+			uint64_t len = batched * line_time;
+			uint64_t free = channel_free.load(std::memory_order_relaxed);
+			uint64_t start;
+			do {
+				start = std::max(free, t);
+			} while (!channel_free.compare_exchange_weak(free, start + len,
+				std::memory_order_relaxed));
+			batched = 0;
+			uint64_t done = std::max(start + len, batch_end + line_time);
+			drain_until = std::max(drain_until, done + write_latency);
+			// stall as the last line would have, had it found the queue full.
+			uint64_t last_start = start + len - line_time;
+			uint64_t window = queue_depth * line_time;
+			if (last_start > batch_end + window){
+				spin_until(last_start - window);
+			}
+		}
+
+		inline void writeback(){
+			uint64_t t = now();
+			if (line_time == 0){
+				drain_until = std::max(drain_until, t + write_latency);
+			} else {
+				if (batched == 0){
+					batch_begin = t;
+				}
+				batch_end = t;
+				if (++batched == std::min(batch_lines, queue_depth)){
+					reserve();
+				}
+			}
+			spin_until(t + flush_cost);
+		}
+
+		inline void drain(){
+			reserve();
+			if (drain_until != 0){
+				spin_until(drain_until);
+				drain_until = 0;
+			}
+		}
+	}
+#endif
+
 	inline void clflush(void *p){
 		asm volatile ("clflush (%0)" :: "r"(p));
+#ifdef NVM_EMULATION
+		// clflush is ordered with other writes, so it drains right away.
+		emulation::writeback();
+		emulation::drain();
+#endif
 	}
 
 	inline void clflushopt(void *p){
 		asm volatile ("clflushopt (%0)" :: "r"(p));
+#ifdef NVM_EMULATION
+		emulation::writeback();
+#endif
 	}
 
 	inline void clwb(void *p){
 		asm volatile ("clwb (%0)" :: "r"(p));
+#ifdef NVM_EMULATION
+		emulation::writeback();
+#endif
 	}
 
 	inline void mfence(){
 		asm volatile ("mfence");
+#ifdef NVM_EMULATION
+		emulation::drain();
+#endif
 	}
 
 	inline void sfence(){
 		asm volatile ("sfence");
+#ifdef NVM_EMULATION
+		emulation::drain();
+#endif
 	}
 
 	inline void clflush_range_nofence(void *p, size_t sz){// unit of sz is byte.